@@ -0,0 +1,713 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <sched.h>
+
+#include "usbpiper.h"
+
+struct piperconfig config = {
+  .vendor = 0x1234,
+  .product = 0x5678,
+  .max_size = 0x20000,
+  .splice_threshold = 0x4000, // 0 disables splice()
+  .hotplug = true,
+  .shards = 1,
+  .num_shard_cpus = 0,
+  .shard_map = NULL,
+  .interfaces = 0xffffffff,
+  .interfaces_requested = false,
+  .iso_tds = 16,
+  .iso_packets = 32,
+  .iso_meta = false,
+  .packet_eps = 0,
+  .packet_interrupt = false,
+  .log_level = LOGLEVEL_INFO,
+  .trace_size = 0,
+  .trace_file = "/run/usbpiper.trace",
+  .simulate = false,
+  .loopback = false,
+  .tap_size = 16 << 20,
+  .huge_pages = false,
+  .fifo_size = 0,
+  .fifo_max = 0,
+  .lazy = false,
+  .pool_size = 16 << 20,
+  .td_pool = 0,
+  .td_max = 32,
+  .rt_policy = SCHED_FIFO,
+  .rt_priority = 0,
+  .num_worker_cpus = 0,
+  .mlockall = false,
+  .busy_poll = false,
+  .spin_budget = 0,
+  .ep_rates_set = false,
+  .device_tds = 0,
+};
+
+static void usage(char *prog) {
+  fprintf(stderr,
+	  "Usage: %s [options]\n\n"
+	  "  -d, --device VID:PID        USB device to serve (hex, default %04x:%04x)\n"
+	  "      --no-hotplug            Scan for devices once at startup only\n"
+	  "      --splice-threshold N    Splice CUSE payloads of N bytes and above\n"
+	  "                              (0 = never, default %d)\n"
+	  "      --shards N              Run N event loops in separate threads, each\n"
+	  "                              with its own share of the USB devices\n"
+	  "      --shard-cpus LIST       Pin shard threads to these CPUs, in order\n"
+	  "                              (comma-separated, e.g. 2,3,6,7)\n"
+	  "      --shard-of PATH=N       Serve the device at bus/port PATH in shard N\n"
+	  "                              (default: chosen by a hash of PATH)\n"
+	  "  -i, --interfaces LIST       Claim only these interfaces (comma-separated,\n"
+	  "                              default: all that are free)\n"
+	  "      --alt IF=ALT            Initial alternate setting of interface IF\n"
+	  "      --iso-tds N             TDs queued on isochronous endpoints (default %d)\n"
+	  "      --iso-packets N         Packets per isochronous TD (default %d)\n"
+	  "      --iso-meta              Add a side channel file with per-packet\n"
+	  "                              length, status and timestamp records\n"
+	  "  -p, --packet LIST           Packet mode (one USB transfer per READ or\n"
+	  "                              WRITE) on these endpoints, given as hex\n"
+	  "                              addresses (e.g. 81,02), or \"interrupt\"\n"
+	  "                              for all interrupt endpoints\n"
+	  "      --log-level LEVEL       error, warn, info (default) or debug\n"
+	  "  -v, --verbose               Same as --log-level debug\n"
+	  "      --trace N               Record the last N events of each shard in\n"
+	  "                              a binary trace ring (0 = off, default)\n"
+	  "      --trace-file PATH       Where SIGUSR1 dumps the trace rings\n"
+	  "                              (default %s)\n"
+	  "      --simulate[=PARAMS]     Serve a simulated device with a bulk IN\n"
+	  "                              and a bulk OUT endpoint. PARAMS is a\n"
+	  "                              comma-separated list of bandwidth=BYTES/S,\n"
+	  "                              latency=US, short=N (every Nth IN transfer\n"
+	  "                              is short), error=N (every Nth transfer\n"
+	  "                              fails), unplug=N (after N transfers),\n"
+	  "                              replay=PATH (IN data from a --tap\n"
+	  "                              capture), timing=original|max, loop=1,\n"
+	  "                              ep=ADDR (e.g. 0x83), sink=PATH (OUT data\n"
+	  "                              into a file), compare=PATH (OUT data\n"
+	  "                              against a capture), iso=1 (add an\n"
+	  "                              interface with an isochronous IN\n"
+	  "                              endpoint of two alternate settings)\n"
+	  "      --loopback              Add usbpiper_loop_out and usbpiper_loop_in,\n"
+	  "                              where data written to the first is read\n"
+	  "                              from the second, without USB\n"
+	  "      --tap EP=PATH           Capture the data to / from endpoint EP (hex\n"
+	  "                              address, e.g. 81) into file PATH\n"
+	  "      --tap-size N            Bytes in each capture ring (default 16M)\n"
+	  "      --huge-pages            Back FIFOs and TD buffers with 2 MiB pages\n"
+	  "                              (hugetlbfs if reserved, otherwise THP)\n"
+	  "      --fifo-size [EP=]N      FIFO size of endpoint EP (hex address),\n"
+	  "                              or of all endpoints (default 256k). OUT\n"
+	  "                              FIFOs also get room for one WRITE\n"
+	  "      --fifo-max N            Let FIFOs that keep filling up grow, to\n"
+	  "                              N bytes at most (default: fixed size)\n"
+	  "      --lazy[=POOL]           Allocate FIFOs and TD buffers when a file\n"
+	  "                              is opened, and keep up to POOL bytes of\n"
+	  "                              them for reuse when closed (default 16M)\n"
+	  "      --td-pool N             N spare TDs that busy bulk and interrupt\n"
+	  "                              endpoints borrow (default 0)\n"
+	  "      --td-max N              TDs an endpoint may have with borrowed\n"
+	  "                              ones (default %d)\n"
+	  "      --rt-priority [rr:]N    Run the shards with SCHED_FIFO (or\n"
+	  "                              SCHED_RR) priority N (1-99)\n"
+	  "      --worker-cpus LIST      Pin threads other than the shards (the\n"
+	  "                              capture writer) to these CPUs\n"
+	  "      --mlockall              Lock all memory in RAM, including thread\n"
+	  "                              stacks, which are touched in advance\n"
+	  "      --busy-poll[=US]        Poll for events without sleeping, and\n"
+	  "                              block only after US microseconds\n"
+	  "                              without any (default: never block)\n"
+	  "      --device-tds N          TDs in flight on the bulk and interrupt\n"
+	  "                              endpoints of a device, shared by weight\n"
+	  "                              (default: no limit)\n"
+	  "      --ep-weight EP=W        Share of endpoint EP (hex address) in\n"
+	  "                              --device-tds (default 1)\n"
+	  "      --ep-rate EP=RATE       Cap endpoint EP at RATE bytes/s\n"
+	  "  -h, --help                  This help\n",
+	  prog, config.vendor, config.product, config.splice_threshold,
+	  config.iso_tds, config.iso_packets, config.trace_file, config.td_max);
+}
+
+// Parse an unsigned number, which may have a k, M or G suffix (binary
+// multipliers). Returns 0 on success.
+
+int parse_uint(char *s, unsigned long *val) {
+  char *end;
+  unsigned long v;
+
+  v = strtoul(s, &end, 0);
+
+  if (end == s)
+    return 1;
+
+  switch (*end) {
+  case 'k': case 'K': v <<= 10; end++; break;
+  case 'm': case 'M': v <<= 20; end++; break;
+  case 'g': case 'G': v <<= 30; end++; break;
+  }
+
+  if (*end)
+    return 1;
+
+  *val = v;
+  return 0;
+}
+
+static int parse_cpu_list(char *s, int *cpus, int *num_cpus) {
+  unsigned long cpu;
+  char *tok;
+
+  for (tok = strtok(s, ","); tok; tok = strtok(NULL, ",")) {
+    if (*num_cpus >= MAX_SHARDS) {
+      ERR("Too many CPUs listed (max %d)\n", MAX_SHARDS);
+      return 1;
+    }
+
+    if (parse_uint(tok, &cpu) || (cpu >= CPU_SETSIZE)) {
+      ERR("Invalid CPU number \"%s\"\n", tok);
+      return 1;
+    }
+
+    cpus[(*num_cpus)++] = cpu;
+  }
+
+  return 0;
+}
+
+static int parse_shard_map(char *s) {
+  struct pipershardmap *entry;
+  unsigned long shard;
+  char *eq = strchr(s, '=');
+
+  if (!eq || (eq == s) || parse_uint(eq + 1, &shard)) {
+    ERR("Invalid shard assignment \"%s\", expected PATH=N\n", s);
+    return 1;
+  }
+
+  if (!(entry = malloc(sizeof(*entry)))) {
+    ERR("Failed to allocate memory for shard assignment\n");
+    return 1;
+  }
+
+  *eq = 0;
+  entry->path = s; // Points into argv, which stays around
+  entry->shard = shard;
+  entry->next = config.shard_map;
+  config.shard_map = entry;
+
+  return 0;
+}
+
+static int parse_interface_list(char *s) {
+  unsigned long num;
+  char *tok;
+
+  config.interfaces = 0;
+  config.interfaces_requested = true;
+
+  for (tok = strtok(s, ","); tok; tok = strtok(NULL, ",")) {
+    if (parse_uint(tok, &num) || (num >= 32)) {
+      ERR("Invalid interface number \"%s\"\n", tok);
+      return 1;
+    }
+
+    config.interfaces |= 1 << num;
+  }
+
+  return 0;
+}
+
+static int parse_alt(char *s) {
+  unsigned long num, alt;
+  char *eq = strchr(s, '=');
+
+  if (!eq)
+    goto err;
+
+  *eq = 0;
+
+  if (parse_uint(s, &num) || (num >= 32) || parse_uint(eq + 1, &alt) ||
+      (alt > 255))
+    goto err;
+
+  config.alt[num] = alt;
+  return 0;
+
+ err:
+  ERR("Invalid alternate setting assignment, expected IF=ALT\n");
+  return 1;
+}
+
+static int parse_packet_list(char *s) {
+  unsigned int addr;
+  char *tok, *end;
+
+  for (tok = strtok(s, ","); tok; tok = strtok(NULL, ",")) {
+    if (!strcmp(tok, "interrupt")) {
+      config.packet_interrupt = true;
+      continue;
+    }
+
+    addr = strtoul(tok, &end, 16);
+
+    if ((end == tok) || *end || (addr & 0x70) || (addr > 0xff)) {
+      ERR("Invalid endpoint address \"%s\"\n", tok);
+      return 1;
+    }
+
+    config.packet_eps |= ep_bit(addr);
+  }
+
+  return 0;
+}
+
+// "--fifo-size 81=4M" for one endpoint, or "--fifo-size 4M" for all
+
+static int parse_fifo_size(char *s) {
+  unsigned long size;
+  unsigned int addr;
+  char *eq = strchr(s, '=');
+  char *end;
+
+  if (parse_uint(eq ? eq + 1 : s, &size) || (size < 1024) ||
+      (size > FIFO_SIZE_MAX))
+    goto err;
+
+  if (!eq) {
+    config.fifo_size = size;
+    return 0;
+  }
+
+  *eq = 0;
+  addr = strtoul(s, &end, 16);
+  *eq = '=';
+
+  if ((eq == s) || (end != eq) || (addr & 0x70) || (addr > 0xff))
+    goto err;
+
+  config.fifo_sizes[ep_index(addr)] = size;
+  return 0;
+
+ err:
+  ERR("Invalid FIFO size \"%s\", expected [EP=]SIZE, 1k to 1G\n", s);
+  return 1;
+}
+
+static int parse_tap(char *s) {
+  unsigned int addr;
+  char *eq = strchr(s, '=');
+  char *end;
+
+  if (!eq || (eq == s) || !eq[1])
+    goto err;
+
+  *eq = 0;
+  addr = strtoul(s, &end, 16);
+
+  if (*end || (addr & 0x70) || (addr > 0xff))
+    goto err;
+
+  config.tap_files[ep_index(addr)] = eq + 1; // Points into argv
+  return 0;
+
+ err:
+  ERR("Invalid tap \"%s\", expected EP=PATH\n", s);
+  return 1;
+}
+
+// "81=VALUE" as with --ep-weight and --ep-rate. Returns 0 on success.
+
+static int parse_ep_value(char *s, unsigned int *addr, unsigned long *val) {
+  char *eq = strchr(s, '=');
+  char *end;
+
+  if (!eq || (eq == s) || parse_uint(eq + 1, val))
+    return 1;
+
+  *addr = strtoul(s, &end, 16);
+
+  return (end != eq) || (*addr & 0x70) || (*addr > 0xff);
+}
+
+// "--rt-priority 50" for SCHED_FIFO, "--rt-priority rr:50" for SCHED_RR
+
+static int parse_rt_priority(char *s) {
+  unsigned long prio;
+  int policy = SCHED_FIFO;
+  char *arg = s;
+
+  if (!strncmp(s, "fifo:", 5)) {
+    s += 5;
+  } else if (!strncmp(s, "rr:", 3)) {
+    policy = SCHED_RR;
+    s += 3;
+  }
+
+  if (parse_uint(s, &prio) || (prio < sched_get_priority_min(policy)) ||
+      (prio > sched_get_priority_max(policy))) {
+    ERR("Invalid realtime priority \"%s\", expected [fifo:|rr:]N (1-99)\n",
+	arg);
+    return 1;
+  }
+
+  config.rt_policy = policy;
+  config.rt_priority = prio;
+  return 0;
+}
+
+static int parse_log_level(char *s) {
+  static const char *names[] = { "error", "warn", "info", "debug" };
+  int i;
+
+  for (i=0; i<4; i++)
+    if (!strcmp(s, names[i])) {
+      config.log_level = i;
+      return 0;
+    }
+
+  ERR("Invalid log level \"%s\"\n", s);
+  return 1;
+}
+
+int parse_options(int argc, char **argv) {
+  enum {
+    OPT_NO_HOTPLUG = 0x100,
+    OPT_SPLICE_THRESHOLD,
+    OPT_SHARDS,
+    OPT_SHARD_CPUS,
+    OPT_SHARD_OF,
+    OPT_ALT,
+    OPT_ISO_TDS,
+    OPT_ISO_PACKETS,
+    OPT_ISO_META,
+    OPT_LOG_LEVEL,
+    OPT_TRACE,
+    OPT_TRACE_FILE,
+    OPT_SIMULATE,
+    OPT_LOOPBACK,
+    OPT_TAP,
+    OPT_TAP_SIZE,
+    OPT_HUGE_PAGES,
+    OPT_FIFO_SIZE,
+    OPT_FIFO_MAX,
+    OPT_LAZY,
+    OPT_TD_POOL,
+    OPT_TD_MAX,
+    OPT_RT_PRIORITY,
+    OPT_WORKER_CPUS,
+    OPT_MLOCKALL,
+    OPT_BUSY_POLL,
+    OPT_DEVICE_TDS,
+    OPT_EP_WEIGHT,
+    OPT_EP_RATE,
+  };
+
+  static const struct option long_options[] = {
+    { "device", required_argument, NULL, 'd' },
+    { "no-hotplug", no_argument, NULL, OPT_NO_HOTPLUG },
+    { "splice-threshold", required_argument, NULL, OPT_SPLICE_THRESHOLD },
+    { "shards", required_argument, NULL, OPT_SHARDS },
+    { "shard-cpus", required_argument, NULL, OPT_SHARD_CPUS },
+    { "shard-of", required_argument, NULL, OPT_SHARD_OF },
+    { "interfaces", required_argument, NULL, 'i' },
+    { "alt", required_argument, NULL, OPT_ALT },
+    { "iso-tds", required_argument, NULL, OPT_ISO_TDS },
+    { "iso-packets", required_argument, NULL, OPT_ISO_PACKETS },
+    { "iso-meta", no_argument, NULL, OPT_ISO_META },
+    { "packet", required_argument, NULL, 'p' },
+    { "log-level", required_argument, NULL, OPT_LOG_LEVEL },
+    { "verbose", no_argument, NULL, 'v' },
+    { "trace", required_argument, NULL, OPT_TRACE },
+    { "trace-file", required_argument, NULL, OPT_TRACE_FILE },
+    { "simulate", optional_argument, NULL, OPT_SIMULATE },
+    { "loopback", no_argument, NULL, OPT_LOOPBACK },
+    { "tap", required_argument, NULL, OPT_TAP },
+    { "tap-size", required_argument, NULL, OPT_TAP_SIZE },
+    { "huge-pages", no_argument, NULL, OPT_HUGE_PAGES },
+    { "fifo-size", required_argument, NULL, OPT_FIFO_SIZE },
+    { "fifo-max", required_argument, NULL, OPT_FIFO_MAX },
+    { "lazy", optional_argument, NULL, OPT_LAZY },
+    { "td-pool", required_argument, NULL, OPT_TD_POOL },
+    { "td-max", required_argument, NULL, OPT_TD_MAX },
+    { "rt-priority", required_argument, NULL, OPT_RT_PRIORITY },
+    { "worker-cpus", required_argument, NULL, OPT_WORKER_CPUS },
+    { "mlockall", no_argument, NULL, OPT_MLOCKALL },
+    { "busy-poll", optional_argument, NULL, OPT_BUSY_POLL },
+    { "device-tds", required_argument, NULL, OPT_DEVICE_TDS },
+    { "ep-weight", required_argument, NULL, OPT_EP_WEIGHT },
+    { "ep-rate", required_argument, NULL, OPT_EP_RATE },
+    { "help", no_argument, NULL, 'h' },
+    { }
+  };
+
+  int c;
+  unsigned int vid, pid, addr;
+  unsigned long val;
+
+  while ((c = getopt_long(argc, argv, "d:i:p:vh", long_options, NULL)) != -1) {
+    switch (c) {
+    case 'd':
+      if ((sscanf(optarg, "%x:%x", &vid, &pid) != 2) ||
+	  (vid > 0xffff) || (pid > 0xffff)) {
+	ERR("Invalid device ID \"%s\", expected VID:PID in hex\n", optarg);
+	return 1;
+      }
+      config.vendor = vid;
+      config.product = pid;
+      break;
+
+    case OPT_NO_HOTPLUG:
+      config.hotplug = false;
+      break;
+
+    case OPT_SPLICE_THRESHOLD:
+      if (parse_uint(optarg, &val) || (val > config.max_size)) {
+	ERR("Invalid splice threshold \"%s\"\n", optarg);
+	return 1;
+      }
+      config.splice_threshold = val;
+      break;
+
+    case OPT_SHARDS:
+      if (parse_uint(optarg, &val) || (val < 1) || (val > MAX_SHARDS)) {
+	ERR("Invalid number of shards \"%s\" (1 to %d)\n",
+	    optarg, MAX_SHARDS);
+	return 1;
+      }
+      config.shards = val;
+      break;
+
+    case OPT_SHARD_CPUS:
+      if (parse_cpu_list(optarg, config.shard_cpus, &config.num_shard_cpus))
+	return 1;
+      break;
+
+    case OPT_SHARD_OF:
+      if (parse_shard_map(optarg))
+	return 1;
+      break;
+
+    case 'i':
+      if (parse_interface_list(optarg))
+	return 1;
+      break;
+
+    case OPT_ALT:
+      if (parse_alt(optarg))
+	return 1;
+      break;
+
+    case OPT_ISO_TDS:
+      if (parse_uint(optarg, &val) || (val < 1) || (val > 1024)) {
+	ERR("Invalid number of isochronous TDs \"%s\"\n", optarg);
+	return 1;
+      }
+      config.iso_tds = val;
+      break;
+
+    case OPT_ISO_PACKETS:
+      if (parse_uint(optarg, &val) || (val < 1) || (val > 1024)) {
+	ERR("Invalid number of isochronous packets \"%s\"\n", optarg);
+	return 1;
+      }
+      config.iso_packets = val;
+      break;
+
+    case OPT_ISO_META:
+      config.iso_meta = true;
+      break;
+
+    case 'p':
+      if (parse_packet_list(optarg))
+	return 1;
+      break;
+
+    case OPT_LOG_LEVEL:
+      if (parse_log_level(optarg))
+	return 1;
+      break;
+
+    case 'v':
+      config.log_level = LOGLEVEL_DEBUG;
+      break;
+
+    case OPT_TRACE:
+      if (parse_uint(optarg, &val) || (val > (1 << 24))) {
+	ERR("Invalid trace ring size \"%s\"\n", optarg);
+	return 1;
+      }
+
+      // Round up to a power of two
+      for (config.trace_size = val ? 1 : 0;
+	   config.trace_size < val; config.trace_size <<= 1)
+	;
+      break;
+
+    case OPT_TRACE_FILE:
+      config.trace_file = optarg;
+      break;
+
+    case OPT_SIMULATE:
+      config.simulate = true;
+
+      if (optarg && parse_sim_options(optarg))
+	return 1;
+      break;
+
+    case OPT_LOOPBACK:
+      config.loopback = true;
+      break;
+
+    case OPT_TAP:
+      if (parse_tap(optarg))
+	return 1;
+      break;
+
+    case OPT_TAP_SIZE:
+      if (parse_uint(optarg, &val) || (val < (1 << 20)) || (val > (1 << 30))) {
+	ERR("Invalid capture ring size \"%s\" (1M to 1G)\n", optarg);
+	return 1;
+      }
+
+      // Round up to a power of two
+      for (config.tap_size = 1; config.tap_size < val; config.tap_size <<= 1)
+	;
+      break;
+
+    case OPT_HUGE_PAGES:
+      config.huge_pages = true;
+      break;
+
+    case OPT_FIFO_SIZE:
+      if (parse_fifo_size(optarg))
+	return 1;
+      break;
+
+    case OPT_FIFO_MAX:
+      if (parse_uint(optarg, &val) || (val > FIFO_SIZE_MAX)) {
+	ERR("Invalid maximal FIFO size \"%s\"\n", optarg);
+	return 1;
+      }
+
+      config.fifo_max = val;
+      break;
+
+    case OPT_LAZY:
+      config.lazy = true;
+
+      if (optarg) {
+	if (parse_uint(optarg, &val)) {
+	  ERR("Invalid pool size \"%s\"\n", optarg);
+	  return 1;
+	}
+
+	config.pool_size = val;
+      }
+      break;
+
+    case OPT_TD_POOL:
+      if (parse_uint(optarg, &val) || (val > 65536)) {
+	ERR("Invalid number of spare TDs \"%s\"\n", optarg);
+	return 1;
+      }
+
+      config.td_pool = val;
+      break;
+
+    case OPT_TD_MAX:
+      if (parse_uint(optarg, &val) || (val < 1) || (val > 1024)) {
+	ERR("Invalid number of TDs \"%s\" (1 to 1024)\n", optarg);
+	return 1;
+      }
+
+      config.td_max = val;
+      break;
+
+    case OPT_RT_PRIORITY:
+      if (parse_rt_priority(optarg))
+	return 1;
+      break;
+
+    case OPT_WORKER_CPUS:
+      if (parse_cpu_list(optarg, config.worker_cpus,
+			 &config.num_worker_cpus))
+	return 1;
+      break;
+
+    case OPT_MLOCKALL:
+      config.mlockall = true;
+      break;
+
+    case OPT_BUSY_POLL:
+      config.busy_poll = true;
+
+      if (optarg) {
+	if (parse_uint(optarg, &val) || (val > 10000000)) {
+	  ERR("Invalid spin budget \"%s\" (microseconds, up to 10 s)\n",
+	      optarg);
+	  return 1;
+	}
+
+	config.spin_budget = val * 1000;
+      }
+      break;
+
+    case OPT_DEVICE_TDS:
+      if (parse_uint(optarg, &val) || (val < 1) || (val > 4096)) {
+	ERR("Invalid number of TDs per device \"%s\" (1 to 4096)\n", optarg);
+	return 1;
+      }
+
+      config.device_tds = val;
+      break;
+
+    case OPT_EP_WEIGHT:
+      if (parse_ep_value(optarg, &addr, &val) || (val < 1) || (val > 1000)) {
+	ERR("Invalid endpoint weight \"%s\", expected EP=W, 1 to 1000\n",
+	    optarg);
+	return 1;
+      }
+
+      config.ep_weights[ep_index(addr)] = val;
+      break;
+
+    case OPT_EP_RATE:
+      if (parse_ep_value(optarg, &addr, &val) || (val < 1024) ||
+	  (val > (4UL << 30))) {
+	ERR("Invalid endpoint rate \"%s\", expected EP=RATE, 1k to 4G\n",
+	    optarg);
+	return 1;
+      }
+
+      config.ep_rates[ep_index(addr)] = val;
+      config.ep_rates_set = true;
+      break;
+
+    case 'h':
+      usage(argv[0]);
+      exit(0);
+
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  struct pipershardmap *entry;
+
+  for (entry = config.shard_map; entry; entry = entry->next)
+    if (entry->shard >= config.shards) {
+      ERR("Device %s assigned to shard %d, but there are only %d shards\n",
+	  entry->path, entry->shard, config.shards);
+      return 1;
+    }
+
+  if (optind < argc) {
+    ERR("Unexpected argument \"%s\"\n", argv[optind]);
+    usage(argv[0]);
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,1555 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "usbpiper.h"
+#include "cuse.h"
+#include "tap.h"
+
+// cuse-harness plays the kernel's part of the CUSE protocol towards
+// devfile.c, so that the request / completion state machine can be tested
+// and benchmarked without /dev/cuse or root. Each device file is served
+// over a socketpair (SOCK_SEQPACKET keeps each request and each response a
+// message of its own, like /dev/cuse), and the harness runs the daemon's
+// event loop itself, in a single thread. Behind the device files are the
+// simulated USB device and the loopback files.
+//
+// First a script of requests is played, each with its expected response.
+// Then a random stream of OPEN, READ, WRITE, INTERRUPT and RELEASE requests
+// is sent as fast as the daemon takes them. All responses are checked for
+// protocol correctness, and the data for integrity.
+//
+// Some features are tested in modes of their own, each with its own
+// script instead of the usual one:
+//
+// With --packet, the simulated bulk endpoints are in packet mode. Every IN
+// transfer is short then (short=1), so all messages have the same length,
+// which isn't a multiple of the counter's period, and a message that isn't
+// discarded properly shows. The OUT endpoint is capped at PACKET_OUT_RATE,
+// so that WRITEs block on a full FIFO.
+//
+// With --sched, the simulated device may have two TDs in flight, each of
+// which takes 1 ms, and its IN endpoint is capped at SCHED_IN_RATE.
+//
+// With --grow, FIFOs may grow up to 64 MiB.
+//
+// With --capture, the simulated endpoints are tapped, and the capture is
+// checked after the random stream. The options after "--" are the
+// daemon's, e.g. --lazy or --td-pool for the random stream.
+
+#define MAX_FILES 32
+#define MAX_PENDING 4
+#define MAX_FAILURES 20
+#define PACKET_OUT_RATE 65536 // Bytes/s, one TD per second
+#define SCHED_IN_RATE (8 << 20) // Bytes/s
+#define CAPTURE_WAIT_US 500000 // For the capture writer to catch up
+
+enum { ROLE_NONE, ROLE_LOOP_OUT, ROLE_LOOP_IN, ROLE_SIM_IN, ROLE_SIM_OUT,
+       ROLE_STATS, ROLE_SIM_ISO, ROLE_SIM_IF, ROLE_SIM_META };
+
+static const char *role_names[] = { "other", "loop_out", "loop_in",
+				    "sim_in", "sim_out", "stats", "sim_iso",
+				    "sim_if", "sim_meta" };
+
+struct hreq {
+  uint64_t unique;
+  uint32_t opcode;
+  uint32_t size; // Of READ and WRITE
+  boolean interrupted;
+};
+
+struct hfile {
+  char *name;
+  int fd; // The kernel's end of the socketpair
+  int role;
+  boolean open;
+  boolean synced; // Simulated IN: The counter's phase is known
+  uint8_t next_byte; // Simulated IN: The counter's next value
+  uint64_t pos; // Loopback: Bytes accepted (OUT) or received (IN)
+  uint32_t msg_len; // Packet mode IN: Length of the messages, 0 = unknown
+  struct hreq pending[MAX_PENDING];
+  int num_pending;
+  uint64_t last_unique; // The most recent request, except INTERRUPT
+  uint32_t last_size;
+
+  // The most recent completion
+  uint64_t done_unique;
+  int32_t done_error;
+  uint32_t done_count;
+};
+
+static struct hfile files[MAX_FILES];
+static int num_files;
+static int pollfd;
+
+static uint64_t next_unique = 2; // Odd values are for INTERRUPT requests
+static unsigned char *txbuf, *rxbuf, *expectbuf;
+static unsigned int bufsize;
+static char *stats_text; // From the most recent READ of the stats file
+static int failures;
+static enum { MODE_DEFAULT, MODE_PACKET, MODE_SCHED, MODE_GROW } mode;
+
+static struct {
+  unsigned long requests;
+  unsigned long opcodes[5]; // OPEN, READ, WRITE, INTERRUPT, RELEASE
+  uint64_t bytes_read, bytes_written;
+} counts;
+
+static uint64_t rng_state = 1;
+
+static uint32_t rnd(void) {
+  uint64_t x = rng_state;
+
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  rng_state = x;
+
+  return x >> 16;
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void fail(struct hfile *f, const char *fmt, ...)
+  __attribute__ ((format (printf, 2, 3)));
+
+static void fail(struct hfile *f, const char *fmt, ...) {
+  va_list ap;
+
+  if (++failures > MAX_FAILURES)
+    return;
+
+  fprintf(stderr, "%s: ", f ? f->name : "harness");
+
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+
+  if (failures == MAX_FAILURES)
+    fprintf(stderr, "(Further failures are not shown)\n");
+}
+
+static void fatal(const char *msg) {
+  fprintf(stderr, "Fatal: %s\n", msg);
+  exit(2);
+}
+
+// The loopback stream: Each 64-bit word is a function of its position, so
+// that both lost and repeated data are detected.
+
+static inline uint64_t pattern_word(uint64_t index) {
+  return (index + 1) * 0x9e3779b97f4a7c15ULL;
+}
+
+static void pattern_fill(unsigned char *buf, uint64_t pos, unsigned int len) {
+  uint64_t w;
+
+  while (len) {
+    unsigned int offset = pos & 7;
+    unsigned int n = 8 - offset;
+
+    if (n > len)
+      n = len;
+
+    w = pattern_word(pos >> 3);
+    memcpy(buf, (unsigned char *) &w + offset, n);
+
+    buf += n;
+    pos += n;
+    len -= n;
+  }
+}
+
+// The function that devfile_init() calls instead of opening /dev/cuse
+
+static int harness_open_cuse(char *name) {
+  int sndbuf = 4 << 20; // Silently capped by the kernel
+  struct hfile *f;
+  int fds[2];
+
+  if (num_files >= MAX_FILES) {
+    ERR("Too many device files for the harness\n");
+    return -1;
+  }
+
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds)) {
+    perror("socketpair");
+    return -1;
+  }
+
+  setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+  setsockopt(fds[1], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+  f = &files[num_files++];
+  memset(f, 0, sizeof(*f));
+
+  f->name = strdup(name);
+  f->fd = fds[1];
+
+  if (!strcmp(name, "usbpiper_loop_out"))
+    f->role = ROLE_LOOP_OUT;
+  else if (!strcmp(name, "usbpiper_loop_in"))
+    f->role = ROLE_LOOP_IN;
+  else if (!strcmp(name, "usbpiper_stats"))
+    f->role = ROLE_STATS;
+  else if (strstr(name, "_bulk_in_"))
+    f->role = ROLE_SIM_IN;
+  else if (strstr(name, "_bulk_out_"))
+    f->role = ROLE_SIM_OUT;
+  else if (strstr(name, "_iso_in_") && strstr(name, "_meta"))
+    f->role = ROLE_SIM_META;
+  else if (strstr(name, "_iso_in_"))
+    f->role = ROLE_SIM_ISO;
+  else if (strstr(name, "_if01"))
+    f->role = ROLE_SIM_IF;
+
+  return fds[0];
+}
+
+static boolean is_writer(struct hfile *f) {
+  return (f->role == ROLE_LOOP_OUT) || (f->role == ROLE_SIM_OUT);
+}
+
+static struct hfile *file_of(int role) {
+  int i;
+
+  for (i=0; i<num_files; i++)
+    if (files[i].role == role)
+      return &files[i];
+
+  return NULL;
+}
+
+static struct hreq *find_pending(struct hfile *f, uint64_t unique) {
+  int i;
+
+  for (i=0; i<f->num_pending; i++)
+    if (f->pending[i].unique == unique)
+      return &f->pending[i];
+
+  return NULL;
+}
+
+static boolean is_pending(struct hfile *f, uint64_t unique) {
+  return find_pending(f, unique) != NULL;
+}
+
+// The side channel's records must refer to the main file's stream without
+// gaps, and can't be behind what has been read from it already, as only
+// packets that arrive after its OPEN are recorded
+
+static void check_records(struct hfile *f, unsigned char *data,
+			  unsigned int len) {
+  struct hfile *main = file_of(ROLE_SIM_ISO);
+  struct piperisorecord rec;
+  unsigned int i;
+
+  if (len % sizeof(rec)) {
+    fail(f, "READ of %u bytes isn't a whole number of records\n", len);
+    return;
+  }
+
+  for (i=0; i<len; i += sizeof(rec)) {
+    memcpy(&rec, data + i, sizeof(rec));
+
+    if (!f->synced) {
+      if (main && (rec.offset < main->pos))
+	fail(f, "First record at stream offset %llu, but %llu bytes "
+	     "were read before\n", (unsigned long long) rec.offset,
+	     (unsigned long long) main->pos);
+
+      f->pos = rec.offset;
+      f->synced = true;
+    }
+
+    if (rec.offset != f->pos)
+      fail(f, "Record at stream offset %llu, expected %llu\n",
+	   (unsigned long long) rec.offset, (unsigned long long) f->pos);
+
+    f->pos = rec.offset + rec.length;
+  }
+}
+
+// In packet mode, each READ returns one message, which continues the
+// counter where the previous message ended. A message that filled the
+// READ's buffer may have been cut short, so it's taken to be as long as the
+// last one that didn't.
+
+static void check_message(struct hfile *f, unsigned char *data,
+			  unsigned int len, uint32_t size) {
+  uint8_t first = data[0];
+  unsigned int i;
+
+  if (f->synced && (first != f->next_byte))
+    fail(f, "Message starts at counter %d, expected %d\n", first,
+	 f->next_byte);
+
+  for (i=1; i<len; i++)
+    if (data[i] != (uint8_t) (first + i)) {
+      fail(f, "Counter skipped within a message, at byte %u\n", i);
+      break;
+    }
+
+  if (len < size)
+    f->msg_len = len;
+
+  f->synced = (f->msg_len != 0);
+  f->next_byte = first + f->msg_len;
+}
+
+static void check_data(struct hfile *f, unsigned char *data,
+		       unsigned int len, uint32_t size) {
+  unsigned int i;
+
+  switch (f->role) {
+  case ROLE_LOOP_IN:
+    pattern_fill(expectbuf, f->pos, len);
+
+    if (memcmp(data, expectbuf, len)) {
+      for (i=0; data[i] == expectbuf[i]; i++)
+	;
+
+      fail(f, "Wrong data at stream position %llu\n",
+	   (unsigned long long) f->pos + i);
+    }
+
+    f->pos += len;
+    break;
+
+  case ROLE_SIM_META:
+    check_records(f, data, len);
+    break;
+
+  case ROLE_STATS:
+    memcpy(stats_text, data, len);
+    stats_text[len] = 0;
+    break;
+
+  case ROLE_SIM_ISO:
+    f->pos += len;
+    // Fall through
+
+  case ROLE_SIM_IN:
+    if ((mode == MODE_PACKET) && len) {
+      check_message(f, data, len, size);
+      break;
+    }
+
+    if (!f->synced && len) {
+      f->next_byte = data[0];
+      f->synced = true;
+    }
+
+    for (i=0; i<len; i++)
+      if (data[i] != f->next_byte++) {
+	fail(f, "Counter skipped from %d to %d\n",
+	     (uint8_t) (f->next_byte - 1), data[i]);
+	f->next_byte = data[i] + 1;
+      }
+    break;
+  }
+}
+
+static void check_response(struct hfile *f, unsigned char *buf, int len) {
+  struct fuse_out_header *h = (void *) buf;
+  unsigned int payload = len - sizeof(*h);
+  struct hreq *r, req;
+  uint32_t count = 0;
+
+  if ((len < sizeof(*h)) || (h->len != len)) {
+    fail(f, "Response of %d bytes, with %u in its header\n",
+	 len, (len < sizeof(*h)) ? 0 : h->len);
+    return;
+  }
+
+  if (!(r = find_pending(f, h->unique))) {
+    fail(f, "Response to unknown or completed request %llu\n",
+	 (unsigned long long) h->unique);
+    return;
+  }
+
+  req = *r;
+  *r = f->pending[--f->num_pending];
+
+  if ((h->error > 0) || (h->error < -4095))
+    fail(f, "Invalid error %d in response\n", h->error);
+
+  if (h->error && payload)
+    fail(f, "Error response (%d) with %u bytes of payload\n",
+	 h->error, payload);
+
+  if ((h->error == -EINTR) && !req.interrupted)
+    fail(f, "-EINTR on a request that wasn't interrupted\n");
+
+  if (h->error)
+    goto done;
+
+  switch (req.opcode) {
+  case CUSE_INIT: {
+    struct cuse_init_out *out = (void *) &h[1];
+    char *devname = (char *) &out[1];
+    unsigned int namelen = payload - sizeof(*out);
+
+    if ((payload < sizeof(*out) + 1) || (out->major != 7) ||
+	(out->minor < 21) || (out->max_read != config.max_size) ||
+	(out->max_write != config.max_size) ||
+	(devname[namelen - 1] != 0) ||
+	strncmp(devname, "DEVNAME=", 8) ||
+	strcmp(devname + 8, f->name))
+      fail(f, "Malformed response to CUSE_INIT\n");
+    break;
+  }
+
+  case FUSE_OPEN:
+    if (payload != sizeof(struct fuse_open_out))
+      fail(f, "Response to OPEN with %u bytes of payload\n", payload);
+
+    f->open = true;
+    f->synced = false;
+
+    if (f->role == ROLE_SIM_ISO) // Its stream offsets start anew
+      f->pos = 0;
+    break;
+
+  case FUSE_READ:
+    count = payload;
+
+    if (count > req.size)
+      fail(f, "READ of %u bytes returned %u\n", req.size, count);
+    else if (!count && (f->role != ROLE_STATS))
+      fail(f, "READ returned no data\n");
+
+    check_data(f, &buf[sizeof(*h)], count, req.size);
+    counts.bytes_read += count;
+    break;
+
+  case FUSE_WRITE: {
+    struct fuse_write_out *out = (void *) &h[1];
+
+    if (payload != sizeof(*out)) {
+      fail(f, "Response to WRITE with %u bytes of payload\n", payload);
+      break;
+    }
+
+    count = out->size;
+
+    if ((count > req.size) || ((count < req.size) && !req.interrupted))
+      fail(f, "WRITE of %u bytes returned %u\n", req.size, count);
+
+    if ((f->role == ROLE_LOOP_OUT) || (f->role == ROLE_SIM_OUT))
+      f->pos += count;
+
+    counts.bytes_written += count;
+    break;
+  }
+
+  case FUSE_RELEASE:
+    f->open = false;
+    // Fall through
+
+  default:
+    if (payload)
+      fail(f, "Response to opcode %u with %u bytes of payload\n",
+	   req.opcode, payload);
+  }
+
+ done:
+  if ((req.opcode == FUSE_RELEASE) && (h->error == -EINTR))
+    f->open = false;
+
+  f->done_unique = req.unique;
+  f->done_error = h->error;
+  f->done_count = count;
+}
+
+static void collect(struct hfile *f) {
+  int len;
+
+  while (1) {
+    len = recv(f->fd, rxbuf, bufsize, MSG_DONTWAIT | MSG_TRUNC);
+
+    if (len < 0) {
+      if ((errno == EAGAIN) || (errno == EINTR))
+	return;
+
+      perror("recv");
+      fatal("Failed to receive response");
+    }
+
+    if (len > bufsize) {
+      fail(f, "Response of %d bytes is larger than any legal one\n", len);
+      continue;
+    }
+
+    check_response(f, rxbuf, len);
+  }
+}
+
+// One round of the daemon's event loop (see eventloop() in usbpiper.c),
+// followed by collecting the responses.
+
+static void step(int timeout_ms) {
+  struct epoll_event events[16];
+  int num, i;
+
+  num = epoll_wait(pollfd, events, 16, timeout_ms);
+
+  if ((num < 0) && (errno != EINTR)) {
+    perror("epoll_wait");
+    fatal("Event loop failed");
+  }
+
+  for (i=0; i<num; i++) {
+    struct pipercallback *c = events[i].data.ptr;
+
+    if ((*c->callback)(events[i].events, c->private))
+      fatal("A callback failed, which makes the daemon quit");
+  }
+
+  if (usb_process_devices())
+    fatal("usb_process_devices() failed, which makes the daemon quit");
+
+  for (i=0; i<num_files; i++)
+    collect(&files[i]);
+}
+
+// Send a request, whose argument (of @arglen bytes) and payload (of
+// @paylen bytes) are already in place after the header in txbuf.
+
+static uint64_t send_request(struct hfile *f, uint32_t opcode,
+			     unsigned int arglen, unsigned int paylen,
+			     uint32_t size) {
+  struct fuse_in_header *inh = (void *) txbuf;
+  uint64_t unique = next_unique;
+  int rc;
+
+  if (opcode != FUSE_INTERRUPT) {
+    struct hreq *r;
+
+    if (f->num_pending >= MAX_PENDING)
+      fatal("Too many pending requests on a file");
+
+    next_unique += 2;
+
+    r = &f->pending[f->num_pending++];
+    r->unique = unique;
+    r->opcode = opcode;
+    r->size = size;
+    r->interrupted = false;
+
+    f->last_unique = unique;
+    f->last_size = size;
+  } else {
+    unique = ((struct fuse_interrupt_in *) &inh[1])->unique | 1;
+  }
+
+  memset(inh, 0, sizeof(*inh));
+  inh->len = sizeof(*inh) + arglen + paylen;
+  inh->opcode = opcode;
+  inh->unique = unique;
+  inh->pid = getpid();
+
+  while ((rc = send(f->fd, txbuf, inh->len, MSG_DONTWAIT)) < 0) {
+    if (errno != EAGAIN) {
+      perror("send");
+      fatal("Failed to send request");
+    }
+
+    step(1); // The daemon hasn't caught up yet
+  }
+
+  counts.requests++;
+
+  return unique;
+}
+
+static uint64_t send_init(struct hfile *f) {
+  struct cuse_init_in *arg = (void *) (txbuf + sizeof(struct fuse_in_header));
+
+  memset(arg, 0, sizeof(*arg));
+  arg->major = 7;
+  arg->minor = 31;
+
+  return send_request(f, CUSE_INIT, sizeof(*arg), 0, 0);
+}
+
+static uint64_t send_open(struct hfile *f, int flags) {
+  struct fuse_open_in *arg = (void *) (txbuf + sizeof(struct fuse_in_header));
+
+  memset(arg, 0, sizeof(*arg));
+  arg->flags = flags;
+
+  counts.opcodes[0]++;
+  return send_request(f, FUSE_OPEN, sizeof(*arg), 0, 0);
+}
+
+static uint64_t send_read(struct hfile *f, uint32_t size) {
+  struct fuse_read_in *arg = (void *) (txbuf + sizeof(struct fuse_in_header));
+
+  memset(arg, 0, sizeof(*arg));
+  arg->size = size;
+
+  counts.opcodes[1]++;
+  return send_request(f, FUSE_READ, sizeof(*arg), 0, size);
+}
+
+// Payload from @text if non-NULL, otherwise from the loopback pattern
+
+static uint64_t send_write(struct hfile *f, uint32_t size, const char *text) {
+  struct fuse_write_in *arg = (void *) (txbuf + sizeof(struct fuse_in_header));
+
+  memset(arg, 0, sizeof(*arg));
+  arg->size = size;
+
+  if (text)
+    memcpy(&arg[1], text, size);
+  else
+    pattern_fill((unsigned char *) &arg[1], f->pos, size);
+
+  counts.opcodes[2]++;
+  return send_request(f, FUSE_WRITE, sizeof(*arg), size, size);
+}
+
+static void send_interrupt(struct hfile *f, uint64_t unique) {
+  struct fuse_interrupt_in *arg =
+    (void *) (txbuf + sizeof(struct fuse_in_header));
+  struct hreq *r = find_pending(f, unique);
+
+  if (r)
+    r->interrupted = true;
+
+  arg->unique = unique;
+
+  counts.opcodes[3]++;
+  send_request(f, FUSE_INTERRUPT, sizeof(*arg), 0, 0);
+}
+
+static uint64_t send_release(struct hfile *f) {
+  struct fuse_release_in *arg =
+    (void *) (txbuf + sizeof(struct fuse_in_header));
+
+  memset(arg, 0, sizeof(*arg));
+
+  counts.opcodes[4]++;
+  return send_request(f, FUSE_RELEASE, sizeof(*arg), 0, 0);
+}
+
+// Run the event loop until the request is completed, or @ms have passed
+
+static boolean wait_done(struct hfile *f, uint64_t unique, int ms) {
+  uint64_t deadline = now_ns() + ms * 1000000ULL;
+
+  while (is_pending(f, unique)) {
+    uint64_t now = now_ns();
+
+    if (now >= deadline)
+      return false;
+
+    step(1 + (deadline - now) / 1000000);
+  }
+
+  return true;
+}
+
+// The script
+
+enum { S_END, S_OPEN, S_READ, S_WRITE, S_TEXT, S_INTERRUPT, S_COMPLETE,
+       S_RELEASE, S_OPCODE, S_FILL, S_DRAIN, S_STAT, S_STREAM, S_RATE };
+
+static const char *step_names[] = { "END", "OPEN", "READ", "WRITE", "TEXT",
+				    "INTERRUPT", "COMPLETE", "RELEASE",
+				    "OPCODE", "FILL", "DRAIN", "STAT",
+				    "STREAM", "RATE" };
+
+// Values of @expect, besides an error (<= 0) or a byte count (> 0)
+#define PENDING 1000000000 // The request doesn't complete (yet)
+#define ANY 1000000001 // Any successful completion
+#define INTERRUPTED 1000000002 // -EINTR, or completion with a short count
+
+// How STAT compares the counter with @expect, given as @arg
+enum { EQUAL, ABOVE, AT_MOST };
+
+#define PENDING_MS 50 // How long a request is watched to stay pending
+#define DONE_MS 1000 // How long a request may take to complete
+
+struct step {
+  int op;
+  int role;
+  int arg; // Flags for OPEN, size for READ, WRITE, STREAM and FILL (0 =
+	   // max_size), opcode for OPCODE, comparison for STAT, ms for RATE
+  int expect; // Count for STREAM, bytes/s for RATE
+  const char *text; // For TEXT, which is a WRITE, and STAT
+};
+
+static const struct step script[] = {
+  { S_OPCODE, ROLE_LOOP_IN, FUSE_IOCTL, -EINVAL },
+  { S_OPCODE, ROLE_LOOP_IN, FUSE_GETATTR, -ENOSYS },
+  { S_OPEN, ROLE_LOOP_IN, O_WRONLY, -ENODEV },
+  { S_OPEN, ROLE_LOOP_IN, O_RDONLY, 0 },
+  { S_OPEN, ROLE_LOOP_IN, O_RDONLY, -EBUSY },
+  { S_OPEN, ROLE_LOOP_OUT, O_WRONLY, 0 },
+
+  // With no data at all, a READ waits for data or INTERRUPT
+  { S_READ, ROLE_LOOP_IN, 100, PENDING },
+  { S_INTERRUPT, ROLE_LOOP_IN, 0, -EINTR },
+
+  { S_WRITE, ROLE_LOOP_OUT, 1000, 1000 },
+  { S_READ, ROLE_LOOP_IN, 1000, 1000 },
+
+  // A READ with some data completes partially on the 10 ms timeout...
+  { S_WRITE, ROLE_LOOP_OUT, 30, 30 },
+  { S_READ, ROLE_LOOP_IN, 100, 30 },
+
+  // ... or fully as soon as there's enough data
+  { S_READ, ROLE_LOOP_IN, 100, PENDING },
+  { S_WRITE, ROLE_LOOP_OUT, 100, 100 },
+  { S_COMPLETE, ROLE_LOOP_IN, 0, 100 },
+
+  // A WRITE that blocks on a full FIFO completes partially or not at all
+  // on INTERRUPT, and the FIFO's content remains consistent
+  { S_FILL, ROLE_LOOP_OUT, 0, PENDING },
+  { S_INTERRUPT, ROLE_LOOP_OUT, 0, INTERRUPTED },
+  { S_DRAIN, ROLE_LOOP_IN, 0, 0 },
+
+  { S_RELEASE, ROLE_LOOP_OUT, 0, 0 },
+  { S_RELEASE, ROLE_LOOP_IN, 0, 0 },
+
+  // STAT reads the stats file, and checks a counter of a device file (-1
+  // if it's not shown at all)
+  { S_OPEN, ROLE_STATS, O_RDWR, 0 },
+  { S_READ, ROLE_STATS, 4096, ANY },
+  { S_STAT, ROLE_STATS, ABOVE, 0, "usbpiper_loop_out write_latency_us" },
+  { S_TEXT, ROLE_STATS, 0, 14, "reset latency\n" },
+  { S_STAT, ROLE_STATS, EQUAL, -1, "usbpiper_loop_out write_latency_us" },
+  { S_STAT, ROLE_STATS, ABOVE, 0, "usbpiper_loop_out writes" },
+  { S_TEXT, ROLE_STATS, 0, 6, "reset\n" },
+  { S_STAT, ROLE_STATS, EQUAL, 0, "usbpiper_loop_out writes" },
+  { S_TEXT, ROLE_STATS, 0, -EINVAL, "nonsense\n" },
+  { S_TEXT, ROLE_STATS, 0, 32, "fifo usbpiper_sim_bulk_in_01 1M\n" },
+  { S_TEXT, ROLE_STATS, 0, -ENODEV, "fifo usbpiper_nothing 1M\n" },
+  { S_RELEASE, ROLE_STATS, 0, 0 },
+
+  { S_OPEN, ROLE_SIM_IN, O_RDONLY, 0 },
+  { S_READ, ROLE_SIM_IN, 65536, 65536 },
+  { S_READ, ROLE_SIM_IN, 100, 100 },
+  { S_RELEASE, ROLE_SIM_IN, 0, 0 },
+
+  { S_OPEN, ROLE_SIM_OUT, O_WRONLY, 0 },
+  { S_WRITE, ROLE_SIM_OUT, 65536, 65536 },
+  { S_RELEASE, ROLE_SIM_OUT, 0, 0 },
+
+  // The isochronous endpoint has no bandwidth in setting 0. Its TDs must
+  // take the packets of setting 2 after a switch from setting 1. There are
+  // three settings, but none is number 3.
+  { S_OPEN, ROLE_SIM_ISO, O_RDONLY, -ENODEV },
+  { S_OPEN, ROLE_SIM_IF, O_RDWR, 0 },
+  { S_TEXT, ROLE_SIM_IF, 0, -EINVAL, "alt 3\n" },
+  { S_TEXT, ROLE_SIM_IF, 0, 6, "alt 1\n" },
+  { S_OPEN, ROLE_SIM_ISO, O_RDONLY, 0 },
+  { S_READ, ROLE_SIM_ISO, 65536, 65536 },
+  { S_TEXT, ROLE_SIM_IF, 0, -EBUSY, "alt 2\n" },
+  { S_RELEASE, ROLE_SIM_ISO, 0, 0 },
+  { S_TEXT, ROLE_SIM_IF, 0, 6, "alt 2\n" },
+  { S_OPEN, ROLE_SIM_ISO, O_RDONLY, 0 },
+  { S_READ, ROLE_SIM_ISO, 65536, 65536 },
+
+  // The side channel, opened in mid-stream, lines up with the data. How
+  // many records there are depends on when the TDs complete.
+  { S_OPEN, ROLE_SIM_META, O_RDONLY, 0 },
+  { S_READ, ROLE_SIM_ISO, 65536, 65536 },
+  { S_READ, ROLE_SIM_META, 100 * sizeof(struct piperisorecord), ANY },
+  { S_READ, ROLE_SIM_ISO, 65536, 65536 },
+  { S_READ, ROLE_SIM_META, 100 * sizeof(struct piperisorecord), ANY },
+  { S_RELEASE, ROLE_SIM_META, 0, 0 },
+  { S_RELEASE, ROLE_SIM_ISO, 0, 0 },
+  { S_RELEASE, ROLE_SIM_IF, 0, 0 },
+
+  { S_END }
+};
+
+static const struct step packet_script[] = {
+  // A READ returns one message (of 32769 bytes, see above), and a short
+  // READ the start of one, whose rest is discarded
+  { S_OPEN, ROLE_SIM_IN, O_RDONLY, 0 },
+  { S_READ, ROLE_SIM_IN, 65536, 32769 },
+  { S_READ, ROLE_SIM_IN, 100, 100 },
+  { S_READ, ROLE_SIM_IN, 65536, 32769 },
+  { S_READ, ROLE_SIM_IN, 32769, 32769 },
+  { S_READ, ROLE_SIM_IN, 1, 1 },
+  { S_READ, ROLE_SIM_IN, 65536, 32769 },
+  { S_RELEASE, ROLE_SIM_IN, 0, 0 },
+
+  // A WRITE must fit into a TD (64 kiB)
+  { S_OPEN, ROLE_SIM_OUT, O_WRONLY, 0 },
+  { S_WRITE, ROLE_SIM_OUT, 65537, -EMSGSIZE },
+  { S_WRITE, ROLE_SIM_OUT, 65536, 65536 },
+
+  // An interrupted WRITE that blocks on a full FIFO is unwound as a whole
+  // message, so the next WRITE fits in right away. The rate cap lets two
+  // TDs go (the first WRITE and one of FILL's) and then none for a second,
+  // so the FIFO (256 + 128 kiB) ends up with three messages of 64 kiB, and
+  // one of 100 bytes, each with its length.
+  { S_FILL, ROLE_SIM_OUT, 65536, PENDING },
+  { S_INTERRUPT, ROLE_SIM_OUT, 0, -EINTR },
+  { S_WRITE, ROLE_SIM_OUT, 100, 100 },
+  { S_WRITE, ROLE_SIM_OUT, 65536, PENDING },
+  { S_INTERRUPT, ROLE_SIM_OUT, 0, -EINTR },
+
+  { S_OPEN, ROLE_STATS, O_RDWR, 0 },
+  { S_STAT, ROLE_STATS, EQUAL, 3 * (65536 + sizeof(piperpkthdr)) +
+    100 + sizeof(piperpkthdr), "usbpiper_sim_bulk_out_02 fifo_fill" },
+  { S_STAT, ROLE_STATS, ABOVE, 0, "usbpiper_sim_bulk_out_02 throttles" },
+  { S_STAT, ROLE_STATS, ABOVE, 0, "usbpiper_sim_bulk_in_01 reads_message" },
+  { S_RELEASE, ROLE_STATS, 0, 0 },
+
+  // Flushing the FIFO would take seconds
+  { S_RELEASE, ROLE_SIM_OUT, 0, PENDING },
+  { S_INTERRUPT, ROLE_SIM_OUT, 0, -EINTR },
+
+  { S_END }
+};
+
+static const struct step sched_script[] = {
+  // The OUT endpoint isn't capped, and would have all its TDs in flight
+  // otherwise. STREAM makes @expect requests of @arg bytes each.
+  { S_OPEN, ROLE_SIM_OUT, O_WRONLY, 0 },
+  { S_STREAM, ROLE_SIM_OUT, 65536, 200 },
+  { S_RELEASE, ROLE_SIM_OUT, 0, 0 },
+
+  // RATE measures the throughput of @arg ms of requests
+  { S_OPEN, ROLE_SIM_IN, O_RDONLY, 0 },
+  { S_RATE, ROLE_SIM_IN, 1000, SCHED_IN_RATE },
+  { S_RELEASE, ROLE_SIM_IN, 0, 0 },
+
+  // For "depth", STAT takes the deepest queue left when a TD completed
+  { S_OPEN, ROLE_STATS, O_RDWR, 0 },
+  { S_STAT, ROLE_STATS, AT_MOST, 1, "usbpiper_sim_bulk_out_02 depth" },
+  { S_STAT, ROLE_STATS, ABOVE, 0, "usbpiper_sim_bulk_out_02 sched_waits" },
+  { S_STAT, ROLE_STATS, AT_MOST, 1, "usbpiper_sim_bulk_in_01 depth" },
+  { S_STAT, ROLE_STATS, ABOVE, 0, "usbpiper_sim_bulk_in_01 throttles" },
+  { S_RELEASE, ROLE_STATS, 0, 0 },
+
+  { S_END }
+};
+
+static const struct step grow_script[] = {
+  // A reader that's steadily slower than USB keeps the FIFO about full,
+  // which isn't a reason to let it grow
+  { S_OPEN, ROLE_STATS, O_RDWR, 0 },
+  { S_OPEN, ROLE_SIM_IN, O_RDONLY, 0 },
+  { S_STREAM, ROLE_SIM_IN, 4096, 20000 },
+  { S_STAT, ROLE_STATS, EQUAL, 262144, "usbpiper_sim_bulk_in_01 fifo_size" },
+
+  // A bursty one drains it to half in between, so it fills up again and
+  // again
+  { S_STREAM, ROLE_SIM_IN, 131072, 200 },
+  { S_STAT, ROLE_STATS, ABOVE, 262144, "usbpiper_sim_bulk_in_01 fifo_size" },
+  { S_RELEASE, ROLE_SIM_IN, 0, 0 },
+  { S_RELEASE, ROLE_STATS, 0, 0 },
+
+  { S_END }
+};
+
+static void check_step(int n, const struct step *s, struct hfile *f,
+		       uint64_t unique, uint32_t size) {
+  boolean ok;
+
+  if (s->expect == PENDING) {
+    if (wait_done(f, unique, PENDING_MS))
+      fail(f, "Script step %d (%s): Completed, but should be pending\n",
+	   n, step_names[s->op]);
+    return;
+  }
+
+  if (!wait_done(f, unique, DONE_MS)) {
+    fail(f, "Script step %d (%s): Didn't complete\n", n, step_names[s->op]);
+    return;
+  }
+
+  if (f->done_unique != unique) {
+    fail(f, "Script step %d (%s): Another request completed after it\n",
+	 n, step_names[s->op]);
+    return;
+  }
+
+  switch (s->expect) {
+  case ANY:
+    ok = !f->done_error;
+    break;
+
+  case INTERRUPTED:
+    ok = (f->done_error == -EINTR) ||
+      (!f->done_error && (f->done_count < size));
+    break;
+
+  default:
+    if (s->expect <= 0)
+      ok = (f->done_error == s->expect);
+    else
+      ok = !f->done_error && (f->done_count == s->expect);
+  }
+
+  if (ok)
+    return;
+
+  if (s->expect == ANY)
+    fail(f, "Script step %d (%s): Failed with error %d\n",
+	 n, step_names[s->op], f->done_error);
+  else if (s->expect == INTERRUPTED)
+    fail(f, "Script step %d (%s): Completed fully, despite INTERRUPT\n",
+	 n, step_names[s->op]);
+  else
+    fail(f, "Script step %d (%s): Expected %d, got error %d, count %u\n",
+	 n, step_names[s->op], s->expect, f->done_error, f->done_count);
+}
+
+// The value of counter @field in the stats of device file @name, or -1.
+// For a histogram, that's its first number, the count. For the queue
+// depths, it's the deepest one seen, which is listed last.
+
+static long long stat_value(const char *name, const char *field) {
+  char *section, *end, *p;
+  int n = strlen(name);
+
+  for (section = stats_text; section; section = strchr(section, '\n')) {
+    if (*section == '\n')
+      section++;
+
+    if (!strncmp(section, name, n) && (section[n] == ':'))
+      break;
+  }
+
+  if (!section)
+    return -1;
+
+  // The section ends at the next line that isn't indented
+  for (end = section; (end = strchr(end, '\n')) && (end[1] == ' '); end++)
+    ;
+
+  n = strlen(field);
+
+  for (p = section; (p = strstr(p, field)) && (!end || (p < end)); p++) {
+    if ((p[-1] != ' ') || (p[n] != ' '))
+      continue;
+
+    p += n;
+
+    if (!strcmp(field, "depth")) {
+      *strchrnul(p, '\n') = 0;
+      p = strrchr(p, ' ');
+    }
+
+    return strtoll(p + strcspn(p, "0123456789"), NULL, 10);
+  }
+
+  return -1;
+}
+
+static void check_stat(int n, const struct step *s, struct hfile *f,
+		       uint64_t unique) {
+  char name[64], *field;
+  long long value;
+
+  if (!wait_done(f, unique, DONE_MS) || f->done_error) {
+    fail(f, "Script step %d: READ failed\n", n);
+    return;
+  }
+
+  snprintf(name, sizeof(name), "%s", s->text);
+
+  if (!(field = strchr(name, ' ')))
+    fatal("STAT step without a counter");
+
+  *field++ = 0;
+  value = stat_value(name, field);
+
+  if ((value < 0) && (s->expect >= 0))
+    fail(f, "Script step %d: No %s of %s in the statistics\n",
+	 n, field, name);
+  else if ((s->arg == EQUAL) ? (value != s->expect) :
+	   (s->arg == ABOVE) ? (value <= s->expect) : (value > s->expect))
+    fail(f, "Script step %d: %s of %s is %lld\n", n, field, name, value);
+}
+
+// READ (or WRITE) max_size bytes at a time for @s->arg ms, and check the
+// throughput against @s->expect, which is a cap with some burst on top
+
+static void check_rate(int n, const struct step *s, struct hfile *f) {
+  uint64_t start = now_ns(), end = start + s->arg * 1000000ULL;
+  uint64_t bytes = 0, unique;
+  double rate;
+
+  while (now_ns() < end) {
+    unique = is_writer(f) ? send_write(f, config.max_size, NULL) :
+      send_read(f, config.max_size);
+
+    if (!wait_done(f, unique, DONE_MS) || f->done_error) {
+      fail(f, "Script step %d: Request failed or didn't complete\n", n);
+      return;
+    }
+
+    bytes += f->done_count;
+  }
+
+  rate = bytes * 1e9 / (now_ns() - start);
+
+  if ((rate > s->expect * 1.1) || (rate < s->expect * 0.8))
+    fail(f, "Script step %d: %.0f bytes/s, expected %d\n", n, rate,
+	 s->expect);
+}
+
+static void run_script(const struct step *script, const char *name) {
+  const struct step *s;
+  struct hfile *f;
+  uint64_t unique;
+  uint32_t size = 0;
+  int n, i;
+
+  for (s = script, n = 1; s->op != S_END; s++, n++) {
+    if (!(f = file_of(s->role))) {
+      fail(NULL, "Script step %d: No %s file\n", n, role_names[s->role]);
+      continue;
+    }
+
+    switch (s->op) {
+    case S_OPEN:
+      unique = send_open(f, s->arg);
+      break;
+
+    case S_READ:
+      unique = send_read(f, s->arg);
+      break;
+
+    case S_WRITE:
+      unique = send_write(f, s->arg, NULL);
+      break;
+
+    case S_TEXT:
+      unique = send_write(f, strlen(s->text), s->text);
+      break;
+
+    case S_INTERRUPT:
+    case S_COMPLETE:
+      // The request may have completed already, e.g. as a side effect of
+      // the previous step. An INTERRUPT is sent anyhow, like the kernel may.
+      unique = f->last_unique;
+      size = f->last_size;
+
+      if (s->op == S_INTERRUPT)
+	send_interrupt(f, unique);
+      break;
+
+    case S_RELEASE:
+      unique = send_release(f);
+      break;
+
+    case S_OPCODE:
+      unique = send_request(f, s->arg, 0, 0, 0);
+      break;
+
+    case S_STAT:
+      check_stat(n, s, f, send_read(f, config.max_size));
+      continue;
+
+    case S_RATE:
+      check_rate(n, s, f);
+      continue;
+
+    case S_STREAM:
+      for (i=0; i<s->expect; i++) {
+	unique = is_writer(f) ? send_write(f, s->arg, NULL) :
+	  send_read(f, s->arg);
+
+	if (!wait_done(f, unique, DONE_MS) || f->done_error ||
+	    (f->done_count != s->arg)) {
+	  fail(f, "Script step %d: Request %d of %d didn't complete fully\n",
+	       n, i + 1, s->expect);
+	  break;
+	}
+      }
+      continue;
+
+    case S_FILL: // WRITE max_size bytes at a time until a WRITE blocks
+      for (i=0; i<1000; i++) {
+	unique = send_write(f, s->arg ? s->arg : config.max_size, NULL);
+
+	if (!wait_done(f, unique, PENDING_MS))
+	  break;
+      }
+
+      if (i == 1000)
+	fail(f, "Script step %d: WRITE never blocked\n", n);
+      continue;
+
+    case S_DRAIN: // READ until a READ blocks, and then interrupt it
+      for (i=0; i<1000; i++) {
+	unique = send_read(f, config.max_size);
+
+	if (!wait_done(f, unique, PENDING_MS))
+	  break;
+      }
+
+      send_interrupt(f, unique);
+
+      if (!wait_done(f, unique, DONE_MS) || (f->done_error != -EINTR))
+	fail(f, "Script step %d: Last READ wasn't interrupted properly\n", n);
+      continue;
+
+    default:
+      continue;
+    }
+
+    check_step(n, s, f, unique, size);
+  }
+
+  printf("%s: %d steps, %d failures\n", name, n - 1, failures);
+}
+
+// The random stream, on the loopback files and the simulated device
+
+static unsigned int rnd_size(void) {
+  switch (rnd() % 4) {
+  case 0: return 1 + rnd() % 64;
+  case 1: return 1 + rnd() % 4096;
+  case 2: return config.max_size;
+  default: return 1 + rnd() % config.max_size;
+  }
+}
+
+static boolean random_request(struct hfile *f) {
+  boolean writer = is_writer(f);
+
+  if (f->num_pending) {
+    struct hreq *r = &f->pending[0];
+
+    if (!r->interrupted && !(rnd() % 32) &&
+	((r->opcode == FUSE_READ) || (r->opcode == FUSE_WRITE))) {
+      send_interrupt(f, r->unique);
+      return true;
+    }
+
+    return false;
+  }
+
+  if (!f->open) {
+    send_open(f, writer ? O_WRONLY : O_RDONLY);
+    return true;
+  }
+
+  // Releasing the loopback reader discards data in an unpredictable way,
+  // so only the other files are closed and reopened.
+
+  if (!(rnd() % 64) && (f->role != ROLE_LOOP_IN))
+    send_release(f);
+  else if (writer)
+    send_write(f, rnd_size(), NULL);
+  else
+    send_read(f, rnd_size());
+
+  return true;
+}
+
+static void run_random(unsigned long num_requests) {
+  static const int roles[] = { ROLE_LOOP_OUT, ROLE_LOOP_IN,
+			       ROLE_SIM_IN, ROLE_SIM_OUT };
+  struct hfile *active[4];
+  int num_active = 0;
+  unsigned long start_requests = counts.requests;
+  uint64_t start_read = counts.bytes_read;
+  uint64_t start_written = counts.bytes_written;
+  uint64_t start, elapsed, deadline;
+  boolean sent, busy;
+  int i;
+
+  memset(counts.opcodes, 0, sizeof(counts.opcodes));
+
+  for (i=0; i<4; i++)
+    if ((active[num_active] = file_of(roles[i])))
+      num_active++;
+
+  start = now_ns();
+
+  while ((counts.requests - start_requests) < num_requests) {
+    sent = false;
+
+    for (i=0; i<num_active; i++)
+      sent |= random_request(active[i]);
+
+    step(sent ? 0 : 1); // Let timers expire if nothing is going on
+  }
+
+  // Wrap up: Interrupt whatever is pending, and close everything
+
+  for (i=0; i<num_active; i++)
+    if (active[i]->num_pending && !active[i]->pending[0].interrupted &&
+	(active[i]->pending[0].opcode != FUSE_RELEASE))
+      send_interrupt(active[i], active[i]->pending[0].unique);
+
+  deadline = now_ns() + 3000000000ULL;
+
+  do {
+    step(1);
+
+    for (i=0, busy=false; i<num_active; i++) {
+      if (active[i]->num_pending) {
+	busy = true;
+      } else if (active[i]->open) {
+	send_release(active[i]);
+	busy = true;
+      }
+    }
+  } while (busy && (now_ns() < deadline));
+
+  elapsed = now_ns() - start;
+
+  for (i=0; i<num_active; i++)
+    if (active[i]->num_pending)
+      fail(active[i], "%d request(s) never completed\n",
+	   active[i]->num_pending);
+
+  printf("Random: %lu requests (%lu OPEN, %lu READ, %lu WRITE, "
+	 "%lu INTERRUPT, %lu RELEASE) in %.3f s\n",
+	 counts.requests - start_requests, counts.opcodes[0],
+	 counts.opcodes[1], counts.opcodes[2], counts.opcodes[3],
+	 counts.opcodes[4], elapsed / 1e9);
+
+  printf("        %.0f requests/s, %.1f MB/s read, %.1f MB/s written\n",
+	 (counts.requests - start_requests) * 1e9 / elapsed,
+	 (counts.bytes_read - start_read) * 1e3 / elapsed,
+	 (counts.bytes_written - start_written) * 1e3 / elapsed);
+}
+
+// Check the capture of the simulated bulk endpoints. The IN records carry
+// the simulator's byte counter and the OUT records the loopback pattern,
+// each without gaps, except for those that a TAP_DROPPED record accounts
+// for.
+
+static void check_capture(const char *path) {
+  struct pipertaprecord rec;
+  unsigned char *payload = rxbuf;
+  uint64_t out_pos = 0, records = 0, bytes = 0, dropped = 0;
+  uint8_t in_next = 0;
+  boolean in_started = false;
+  char magic[8];
+  uint32_t i;
+  FILE *fp;
+
+  usleep(CAPTURE_WAIT_US);
+
+  if (!(fp = fopen(path, "r"))) {
+    fail(NULL, "Failed to open capture %s: %s\n", path, strerror(errno));
+    return;
+  }
+
+  if ((fread(magic, 1, 8, fp) != 8) || memcmp(magic, TAP_MAGIC, 8)) {
+    fail(NULL, "Capture %s doesn't begin with %s\n", path, TAP_MAGIC);
+    goto done;
+  }
+
+  while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+    records++;
+
+    if (rec.flags & TAP_DROPPED) {
+      dropped += rec.length;
+
+      if (rec.addr == 0x81)
+	in_next += rec.length;
+      else
+	out_pos += rec.length;
+      continue;
+    }
+
+    if ((rec.length > bufsize) ||
+	(fread(payload, 1, tap_padded(rec.length), fp) !=
+	 tap_padded(rec.length))) {
+      fail(NULL, "Capture record %llu is truncated\n",
+	   (unsigned long long) records);
+      goto done;
+    }
+
+    bytes += rec.length;
+
+    if (rec.addr == 0x81) {
+      if (!in_started && rec.length)
+	in_next = payload[0];
+
+      in_started = true;
+
+      for (i=0; i<rec.length; i++, in_next++)
+	if (payload[i] != in_next) {
+	  fail(NULL, "Capture record %llu (IN): Byte %u is 0x%02x, "
+	       "expected 0x%02x\n", (unsigned long long) records, i,
+	       payload[i], in_next);
+	  goto done;
+	}
+    } else if (rec.addr == 0x02) {
+      pattern_fill(expectbuf, out_pos, rec.length);
+
+      if (memcmp(payload, expectbuf, rec.length)) {
+	fail(NULL, "Capture record %llu (OUT) doesn't match the stream at "
+	     "position %llu\n", (unsigned long long) records,
+	     (unsigned long long) out_pos);
+	goto done;
+      }
+
+      out_pos += rec.length;
+    } else {
+      fail(NULL, "Capture record %llu is of endpoint 0x%02x\n",
+	   (unsigned long long) records, rec.addr);
+      goto done;
+    }
+  }
+
+  printf("Capture: %llu records, %llu bytes, %llu bytes dropped\n",
+	 (unsigned long long) records, (unsigned long long) bytes,
+	 (unsigned long long) dropped);
+
+ done:
+  fclose(fp);
+}
+
+static void usage(char *prog) {
+  fprintf(stderr,
+	  "Usage: %s [options] [-- usbpiper options]\n\n"
+	  "  -n, --requests N            Random requests to send "
+	  "(default 200000)\n"
+	  "  -s, --seed N                Random seed\n"
+	  "      --simulate PARAMS       Simulated device parameters, as with\n"
+	  "                              usbpiper (default "
+	  "bandwidth=0,latency=0,iso=1,\n"
+	  "                              and short=1 with --packet)\n"
+	  "      --no-script             Skip the scripted tests\n"
+	  "      --packet                Packet mode on the simulated bulk\n"
+	  "                              endpoints, with a script of its own\n"
+	  "      --sched                 Test --device-tds and --ep-rate, with\n"
+	  "                              a script of their own\n"
+	  "      --grow                  Test --fifo-max, with a script of its "
+	  "own\n"
+	  "      --capture PATH          Tap the simulated bulk endpoints into\n"
+	  "                              PATH, and check it after the random "
+	  "stream\n"
+	  "  -v, --verbose               Show the daemon's INFO messages\n"
+	  "  -h, --help                  This help\n",
+	  prog);
+}
+
+int main(int argc, char **argv) {
+  enum { OPT_SIMULATE = 256, OPT_NO_SCRIPT, OPT_PACKET, OPT_SCHED, OPT_GROW,
+	 OPT_CAPTURE };
+
+  static const struct option long_options[] = {
+    { "requests", required_argument, NULL, 'n' },
+    { "seed", required_argument, NULL, 's' },
+    { "simulate", required_argument, NULL, OPT_SIMULATE },
+    { "no-script", no_argument, NULL, OPT_NO_SCRIPT },
+    { "packet", no_argument, NULL, OPT_PACKET },
+    { "sched", no_argument, NULL, OPT_SCHED },
+    { "grow", no_argument, NULL, OPT_GROW },
+    { "capture", required_argument, NULL, OPT_CAPTURE },
+    { "verbose", no_argument, NULL, 'v' },
+    { "help", no_argument, NULL, 'h' },
+    { }
+  };
+
+  char default_sim[] = "bandwidth=0,latency=0,iso=1";
+  char packet_sim[] = "bandwidth=0,latency=0,iso=1,short=1";
+  char sched_sim[] = "bandwidth=0,latency=1000,iso=1";
+  char *sim_params = NULL, *capture = NULL;
+  unsigned long num_requests = 200000;
+  boolean scripted = true;
+  uint64_t unique;
+  int c, i, first;
+
+  config.log_level = LOGLEVEL_WARN;
+
+  while ((c = getopt_long(argc, argv, "n:s:vh", long_options, NULL)) != -1) {
+    switch (c) {
+    case 'n':
+      num_requests = strtoul(optarg, NULL, 0);
+      break;
+
+    case 's':
+      rng_state = strtoull(optarg, NULL, 0);
+
+      if (!rng_state)
+	rng_state = 1;
+      break;
+
+    case OPT_SIMULATE:
+      sim_params = optarg;
+      break;
+
+    case OPT_NO_SCRIPT:
+      scripted = false;
+      break;
+
+    case OPT_PACKET:
+    case OPT_SCHED:
+    case OPT_GROW:
+      if (mode != MODE_DEFAULT) {
+	fprintf(stderr, "Only one of --packet, --sched and --grow may be "
+		"given\n");
+	return 1;
+      }
+
+      mode = (c == OPT_PACKET) ? MODE_PACKET :
+	(c == OPT_SCHED) ? MODE_SCHED : MODE_GROW;
+      break;
+
+    case OPT_CAPTURE:
+      capture = optarg;
+      break;
+
+    case 'v':
+      config.log_level = LOGLEVEL_INFO;
+      break;
+
+    case 'h':
+      usage(argv[0]);
+      return 0;
+
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  // Releasing the packet mode OUT file times out on purpose, and loses
+  // data that the capture can't account for
+  if (capture && (mode == MODE_PACKET)) {
+    fprintf(stderr, "--capture can't be combined with --packet\n");
+    return 1;
+  }
+
+  // The rest are the daemon's options, which parse_options() takes as if
+  // they were the whole command line
+  if (optind < argc) {
+    first = optind;
+    argv[first - 1] = argv[0];
+    optind = 0;
+
+    if (parse_options(argc - first + 1, argv + first - 1))
+      return 1;
+  }
+
+  if (!sim_params)
+    sim_params = (mode == MODE_PACKET) ? packet_sim :
+      (mode == MODE_SCHED) ? sched_sim : default_sim;
+
+  if (parse_sim_options(sim_params))
+    return 1;
+
+  switch (mode) {
+  case MODE_PACKET:
+    config.packet_eps = ep_bit(0x81) | ep_bit(0x02);
+    config.ep_rates[ep_index(0x02)] = PACKET_OUT_RATE;
+    config.ep_rates_set = true;
+    break;
+
+  case MODE_SCHED:
+    config.device_tds = 2;
+    config.ep_rates[ep_index(0x81)] = SCHED_IN_RATE;
+    config.ep_rates_set = true;
+    break;
+
+  case MODE_GROW:
+    config.fifo_max = 64 << 20;
+    break;
+
+  default:
+    break;
+  }
+
+  if (capture) {
+    unlink(capture);
+    config.tap_files[ep_index(0x81)] = capture;
+    config.tap_files[ep_index(0x02)] = capture;
+  }
+
+  for (i=0; i<32; i++)
+    if (config.tap_files[i]) {
+      if (tap_start())
+	return 1;
+      break;
+    }
+
+  config.simulate = true;
+  config.loopback = true;
+  config.iso_meta = true;
+
+  // splice() isn't supported on AF_UNIX SOCK_SEQPACKET sockets, so the
+  // read() / write() path is tested.
+  config.splice_threshold = 0;
+
+  devfile_open_cuse = harness_open_cuse;
+
+  bufsize = config.max_size + 4096;
+
+  if (!(txbuf = malloc(bufsize)) || !(rxbuf = malloc(bufsize)) ||
+      !(expectbuf = malloc(bufsize)) || !(stats_text = malloc(bufsize)))
+    fatal("Out of memory");
+
+  if (init_devfile(config.max_size, config.splice_threshold))
+    return 1;
+
+  if ((pollfd = epoll_create1(0)) < 0) {
+    perror("epoll_create1");
+    return 1;
+  }
+
+  if (stats_init(pollfd, 0) || init_usb(pollfd, config.max_size, 0))
+    return 1;
+
+  // Like the kernel, start each CUSE session with CUSE_INIT
+
+  for (i=0; i<num_files; i++) {
+    unique = send_init(&files[i]);
+
+    if (!wait_done(&files[i], unique, DONE_MS))
+      fail(&files[i], "No response to CUSE_INIT\n");
+  }
+
+  if (scripted)
+    switch (mode) {
+    case MODE_PACKET:
+      run_script(packet_script, "Packet script");
+      break;
+
+    case MODE_SCHED:
+      run_script(sched_script, "Sched script");
+      break;
+
+    case MODE_GROW:
+      run_script(grow_script, "Grow script");
+      break;
+
+    default:
+      run_script(script, "Script");
+      break;
+    }
+
+  if (num_requests)
+    run_random(num_requests);
+
+  if (capture)
+    check_capture(capture);
+
+  printf("%d failures\n", failures);
+
+  return failures ? 1 : 0;
+}
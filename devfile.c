@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -10,14 +11,57 @@
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/timerfd.h>
+#include <sys/uio.h>
 
 #include "cuse.h"
 #include "usbpiper.h"
 
-static int max_size;
-static int bufsize;
+// Each shard's thread has its own buffers, and its own splice pipe.
 
-static void *buf, *complbuf;
+static __thread int max_size;
+static __thread int bufsize;
+
+static __thread void *buf, *complbuf;
+
+// Payloads of at least splice_threshold bytes move between the CUSE file
+// and the FIFO through splice_fds (a pipe) rather than buf / complbuf.
+// Zero means splicing is off, either by choice or because it failed.
+static __thread int splice_threshold;
+static __thread int splice_fds[2] = { -1, -1 };
+
+static void splice_disable(char *what) {
+  ERR("While attempting %s on CUSE file:\n", what);
+  perror(what);
+  WARN("Falling back to read() / write() for CUSE payloads\n");
+
+  // Closing the pipe also discards anything left in it
+  close(splice_fds[0]);
+  close(splice_fds[1]);
+  splice_fds[0] = splice_fds[1] = -1;
+  splice_threshold = 0;
+}
+
+static int read_pipe(void *dst, unsigned int len) {
+  int rc;
+
+  while (len) {
+    rc = read(splice_fds[0], dst, len);
+
+    if ((rc < 0) && (errno == EINTR))
+      continue;
+
+    if (rc <= 0) {
+      if (rc == 0)
+	errno = EIO; // Data that was spliced in has vanished?!
+      return -1;
+    }
+
+    dst += rc;
+    len -= rc;
+  }
+
+  return 0;
+}
 
 // timerfd_settime() clears any pending timer events, so there's no need
 // for any dummy read() cleanup after calling this function.
@@ -33,7 +77,7 @@ static int timer_disarm(struct piperusbfile *xusb) {
     return 1;
   }
 
-  xusb->timer_armed = 0;
+  xusb->timer_armed = false;
   return 0;
 }
 
@@ -48,7 +92,9 @@ static int timer_arm(struct piperusbfile *xusb,
     perror("timerfd_settime");
     return 1;
   }
-  xusb->timer_armed = 1;
+  xusb->timer_armed = true;
+  xusb->stats.timer_arms++;
+  PROBE1(timer_arm, xusb->fd);
   return 0;
 }
 
@@ -72,8 +118,70 @@ static int send_response(struct piperusbfile *xusb, void *buf) {
 	      h->len, rc);
       return 1;
     }
+
+    PROBE4(cuse_response, xusb->fd, h->unique, h->len, h->error);
+    return 0;
+  }
+}
+
+// Send a response which consists of the header in @h followed by payload
+// that is taken from the head of @fifo, without copying the latter. The
+// FIFO's pages are vmsplice()'d into the pipe and then splice()'d into the
+// CUSE file, where the kernel copies them to the reader's buffer. The
+// splice() is synchronous, so the payload can be dropped from the FIFO
+// as soon as it returns.
+//
+// Returns 0 on success, 1 on failure and -1 if splicing isn't supported,
+// in which case nothing was sent, and the FIFO is unchanged.
+
+static int send_response_splice(struct piperusbfile *xusb,
+				struct fuse_out_header *h,
+				struct piperfifo *fifo) {
+  struct iovec iov[3];
+  int num, rc;
+
+  iov[0].iov_base = h;
+  iov[0].iov_len = sizeof(*h);
+
+  num = 1 + piperfifo_peek_iov(fifo, &iov[1], h->len - sizeof(*h));
+
+  // The pipe is large enough for any response, so vmsplice() is
+  // expected to consume everything at once.
+
+  do {
+    rc = vmsplice(splice_fds[1], iov, num, 0);
+  } while ((rc < 0) && (errno == EINTR));
+
+  if (rc != h->len) {
+    if (rc >= 0)
+      errno = EMSGSIZE;
+    splice_disable("vmsplice()");
+    return -1;
+  }
+
+  do {
+    rc = splice(splice_fds[0], NULL, xusb->fd, NULL, h->len, 0);
+  } while ((rc < 0) && (errno == EINTR));
+
+  if (rc == h->len) {
+    PROBE4(cuse_response, xusb->fd, h->unique, h->len, h->error);
+    piperfifo_drop(fifo, h->len - sizeof(*h));
     return 0;
   }
+
+  if ((rc < 0) && ((errno == EINVAL) || (errno == ENOSYS))) {
+    splice_disable("splice()");
+    return -1;
+  }
+
+  if (rc < 0) {
+    perror("splice response");
+    return 1;
+  }
+
+  fprintf(stderr, "Huh? Spliced %d bytes, only %d accepted!\n",
+	  h->len, rc);
+  return 1;
 }
 
 static int complete_status_only(struct piperusbfile *xusb,
@@ -153,6 +261,18 @@ static int complete_open(struct piperusbfile *xusb,
 
   DEBUG("OPEN %s flags = %08x\n", xusb->name, arg->flags);
 
+  // Control files may be opened any number of times, and are seekable, so
+  // that the file position tells how much of the text has been read.
+  if (xusb->ctl) {
+    compl.h.len = sizeof(compl);
+    compl.h.error = 0;
+    compl.h.unique = inh->unique;
+    compl.resp.fh = 0;
+    compl.resp.open_flags = FOPEN_DIRECT_IO;
+
+    return send_response(xusb, &compl);
+  }
+
   if (xusb->state != XUSB_CLOSED) {
     ERR("Rejected attempt to double-open %s\n", xusb->name);
     return complete_status_only(xusb, inh->unique, -EBUSY);
@@ -162,6 +282,21 @@ static int complete_open(struct piperusbfile *xusb,
       (open_for_write && !xusb->sink))
     return complete_status_only(xusb, inh->unique, -ENODEV);
 
+  // The endpoint may be missing in the current alternate setting
+  if ((open_for_read && !xusb->source->present) ||
+      (open_for_write && !xusb->sink->present))
+    return complete_status_only(xusb, inh->unique, -ENODEV);
+
+  if (xusb->source)
+    fifo_open_resize(xusb->source);
+
+  if (xusb->sink)
+    fifo_open_resize(xusb->sink);
+
+  if ((xusb->source && endpoint_activate(xusb->source)) ||
+      (xusb->sink && endpoint_activate(xusb->sink)))
+    return complete_status_only(xusb, inh->unique, -ENOMEM);
+
   if (open_for_read && try_queue_bulkin(xusb->source))
     return 1;
 
@@ -179,6 +314,15 @@ static int complete_open(struct piperusbfile *xusb,
   return send_response(xusb, &compl);
 }
 
+// A closed file's endpoint has no TDs queued, and that's not interesting
+
+static void stop_zero_td_clock(struct piperendpoint *xep) {
+  if (xep->stats.zero_td_since) {
+    xep->stats.zero_td_ns += piper_now() - xep->stats.zero_td_since;
+    xep->stats.zero_td_since = 0;
+  }
+}
+
 int try_complete_release(struct piperusbfile *xusb) {
   struct piperfifo *sink_fifo = xusb->sink ? xusb->sink->fifo : NULL;
   unsigned int sink_fill = sink_fifo ? fifo_fill(sink_fifo) : 0;
@@ -208,14 +352,26 @@ int try_complete_release(struct piperusbfile *xusb) {
       WARN("Timed out while flushing. Lost at least %d bytes of data on %s.\n",
 	   sink_fill, xusb->name);
 
-    if (xusb->sink)
+    if (xusb->sink) {
       piperfifo_limit(xusb->sink->fifo, 0);
-    if (xusb->source)
+      stop_zero_td_clock(xusb->sink);
+      endpoint_deactivate(xusb->sink);
+    }
+    if (xusb->source) {
       piperfifo_limit(xusb->source->fifo, 0);
+      xusb->source->iso_offset = 0; // The next OPEN's stream starts anew
+      stop_zero_td_clock(xusb->source);
+
+      // In loopback mode, discarding the data may unblock the writer
+      if (xusb->counterpart)
+	rc = try_queue_bulkin(xusb->source);
+
+      endpoint_deactivate(xusb->source);
+    }
 
     xusb->state = XUSB_CLOSED;
-    rc = complete_status_only(xusb, xusb->unique_down,
-			      xusb->interrupted_down ? -EINTR : 0);
+    rc |= complete_status_only(xusb, xusb->unique_down,
+			       xusb->interrupted_down ? -EINTR : 0);
     xusb->unique_down = 0;
     return rc;
   }
@@ -223,7 +379,7 @@ int try_complete_release(struct piperusbfile *xusb) {
   // Couldn't complete the RELEASE request, maybe help to give it a push.
 
   if (xusb->sink && xusb->timed_out && !xusb->bulkout_canceled) {
-    xusb->bulkout_canceled = 1;
+    xusb->bulkout_canceled = true;
     piperfifo_limit(sink_fifo, 0); // Also prevents queuing of BULK OUT TDs
     rc |= cancel_all(xusb->sink);
   }
@@ -241,6 +397,9 @@ static int process_release(struct piperusbfile *xusb,
 			   struct fuse_in_header *inh) {
   DEBUG("RELEASE %s\n", xusb->name);
 
+  if (xusb->ctl)
+    return complete_status_only(xusb, inh->unique, 0);
+
   if (xusb->state != XUSB_OPEN)
     BUG("Huh? %s is not open, and yet it got a RELEASE request!\n",
 	xusb->name);
@@ -262,9 +421,9 @@ static int process_release(struct piperusbfile *xusb,
 
   xusb->unique_down = inh->unique;
   xusb->state = XUSB_RELEASING;
-  xusb->timed_out = 0;
-  xusb->interrupted_down = 0;
-  xusb->bulkout_canceled = 0;
+  xusb->timed_out = false;
+  xusb->interrupted_down = false;
+  xusb->bulkout_canceled = false;
 
   if (xusb->source)
     cancel_all(xusb->source);
@@ -285,19 +444,43 @@ int try_complete_write(struct piperusbfile *xusb) {
     struct fuse_write_out resp;
   } compl;
   int rc;
+  boolean packet_mode = xusb->sink->packet_mode;
+  unsigned int room = max_size + (packet_mode ? sizeof(piperpkthdr) : 0);
+  unsigned int vacant;
+
+  fifo_check_drained(xusb->sink);
+
+  // The WRITE waits because the FIFO is full. fifo_full() may grow the
+  // FIFO for that, so the vacant room is looked at again.
+  vacant = fifo_vacant(fifo);
 
-  if (!xusb->interrupted_down && (fifo_vacant(fifo) < max_size))
+  if (!xusb->interrupted_down && (vacant < room) && fifo_full(xusb->sink))
+    vacant = fifo_vacant(fifo);
+
+  if (!xusb->interrupted_down && (vacant < room))
     return 0; // Didn't complete, and this is no error. So success.
 
   count = xusb->write_size;
 
   // If completion is forced by interrupt, ensure there's max_size bytes
-  // vacant in the FIFO for the next WRITE, by possibly unwinding data
-
-  if (xusb->interrupted_down)
+  // vacant in the FIFO for the next WRITE, by possibly unwinding data.
+  // In packet mode, the message is either unwound completely or not at all.
+  // If there isn't enough room, the message can't have been sent, so it's
+  // still the last one in the FIFO.
+
+  if (xusb->interrupted_down && packet_mode) {
+    if (fifo_vacant(fifo) < room) {
+      piperfifo_limit(fifo, fifo->fill - sizeof(piperpkthdr) - count);
+      count = 0;
+    }
+  } else if (xusb->interrupted_down) {
     count -= piperfifo_limit(fifo, fifo->size - max_size);
+  }
+
+  hist_add(&xusb->stats.write_latency, piper_now() - xusb->down_since);
 
   if ((count == 0) && (xusb->write_size != 0)) {
+    trace(TRACE_WRITE_DONE, xusb->fd, xusb->unique_down, -EINTR);
     rc = complete_status_only(xusb, xusb->unique_down, -EINTR);
     xusb->unique_down = 0;
     return rc;
@@ -308,26 +491,57 @@ int try_complete_write(struct piperusbfile *xusb) {
   compl.h.error = 0;
   compl.resp.size = count;
 
+  trace(TRACE_WRITE_DONE, xusb->fd, xusb->unique_down, count);
+
   xusb->unique_down = 0;
+  xusb->stats.writes++;
 
   return send_response(xusb, &compl);
 }
 
+// In packet mode, a READ completes as soon as there's a message in the FIFO,
+// and returns exactly one message. If the READ's buffer is too short, the
+// rest of the message is discarded (like recv() on a datagram socket).
+
 int try_complete_read(struct piperusbfile *xusb) {
   struct piperfifo *fifo = xusb->source->fifo;
   uint32_t count = fifo_fill(fifo);
+  uint32_t excess = 0; // Bytes to discard after the completion
 
   struct fuse_out_header *compl = complbuf;
   int rc = 0;
   int bufsize = sizeof(*compl);
 
   if (xusb->interrupted_up && (count == 0)) {
+    if (xusb->timer_armed) {
+      rc = timer_disarm(xusb);
+      if (rc)
+	return rc;
+    }
+
+    trace(TRACE_READ_DONE, xusb->fd, xusb->unique_up, -EINTR);
     rc = complete_status_only(xusb, xusb->unique_up, -EINTR);
     xusb->unique_up = 0;
+    xusb->stats.reads_interrupted++;
+    hist_add(&xusb->stats.read_latency, piper_now() - xusb->up_since);
     return rc;
   }
 
-  if ((count == 0) ||
+  if (xusb->source->packet_mode) {
+    piperpkthdr len;
+
+    if (count == 0)
+      return 0; // No message yet, no timer needed
+
+    piperfifo_read(fifo, &len, sizeof(len));
+
+    count = len;
+
+    if (count > xusb->read_size) {
+      excess = count - xusb->read_size;
+      count = xusb->read_size;
+    }
+  } else if ((count == 0) ||
       // Partial completion: Only on timeout or interrupt
       ((count < xusb->read_size) &&
        !(xusb->timed_out || xusb->interrupted_up))) {
@@ -349,8 +563,40 @@ int try_complete_read(struct piperusbfile *xusb) {
   if (count > xusb->read_size)
     count = xusb->read_size;
 
+  if (xusb->source->packet_mode)
+    xusb->stats.reads_message++;
+  else if (count == xusb->read_size)
+    xusb->stats.reads_full++;
+  else if (xusb->interrupted_up)
+    xusb->stats.reads_interrupted++;
+  else
+    xusb->stats.reads_timeout++;
+
+  hist_add(&xusb->stats.read_latency, piper_now() - xusb->up_since);
+  trace(TRACE_READ_DONE, xusb->fd, xusb->unique_up, count);
+
   bufsize += count;
 
+  if (splice_threshold && (count >= splice_threshold)) {
+    struct fuse_out_header h = {
+      .unique = xusb->unique_up,
+      .len = bufsize,
+      .error = 0,
+    };
+
+    rc = send_response_splice(xusb, &h, fifo);
+
+    if (rc >= 0) {
+      xusb->unique_up = 0;
+      piperfifo_drop(fifo, excess);
+
+      // After getting some data off the FIFO, maybe a BULK IN TD can be queued
+      return rc | try_queue_bulkin(xusb->source);
+    }
+
+    rc = 0; // Splicing not supported, fall back to copying
+  }
+
   memset(compl, 0, sizeof(*compl));
 
   if (piperfifo_read(fifo, &compl[1], count) != count) {
@@ -358,6 +604,8 @@ int try_complete_read(struct piperusbfile *xusb) {
     return 1;
   }
 
+  piperfifo_drop(fifo, excess);
+
   compl->unique = xusb->unique_up;
   compl->len = bufsize;
   compl->error = 0;
@@ -372,15 +620,88 @@ int try_complete_read(struct piperusbfile *xusb) {
   return rc;
 }
 
+// READ and WRITE requests on control files complete immediately. A READ
+// returns the part of the text from show() that starts at the requested
+// offset, so the text is regenerated on each request.
+
+static int complete_ctl_read(struct piperusbfile *xusb,
+			     struct fuse_in_header *inh) {
+  struct fuse_read_in *arg = (void *) &inh[1];
+  struct fuse_out_header *compl = complbuf;
+  char *text = (void *) &compl[1];
+  uint32_t count = 0;
+  int len;
+
+  len = xusb->ctl->show(xusb->ctl->private, text, max_size);
+
+  if (len < 0)
+    return complete_status_only(xusb, inh->unique, len);
+
+  if (arg->offset < len) {
+    count = len - arg->offset;
+
+    if (count > arg->size)
+      count = arg->size;
+
+    memmove(text, text + arg->offset, count);
+  }
+
+  compl->unique = inh->unique;
+  compl->len = sizeof(*compl) + count;
+  compl->error = 0;
+
+  return send_response(xusb, compl);
+}
+
+static int complete_ctl_write(struct piperusbfile *xusb,
+			      struct fuse_in_header *inh) {
+  struct fuse_write_in *arg = (void *) &inh[1];
+  char cmd[256];
+  unsigned int len = arg->size;
+  int rc;
+
+  struct {
+    struct fuse_out_header h;
+    struct fuse_write_out resp;
+  } compl;
+
+  if (len >= sizeof(cmd))
+    return complete_status_only(xusb, inh->unique, -EINVAL);
+
+  memcpy(cmd, &arg[1], len);
+
+  // Strip trailing newline and the like, as written by echo
+  while ((len > 0) && ((cmd[len-1] == '\n') || (cmd[len-1] == ' ')))
+    len--;
+
+  cmd[len] = 0;
+
+  rc = xusb->ctl->command(xusb->ctl->private, cmd);
+
+  if (rc < 0)
+    return complete_status_only(xusb, inh->unique, rc);
+
+  compl.h.unique = inh->unique;
+  compl.h.len = sizeof(compl);
+  compl.h.error = 0;
+  compl.resp.size = arg->size;
+
+  return send_response(xusb, &compl);
+}
+
+// If @in_fifo is true, the payload has already been written into the
+// FIFO by read_spliced(), after the same checks as below were made.
+
 static int process_write(struct piperusbfile *xusb,
-			 struct fuse_in_header *inh) {
+			 struct fuse_in_header *inh,
+			 boolean in_fifo) {
   struct fuse_write_in *arg = (void *) &inh[1];
   int count;
 
-  DEBUG("WRITE fh=%ld, offset=%ld, size=%d, write_flags=0x%08x,\n"
-       "lock_owner=%ld, flags=0x%08x\n",
-       arg->fh, arg->offset, arg->size, arg->write_flags,
-       arg->lock_owner, arg->flags);
+  trace(TRACE_WRITE, xusb->fd, inh->unique, arg->size);
+
+  if (xusb->ctl)
+    return complete_ctl_write(xusb, inh);
 
   // It's really not expected to happen
   if (!xusb->sink) {
@@ -394,9 +715,26 @@ static int process_write(struct piperusbfile *xusb,
   if (xusb->unique_down)
     return complete_status_only(xusb, inh->unique, -EINVAL);
 
+  // In packet mode, each WRITE becomes a single USB transfer, so it must
+  // fit into a TD. The message is stored in the FIFO with its length.
+  if (xusb->sink->packet_mode) {
+    piperpkthdr len = arg->size;
+
+    if (arg->size > xusb->sink->td_bufsize)
+      return complete_status_only(xusb, inh->unique, -EMSGSIZE);
+
+    if (piperfifo_write(xusb->sink->fifo, &len, sizeof(len)) != sizeof(len)) {
+      BUG("Huh? FIFO for %s has no room for packet header\n", xusb->name);
+      return 1;
+    }
+  }
+
   // The FIFO should always have enough room for the entire buffer, since
   // a previous WRITE request must block until then. Or clean up.
-  count = piperfifo_write(xusb->sink->fifo, &arg[1], arg->size);
+  if (in_fifo)
+    count = arg->size;
+  else
+    count = piperfifo_write(xusb->sink->fifo, &arg[1], arg->size);
 
   if (count != arg->size) {
     BUG("Huh? FIFO for %s was unable to accept %d bytes (only %d bytes)\n",
@@ -404,9 +742,13 @@ static int process_write(struct piperusbfile *xusb,
     return 1;
   }
 
+  PROBE3(fifo_fill, xusb->sink->addr, fifo_fill(xusb->sink->fifo),
+	 xusb->sink->fifo->size);
+
   xusb->unique_down = inh->unique;
+  xusb->down_since = piper_now();
   xusb->write_size = arg->size;
-  xusb->interrupted_down = 0;
+  xusb->interrupted_down = false;
 
   return try_queue_bulkout(xusb->sink, true); // Calls try_complete_write()
 }
@@ -415,10 +757,10 @@ static int process_read(struct piperusbfile *xusb,
 			struct fuse_in_header *inh) {
   struct fuse_read_in *arg = (void *) &inh[1];
 
-  DEBUG("READ fh=%ld, offset=%ld, size=%d, read_flags=0x%08x,\n"
-       "lock_owner=%ld, flags=0x%08x\n",
-       arg->fh, arg->offset, arg->size, arg->read_flags,
-       arg->lock_owner, arg->flags);
+  trace(TRACE_READ, xusb->fd, inh->unique, arg->size);
+
+  if (xusb->ctl)
+    return complete_ctl_read(xusb, inh);
 
   // It's really not expected to happen
   if (!xusb->source) {
@@ -439,9 +781,10 @@ static int process_read(struct piperusbfile *xusb,
   }
 
   xusb->unique_up = inh->unique;
+  xusb->up_since = piper_now();
   xusb->read_size = arg->size;
-  xusb->timed_out = 0;
-  xusb->interrupted_up = 0;
+  xusb->timed_out = false;
+  xusb->interrupted_up = false;
 
   return try_complete_read(xusb);
 }
@@ -450,10 +793,10 @@ static int process_interrupt(struct piperusbfile *xusb,
 			     struct fuse_in_header *inh) {
   struct fuse_interrupt_in *arg = (void *) &inh[1];
 
-  DEBUG("INTERRUPT unique=%ld\n", arg->unique);
+  trace(TRACE_INTERRUPT, xusb->fd, arg->unique, 0);
 
   if (arg->unique == xusb->unique_down) {
-    xusb->interrupted_down = 1;
+    xusb->interrupted_down = true;
 
     if (xusb->state == XUSB_OPEN)
       return try_complete_write(xusb);
@@ -462,7 +805,7 @@ static int process_interrupt(struct piperusbfile *xusb,
   }
 
   if (arg->unique == xusb->unique_up) {
-    xusb->interrupted_up = 1;
+    xusb->interrupted_up = true;
     return try_complete_read(xusb);
   }
 
@@ -471,12 +814,87 @@ static int process_interrupt(struct piperusbfile *xusb,
   return 0;
 }
 
+// A request can't be read from the CUSE file in parts, so the choice between
+// read() and splice() is made before its opcode is known. splice() costs a
+// few more system calls per request than read() (the headers are read from
+// the pipe separately), which pays off only for a large WRITE that goes
+// directly into the FIFO. So it's used only on a file whose previous request
+// was such a WRITE, and whose FIFO can take another one now.
+
+static boolean splice_next(struct piperusbfile *xusb) {
+  return splice_threshold && xusb->splice_next && xusb->sink &&
+    !xusb->sink->packet_mode && !xusb->unique_down &&
+    (fifo_vacant(xusb->sink->fifo) >= splice_threshold);
+}
+
+// read_spliced() is a drop-in replacement for read() of a request into buf.
+// The request is splice()'d into the pipe, and only its headers are read()
+// into buf. If it's a large enough WRITE request that is going to be
+// accepted, its payload is read from the pipe directly into the FIFO, and
+// @in_fifo is set. Otherwise, the rest of the request goes to buf as usual.
+
+static int read_spliced(struct piperusbfile *xusb, boolean *in_fifo) {
+  struct fuse_in_header *inh = buf;
+  struct fuse_write_in *arg = (void *) &inh[1];
+  unsigned int hdrlen = sizeof(*inh) + sizeof(*arg);
+  int len;
+
+  do {
+    len = splice(xusb->fd, NULL, splice_fds[1], NULL, bufsize, 0);
+  } while ((len < 0) && (errno == EINTR));
+
+  if ((len < 0) && ((errno == EINVAL) || (errno == ENOSYS))) {
+    splice_disable("splice()");
+    return read(xusb->fd, buf, bufsize);
+  }
+
+  if (len < 0)
+    return len;
+
+  if (len < sizeof(*inh)) {
+    errno = EIO; // Shorter than any legal request
+    return -1;
+  }
+
+  // Both headers of a WRITE with a single read()
+  if (hdrlen > len)
+    hdrlen = len;
+
+  if (read_pipe(inh, hdrlen))
+    return -1;
+
+  if ((inh->opcode == FUSE_WRITE) && (hdrlen == sizeof(*inh) + sizeof(*arg))) {
+    unsigned int payload = len - hdrlen;
+
+    if ((payload == arg->size) && (payload >= splice_threshold) &&
+	(payload <= fifo_vacant(xusb->sink->fifo))) {
+      if (piperfifo_write_fd(xusb->sink->fifo,
+			     splice_fds[0], payload) != payload) {
+	errno = EIO;
+	return -1;
+      }
+
+      *in_fifo = true;
+      return len;
+    }
+  }
+
+  if ((len > hdrlen) && read_pipe(buf + hdrlen, len - hdrlen))
+    return -1;
+
+  return len;
+}
+
 static int read_from_cuse(uint32_t events, void *private) {
   int rc;
   struct piperusbfile *xusb = private;
   struct fuse_in_header *inh = buf;
+  boolean in_fifo = false;
 
-  rc = read(xusb->fd, buf, bufsize);
+  if (splice_next(xusb))
+    rc = read_spliced(xusb, &in_fifo);
+  else
+    rc = read(xusb->fd, buf, bufsize);
 
   if ((rc < 0) && (errno == EINTR))
     return 0;
@@ -496,10 +914,13 @@ static int read_from_cuse(uint32_t events, void *private) {
     return 1;
   }
 
-  DEBUG("len = %d, opcode = %d, unique = %ld, nodeid = %ld\n"
-       "uid = %d, gid = %d, pid = %d\n",
-       inh->len, inh->opcode, inh->unique, inh->nodeid,
-       inh->uid, inh->gid, inh->pid);
+  trace(TRACE_CUSE_REQUEST, xusb->fd, inh->unique, inh->opcode);
+  PROBE4(cuse_request, xusb->fd, inh->opcode, inh->unique, inh->len);
+
+  // A writer that sends large WRITEs is likely to send another one
+  xusb->splice_next = (inh->opcode == FUSE_WRITE) &&
+    (inh->len >= sizeof(*inh) + sizeof(struct fuse_write_in) +
+     splice_threshold);
 
   switch (inh->opcode) {
   case CUSE_INIT:
@@ -512,7 +933,7 @@ static int read_from_cuse(uint32_t events, void *private) {
     return process_read(xusb, inh);
 
   case FUSE_WRITE:
-    return process_write(xusb, inh);
+    return process_write(xusb, inh, in_fifo);
 
   case FUSE_RELEASE:
     return process_release(xusb, inh);
@@ -539,11 +960,12 @@ static int read_from_timer(uint32_t events, void *private) {
   rc = read(xusb->timerfd, &ticks, sizeof(ticks));
 
   if (rc == sizeof(ticks)) { // Properly received timer
-    xusb->timer_armed = 0;
+    xusb->timer_armed = false;
 
-    DEBUG("read_from_timer: ticks = %ld\n", ticks);
+    trace(TRACE_TIMER, xusb->fd, 0, 0);
+    PROBE1(timer_fire, xusb->fd);
 
-    xusb->timed_out = 1;
+    xusb->timed_out = true;
     if ((xusb->state == XUSB_OPEN) && xusb->unique_up)
       return try_complete_read(xusb);
     else if ((xusb->state == XUSB_RELEASING) && xusb->unique_down)
@@ -567,93 +989,97 @@ static int read_from_timer(uint32_t events, void *private) {
   return 1;
 }
 
+static int open_cuse(char *name) {
+  int fd = open("/dev/cuse", O_RDWR);
+
+  if (fd < 0) {
+    ERR("While opening /dev/cuse for %s:\n", name);
+    perror("open");
+  }
+
+  return fd;
+}
+
+// Each device file is a CUSE session of its own. A test harness may replace
+// this function, so that the files are served over e.g. a socketpair, with
+// the harness playing the kernel's part. It must be set before any shard
+// starts, and return a file descriptor or -1 on failure.
+
+int (*devfile_open_cuse)(char *name) = open_cuse;
+
+// The file's name is stored right after the struct, in the same
+// cache-aligned allocation.
+
 struct piperusbfile *devfile_init(int pollfd, char *name) {
   struct piperusbfile *xusb;
-  struct pipercallback *c, *timer_callback;
   struct epoll_event event;
 
   size_t namelen = strlen(name) + 1;
 
-  if (!(xusb = malloc(sizeof(*xusb)))) {
+  if (posix_memalign((void **) &xusb, CACHE_LINE, sizeof(*xusb) + namelen)) {
     ERR("Failed to allocate memory for xusb\n");
     return NULL;
   }
 
-  if (!(c = malloc(sizeof(*c)))) {
-    ERR("Failed to allocate memory for callback struct\n");
-    goto err1;
-  }
-
-  if (!(xusb->name = malloc(namelen))) {
-    ERR("Failed to allocate memory for file name\n");
-    goto err2;
-  }
-
+  xusb->name = (char *) &xusb[1];
   memcpy(xusb->name, name, namelen);
 
   xusb->unique_up = 0;
   xusb->unique_down = 0;
   xusb->state = XUSB_CLOSED;
-  xusb->callback = c;
+  xusb->source = NULL;
+  xusb->sink = NULL;
+  xusb->ctl = NULL;
+  xusb->counterpart = NULL;
+  xusb->splice_next = false;
+  memset(&xusb->stats, 0, sizeof(xusb->stats));
 
-  xusb->fd = open("/dev/cuse", O_RDWR);
+  xusb->fd = devfile_open_cuse(name);
 
-  if (xusb->fd < 0) {
-    ERR("While opening /dev/cuse for %s:\n", name);
-    perror("open");
-    goto err3;
-  }
+  if (xusb->fd < 0)
+    goto err1;
 
-  c->callback = read_from_cuse;
-  c->private = xusb;
+  xusb->callback.callback = read_from_cuse;
+  xusb->callback.private = xusb;
 
   // read() is guaranteed to return immediately on EPOLLERR
   event.events = EPOLLIN | EPOLLERR;
-  event.data.ptr = c;
+  event.data.ptr = &xusb->callback;
 
   if (epoll_ctl(pollfd, EPOLL_CTL_ADD, xusb->fd, &event)) {
     perror("epoll_ctl");
-    goto err3;
+    goto err1;
   }
 
-  xusb->timer_armed = 0;
-  xusb->timed_out = 0;
+  xusb->timer_armed = false;
+  xusb->timed_out = false;
+  xusb->interrupted_up = false;
+  xusb->interrupted_down = false;
+  xusb->bulkout_canceled = false;
   xusb->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
 
   if (xusb->timerfd < 0) {
     perror("timerfd_create");
-    goto err4;
-  }
-
-  if (!(timer_callback = malloc(sizeof(*timer_callback)))) {
-    ERR("Failed to allocate memory for callback struct\n");
-    goto err5;
+    goto err2;
   }
-  xusb->timer_callback = timer_callback;
 
-  timer_callback->callback = read_from_timer;
-  timer_callback->private = xusb;
+  xusb->timer_callback.callback = read_from_timer;
+  xusb->timer_callback.private = xusb;
 
   event.events = EPOLLIN;
-  event.data.ptr = timer_callback;
+  event.data.ptr = &xusb->timer_callback;
 
   if (epoll_ctl(pollfd, EPOLL_CTL_ADD, xusb->timerfd, &event)) {
     perror("epoll_ctl");
-    goto err6;
+    goto err3;
   }
 
   return xusb;
 
- err6:
-  free(timer_callback);
- err5:
-  close(xusb->timerfd);
- err4:
-  close(xusb->fd);
  err3:
-  free(xusb->name);
+  close(xusb->timerfd);
  err2:
-  free(c);
+  close(xusb->fd);
  err1:
   free(xusb);
 
@@ -663,13 +1089,42 @@ struct piperusbfile *devfile_init(int pollfd, char *name) {
 void devfile_destroy(struct piperusbfile *xusb) {
   close(xusb->timerfd);
   close(xusb->fd);
-  free(xusb->timer_callback);
-  free(xusb->callback);
-  free(xusb->name);
   free(xusb);
 }
 
-int init_devfile(int global_max_size) {
+static void init_splice(void) {
+  int rc;
+
+  if (pipe2(splice_fds, O_CLOEXEC)) {
+    perror("pipe2");
+    goto disable;
+  }
+
+  // The pipe must be able to hold the largest request or response as a
+  // whole. F_SETPIPE_SZ may fail for lack of privileges.
+
+  rc = fcntl(splice_fds[1], F_SETPIPE_SZ, bufsize);
+
+  if (rc < bufsize) {
+    if (rc < 0)
+      perror("fcntl(F_SETPIPE_SZ)");
+
+    close(splice_fds[0]);
+    close(splice_fds[1]);
+    goto disable;
+  }
+
+  INFO("CUSE payloads of %d bytes and above go through splice()\n",
+       splice_threshold);
+  return;
+
+ disable:
+  INFO("Not using splice() for CUSE payloads\n");
+  splice_fds[0] = splice_fds[1] = -1;
+  splice_threshold = 0;
+}
+
+int init_devfile(int global_max_size, int global_splice_threshold) {
   int max_in = sizeof(struct fuse_in_header) + sizeof(struct fuse_read_in);
   int max_out =  sizeof(struct fuse_out_header) +
     sizeof(struct fuse_write_out);
@@ -690,10 +1145,20 @@ int init_devfile(int global_max_size) {
     return 1;
   }
 
+  splice_threshold = global_splice_threshold;
+
+  if (splice_threshold)
+    init_splice();
+
   return 0;
 }
 
 void deinit_devfile(void) {
+  if (splice_threshold) {
+    close(splice_fds[0]);
+    close(splice_fds[1]);
+  }
+
   free(buf);
   free(complbuf);
 }
@@ -0,0 +1,616 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "usbpiper.h"
+
+// Correctness and speed of the piperfifo ring buffer (fifo.c), and of a
+// couple of alternative implementations to compare it with. The fuzzer runs
+// random sequences of operations against a trivial reference model, and the
+// benchmark measures throughput across chunk sizes, FIFO sizes and the
+// alignment of the chunks relative to the wrap-around point.
+
+struct piperconfig config = { .log_level = LOGLEVEL_ERR }; // For fifo.c
+
+// The implementations under test, through a common interface. limit() may
+// be NULL if it's not supported.
+
+struct fifoimpl {
+  const char *name;
+  boolean pow2; // Size must be a power of two
+  void *(*new)(unsigned int size);
+  void (*destroy)(void *f);
+  unsigned int (*write)(void *f, void *data, unsigned int len);
+  unsigned int (*read)(void *f, void *data, unsigned int len);
+  unsigned int (*limit)(void *f, unsigned int len);
+  unsigned int (*fill)(void *f);
+};
+
+static void *piper_new(unsigned int size) {
+  return piperfifo_new(size);
+}
+
+static void piper_destroy(void *f) {
+  piperfifo_destroy(f);
+}
+
+static unsigned int piper_write(void *f, void *data, unsigned int len) {
+  return piperfifo_write(f, data, len);
+}
+
+static unsigned int piper_read(void *f, void *data, unsigned int len) {
+  return piperfifo_read(f, data, len);
+}
+
+static unsigned int piper_limit(void *f, unsigned int len) {
+  return piperfifo_limit(f, len);
+}
+
+static unsigned int piper_fill(void *f) {
+  return fifo_fill(f);
+}
+
+// Alternative 1: Power-of-two size, free-running 32-bit positions that are
+// masked on access, and no fill counter.
+
+struct maskfifo {
+  unsigned char *mem;
+  uint32_t mask;
+  uint32_t head; // Write position
+  uint32_t tail; // Read position
+};
+
+static void *mask_new(unsigned int size) {
+  struct maskfifo *f = calloc(1, sizeof(*f));
+
+  if (!f || !(f->mem = malloc(size))) {
+    free(f);
+    return NULL;
+  }
+
+  f->mask = size - 1;
+  return f;
+}
+
+static void mask_destroy(void *p) {
+  struct maskfifo *f = p;
+
+  free(f->mem);
+  free(f);
+}
+
+static unsigned int mask_write(void *p, void *data, unsigned int len) {
+  struct maskfifo *f = p;
+  uint32_t vacant = f->mask + 1 - (f->head - f->tail);
+  uint32_t pos = f->head & f->mask;
+  uint32_t first;
+
+  if (len > vacant)
+    len = vacant;
+
+  first = f->mask + 1 - pos;
+
+  if (first > len)
+    first = len;
+
+  memcpy(f->mem + pos, data, first);
+  memcpy(f->mem, (unsigned char *) data + first, len - first);
+  f->head += len;
+
+  return len;
+}
+
+static unsigned int mask_read(void *p, void *data, unsigned int len) {
+  struct maskfifo *f = p;
+  uint32_t fill = f->head - f->tail;
+  uint32_t pos = f->tail & f->mask;
+  uint32_t first;
+
+  if (len > fill)
+    len = fill;
+
+  first = f->mask + 1 - pos;
+
+  if (first > len)
+    first = len;
+
+  memcpy(data, f->mem + pos, first);
+  memcpy((unsigned char *) data + first, f->mem, len - first);
+  f->tail += len;
+
+  return len;
+}
+
+static unsigned int mask_limit(void *p, unsigned int len) {
+  struct maskfifo *f = p;
+  uint32_t fill = f->head - f->tail;
+
+  if (fill <= len)
+    return 0;
+
+  f->head -= fill - len;
+  return fill - len;
+}
+
+static unsigned int mask_fill(void *p) {
+  struct maskfifo *f = p;
+
+  return f->head - f->tail;
+}
+
+// Alternative 2: The buffer is mapped twice, back to back, so that data
+// is always contiguous and every access is a single memcpy(). The size
+// must be a multiple of the page size.
+
+struct mirrorfifo {
+  unsigned char *mem;
+  unsigned int size;
+  unsigned int fill;
+  unsigned int readpos;
+};
+
+static void *mirror_new(unsigned int size) {
+  struct mirrorfifo *f;
+  unsigned char *mem;
+  int fd;
+
+  if (size % sysconf(_SC_PAGESIZE))
+    return NULL;
+
+  if ((fd = memfd_create("fifo-bench", 0)) < 0)
+    return NULL;
+
+  if (ftruncate(fd, size))
+    goto fail;
+
+  mem = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (mem == MAP_FAILED)
+    goto fail;
+
+  if ((mmap(mem, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+	    fd, 0) == MAP_FAILED) ||
+      (mmap(mem + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+	    fd, 0) == MAP_FAILED)) {
+    munmap(mem, 2 * size);
+    goto fail;
+  }
+
+  close(fd);
+
+  if (!(f = calloc(1, sizeof(*f)))) {
+    munmap(mem, 2 * size);
+    return NULL;
+  }
+
+  f->mem = mem;
+  f->size = size;
+  return f;
+
+ fail:
+  close(fd);
+  return NULL;
+}
+
+static void mirror_destroy(void *p) {
+  struct mirrorfifo *f = p;
+
+  munmap(f->mem, 2 * f->size);
+  free(f);
+}
+
+static unsigned int mirror_write(void *p, void *data, unsigned int len) {
+  struct mirrorfifo *f = p;
+  unsigned int writepos = f->readpos + f->fill;
+
+  if (len > f->size - f->fill)
+    len = f->size - f->fill;
+
+  if (writepos >= f->size)
+    writepos -= f->size;
+
+  memcpy(f->mem + writepos, data, len);
+  f->fill += len;
+
+  return len;
+}
+
+static unsigned int mirror_read(void *p, void *data, unsigned int len) {
+  struct mirrorfifo *f = p;
+
+  if (len > f->fill)
+    len = f->fill;
+
+  memcpy(data, f->mem + f->readpos, len);
+  f->fill -= len;
+  f->readpos += len;
+
+  if (f->readpos >= f->size)
+    f->readpos -= f->size;
+
+  return len;
+}
+
+static unsigned int mirror_limit(void *p, unsigned int len) {
+  struct mirrorfifo *f = p;
+  unsigned int n;
+
+  if (f->fill <= len)
+    return 0;
+
+  n = f->fill - len;
+  f->fill = len;
+  return n;
+}
+
+static unsigned int mirror_fill(void *p) {
+  struct mirrorfifo *f = p;
+
+  return f->fill;
+}
+
+static const struct fifoimpl impls[] = {
+  { "piperfifo", false, piper_new, piper_destroy, piper_write, piper_read,
+    piper_limit, piper_fill },
+  { "mask", true, mask_new, mask_destroy, mask_write, mask_read,
+    mask_limit, mask_fill },
+  { "mirror", true, mirror_new, mirror_destroy, mirror_write, mirror_read,
+    mirror_limit, mirror_fill },
+};
+
+#define NUM_IMPLS (sizeof(impls) / sizeof(impls[0]))
+
+static uint64_t rng_state = 1;
+
+static uint32_t rnd(void) {
+  uint64_t x = rng_state;
+
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  rng_state = x;
+
+  return x >> 16;
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// The reference model: A plain array with the oldest byte first
+
+struct model {
+  unsigned char *data;
+  unsigned int size;
+  unsigned int fill;
+};
+
+static int failures;
+
+#define CHECK(cond, ...)						\
+  if (!(cond)) {							\
+    fprintf(stderr, "%s, size %u, op %lu: ", impl->name, size, op);	\
+    fprintf(stderr, __VA_ARGS__);					\
+    failures++;								\
+    goto out;								\
+  }
+
+// A random length, biased towards small values and the interesting
+// neighbourhood of @size.
+
+static unsigned int rnd_len(unsigned int size) {
+  switch (rnd() % 4) {
+  case 0: return rnd() % 16;
+  case 1: return rnd() % (size + 2);
+  case 2: return ((size > 8) ? size - 8 : 0) + rnd() % 16;
+  default: return rnd() % (size / 4 + 1);
+  }
+}
+
+static void fuzz_one(const struct fifoimpl *impl, unsigned int size,
+		     unsigned long ops) {
+  struct model m = { .size = size };
+  unsigned char *buf, *out;
+  unsigned long op;
+  unsigned int len, rc, i;
+  void *f;
+
+  if (!(f = impl->new(size)))
+    return; // E.g. mirror with a size that isn't a multiple of pages
+
+  buf = malloc(size + 16);
+  out = malloc(size + 16);
+  m.data = malloc(size);
+
+  if (!buf || !out || !m.data) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+
+  for (op=0; op<ops; op++) {
+    len = rnd_len(size);
+
+    switch (rnd() % 8) {
+    case 0: case 1: case 2: // Write
+      for (i=0; i<len; i++)
+	buf[i] = rnd();
+
+      rc = impl->write(f, buf, len);
+
+      CHECK(rc == ((len < size - m.fill) ? len : size - m.fill),
+	    "write(%u) returned %u with fill %u\n", len, rc, m.fill);
+
+      memcpy(m.data + m.fill, buf, rc);
+      m.fill += rc;
+      break;
+
+    case 3: case 4: case 5: // Read
+      rc = impl->read(f, out, len);
+
+      CHECK(rc == ((len < m.fill) ? len : m.fill),
+	    "read(%u) returned %u with fill %u\n", len, rc, m.fill);
+      CHECK(!memcmp(out, m.data, rc), "read(%u) returned wrong data\n", len);
+
+      memmove(m.data, m.data + rc, m.fill - rc);
+      m.fill -= rc;
+      break;
+
+    case 6: // Unwind the last written data, possibly across the wrap point
+      if (!impl->limit)
+	break;
+
+      len = m.fill ? rnd() % (m.fill + 1) : 0;
+      rc = impl->limit(f, len);
+
+      CHECK(rc == ((m.fill > len) ? m.fill - len : 0),
+	    "limit(%u) returned %u with fill %u\n", len, rc, m.fill);
+
+      if (m.fill > len)
+	m.fill = len;
+      break;
+
+    case 7: // Zero-copy access and resizing (piperfifo only)
+      if (impl->new != piper_new)
+	break;
+
+      if (!(rnd() % 4)) {
+	// Resize to anything the content fits in and back, which moves the
+	// content to the beginning of the new buffer, also when it wrapped
+	unsigned int tmp = m.fill + rnd() % (size - m.fill + 1);
+
+	if (!tmp)
+	  tmp = 1;
+
+	CHECK(!m.fill || piperfifo_resize(f, m.fill - 1),
+	      "resize(%u) succeeded with fill %u\n", m.fill - 1, m.fill);
+	CHECK(!piperfifo_resize(f, tmp), "resize(%u) failed with fill %u\n",
+	      tmp, m.fill);
+	CHECK(!piperfifo_resize(f, size), "resize(%u) back failed\n", size);
+      } else if (rnd() & 1) {
+	struct iovec iov[2];
+	unsigned int off = 0;
+	int n = piperfifo_peek_iov(f, iov, len);
+	unsigned int expect = (len < m.fill) ? len : m.fill;
+
+	for (i=0; i<n; i++) {
+	  CHECK(off + iov[i].iov_len <= expect, "peek_iov() overran\n");
+	  CHECK(!memcmp(iov[i].iov_base, m.data + off, iov[i].iov_len),
+		"peek_iov() pointed at wrong data\n");
+	  off += iov[i].iov_len;
+	}
+
+	CHECK(off == expect, "peek_iov() covered %u of %u bytes\n",
+	      off, expect);
+
+	rc = piperfifo_drop(f, off);
+	CHECK(rc == off, "drop(%u) returned %u\n", off, rc);
+
+	memmove(m.data, m.data + off, m.fill - off);
+	m.fill -= off;
+      } else {
+	int fds[2];
+	int frc;
+
+	if (pipe(fds)) {
+	  perror("pipe");
+	  exit(1);
+	}
+
+	if (len > 65536) // Don't fill the pipe
+	  len = 65536;
+
+	for (i=0; i<len; i++)
+	  buf[i] = rnd();
+
+	if (len && (write(fds[1], buf, len) != len)) {
+	  perror("write to pipe");
+	  exit(1);
+	}
+
+	close(fds[1]);
+	frc = piperfifo_write_fd(f, fds[0], len + rnd() % 8);
+	close(fds[0]);
+
+	rc = (len < size - m.fill) ? len : size - m.fill;
+	CHECK(frc == rc, "write_fd(%u) returned %d with fill %u\n",
+	      len, frc, m.fill);
+
+	memcpy(m.data + m.fill, buf, rc);
+	m.fill += rc;
+      }
+      break;
+    }
+
+    CHECK(impl->fill(f) == m.fill, "fill is %u, expected %u\n",
+	  impl->fill(f), m.fill);
+  }
+
+ out:
+  impl->destroy(f);
+  free(buf);
+  free(out);
+  free(m.data);
+}
+
+static void fuzz(unsigned long ops) {
+  static const unsigned int sizes[] = { 1, 2, 3, 7, 64, 1000, 4096, 8192 };
+  int i, s;
+
+  for (i=0; i<NUM_IMPLS; i++)
+    for (s=0; s<sizeof(sizes)/sizeof(sizes[0]); s++) {
+      unsigned int size = sizes[s];
+
+      if (impls[i].pow2 && (size & (size - 1)))
+	continue;
+
+      fuzz_one(&impls[i], size, ops);
+    }
+
+  printf("Fuzz: %lu operations per FIFO size and implementation, "
+	 "%d failures\n", ops, failures);
+}
+
+// Write and read @chunk bytes at a time, with @offset bytes in the FIFO
+// all along, so that the chunks cross the wrap-around point at different
+// positions. Returns GB/s of data that went through the FIFO.
+
+static double bench_one(const struct fifoimpl *impl, unsigned int size,
+			unsigned int chunk, unsigned int offset,
+			double seconds) {
+  unsigned char *buf;
+  uint64_t bytes = 0, start, elapsed;
+  unsigned int i;
+  void *f;
+
+  if ((chunk + offset > size) || !(f = impl->new(size)))
+    return -1;
+
+  if (!(buf = malloc(chunk + offset))) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+
+  memset(buf, 0x5a, chunk + offset);
+  impl->write(f, buf, offset);
+
+  start = now_ns();
+
+  do {
+    for (i=0; i<1000; i++) {
+      impl->write(f, buf, chunk);
+      impl->read(f, buf, chunk);
+    }
+
+    bytes += 1000ULL * chunk;
+    elapsed = now_ns() - start;
+  } while (elapsed < seconds * 1e9);
+
+  impl->destroy(f);
+  free(buf);
+
+  return bytes / (double) elapsed;
+}
+
+static void bench(double seconds) {
+  static const unsigned int sizes[] = { 65536, 262144, 4194304 };
+  static const unsigned int chunks[] = { 64, 512, 4096, 65536 };
+  static const unsigned int offsets[] = { 0, 1, 7, 2048 };
+  int s, c, o, i;
+
+  printf("\n%-10s %8s %6s %6s", "", "size", "chunk", "offset");
+
+  for (i=0; i<NUM_IMPLS; i++)
+    printf(" %10s", impls[i].name);
+
+  printf("  (GB/s)\n");
+
+  for (s=0; s<sizeof(sizes)/sizeof(sizes[0]); s++)
+    for (c=0; c<sizeof(chunks)/sizeof(chunks[0]); c++)
+      for (o=0; o<sizeof(offsets)/sizeof(offsets[0]); o++) {
+	printf("%-10s %8u %6u %6u", "", sizes[s], chunks[c], offsets[o]);
+
+	for (i=0; i<NUM_IMPLS; i++) {
+	  double gbps = bench_one(&impls[i], sizes[s], chunks[c],
+				  offsets[o], seconds);
+
+	  if (gbps < 0)
+	    printf(" %10s", "-");
+	  else
+	    printf(" %10.2f", gbps);
+	}
+
+	printf("\n");
+	fflush(stdout);
+      }
+}
+
+static void usage(char *prog) {
+  fprintf(stderr,
+	  "Usage: %s [options]\n\n"
+	  "  -f, --fuzz N                Fuzz with N operations per case\n"
+	  "                              (default 200000, 0 = skip)\n"
+	  "  -b, --bench SECONDS         Benchmark for SECONDS per case\n"
+	  "                              (default 0.1, 0 = skip)\n"
+	  "  -s, --seed N                Random seed for the fuzzer\n"
+	  "  -h, --help                  This help\n",
+	  prog);
+}
+
+int main(int argc, char **argv) {
+  static const struct option long_options[] = {
+    { "fuzz", required_argument, NULL, 'f' },
+    { "bench", required_argument, NULL, 'b' },
+    { "seed", required_argument, NULL, 's' },
+    { "help", no_argument, NULL, 'h' },
+    { }
+  };
+
+  unsigned long ops = 200000;
+  double seconds = 0.1;
+  int c;
+
+  while ((c = getopt_long(argc, argv, "f:b:s:h", long_options, NULL)) != -1) {
+    switch (c) {
+    case 'f':
+      ops = strtoul(optarg, NULL, 0);
+      break;
+
+    case 'b':
+      seconds = atof(optarg);
+      break;
+
+    case 's':
+      rng_state = strtoull(optarg, NULL, 0);
+
+      if (!rng_state)
+	rng_state = 1;
+      break;
+
+    case 'h':
+      usage(argv[0]);
+      return 0;
+
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (ops)
+    fuzz(ops);
+
+  if (seconds > 0)
+    bench(seconds);
+
+  return failures ? 1 : 0;
+}
@@ -1,25 +1,22 @@
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 
 #include "usbpiper.h"
-struct piperfifo *piperfifo_new(unsigned int size) {
-  struct piperfifo *fifo;
 
-  if (!(fifo = malloc(sizeof(*fifo)))) {
-    ERR("Failed to allocate memory for FIFO struct\n");
-    return NULL;
-  }
+static void *fifo_mem_alloc(unsigned int size, boolean *huge) {
+  unsigned char *buf;
 
-  if (!(fifo->mem = malloc(size))) {
-    free(fifo);
+  if (!(buf = piper_alloc(size, "FIFO", huge))) {
     ERR("Failed to allocate memory for FIFO\n");
     return NULL;
   }
 
-  if (mlock(fifo->mem, size)) {
+  if (mlock(buf, size)) {
     unsigned int i;
-    unsigned char *buf = fifo->mem;
 
     WARN("Warning: Failed to lock RAM, so FIFO's memory may swap to disk.\n"
 	 "(You may want to use ulimit -l)\n");
@@ -31,10 +28,41 @@ struct piperfifo *piperfifo_new(unsigned int size) {
       buf[i] = 0;
   }
 
+  return buf;
+}
+
+static void fifo_mem_free(void *mem, unsigned int size, boolean huge) {
+  munlock(mem, size);
+  piper_free(mem, size, huge);
+}
+
+// Set up a FIFO struct that is part of another one, without memory, e.g.
+// of an endpoint whose file isn't open (see --lazy). piperfifo_get_mem()
+// must be called before it's used, and piperfifo_put_mem() when done.
+void piperfifo_init(struct piperfifo *fifo, unsigned int size) {
+  fifo->mem = NULL;
+  fifo->huge = false;
   fifo->size = size;
   fifo->fill = 0;
+  fifo->highwater = 0;
   fifo->readpos = 0;
   fifo->writepos = 0;
+}
+
+struct piperfifo *piperfifo_new(unsigned int size) {
+  struct piperfifo *fifo;
+
+  if (!(fifo = malloc(sizeof(*fifo)))) {
+    ERR("Failed to allocate memory for FIFO struct\n");
+    return NULL;
+  }
+
+  piperfifo_init(fifo, size);
+
+  if (piperfifo_get_mem(fifo)) {
+    free(fifo);
+    return NULL;
+  }
 
   return fifo;
 }
@@ -43,12 +71,77 @@ void piperfifo_destroy(struct piperfifo *fifo) {
   if (!fifo)
     return; // Better safe than SEGV
 
-  munlock(fifo->mem, fifo->size);
+  if (fifo->mem)
+    fifo_mem_free(fifo->mem, fifo->size, fifo->huge);
 
-  free(fifo->mem);
   free(fifo);
 }
 
+// Memory from the pool (see hugepage.c) if there's a block of the right
+// size there, or else a fresh allocation. Returns 1 on failure.
+int piperfifo_get_mem(struct piperfifo *fifo) {
+  if (fifo->mem)
+    return 0;
+
+  if (!(fifo->mem = pool_get(fifo->size, POOL_FIFO, &fifo->huge)) &&
+      !(fifo->mem = fifo_mem_alloc(fifo->size, &fifo->huge)))
+    return 1;
+
+  return 0;
+}
+
+// Return the memory to the pool (if @pool), or free it. The content is
+// discarded.
+void piperfifo_put_mem(struct piperfifo *fifo, boolean pool) {
+  if (!fifo->mem)
+    return;
+
+  if (!pool || !pool_put(fifo->mem, fifo->size, POOL_FIFO, fifo->huge))
+    fifo_mem_free(fifo->mem, fifo->size, fifo->huge);
+
+  fifo->mem = NULL;
+  fifo->fill = 0;
+  fifo->readpos = 0;
+  fifo->writepos = 0;
+}
+
+// Change the FIFO's size to @size, keeping its content, which is moved to
+// the beginning of the new memory buffer, so it doesn't wrap around there.
+// Returns 1 if the content doesn't fit or there's no memory, in which case
+// the FIFO is unchanged. Nothing may hold pointers from
+// piperfifo_peek_iov() across this call.
+int piperfifo_resize(struct piperfifo *fifo, unsigned int size) {
+  unsigned int fill = fifo->fill;
+  boolean huge;
+  void *mem;
+
+  if ((size == 0) || (size < fill))
+    return 1;
+
+  if (!fifo->mem) { // Idle, so just allocate the new size later
+    fifo->size = size;
+    return 0;
+  }
+
+  if (!(mem = fifo_mem_alloc(size, &huge)))
+    return 1;
+
+  piperfifo_read(fifo, mem, fill); // Copies across the wrap point
+  fifo_mem_free(fifo->mem, fifo->size, fifo->huge);
+
+  fifo->mem = mem;
+  fifo->huge = huge;
+  fifo->size = size;
+  fifo->fill = fill;
+  fifo->readpos = 0;
+  fifo->writepos = (fill == size) ? 0 : fill;
+
+  if (fifo->highwater > size)
+    fifo->highwater = size;
+
+  return 0;
+}
+
 unsigned int piperfifo_write(struct piperfifo *fifo,
 			     void *data, unsigned int len) {
   unsigned int done = 0;
@@ -59,8 +152,11 @@ unsigned int piperfifo_write(struct piperfifo *fifo,
     unsigned int nrail = fifo->size - fifo->writepos;
     unsigned int n = (todo > nmax) ? nmax : todo;
 
-    if (n == 0)
+    if (n == 0) {
+      if (fifo->fill > fifo->highwater)
+	fifo->highwater = fifo->fill;
       return done;
+    }
 
     if (n > nrail)
       n = nrail;
@@ -125,3 +221,91 @@ unsigned int piperfifo_limit(struct piperfifo *fifo,
 
   return n;
 }
+
+// Fill @iov with up to two entries that describe the first @len bytes in
+// the FIFO (or all of it, if it contains less), without consuming them.
+// Returns the number of iov entries used.
+int piperfifo_peek_iov(struct piperfifo *fifo, struct iovec *iov,
+		       unsigned int len) {
+  unsigned int nrail = fifo->size - fifo->readpos;
+  int n = 0;
+
+  if (len > fifo->fill)
+    len = fifo->fill;
+
+  if (len == 0)
+    return 0;
+
+  iov[n].iov_base = fifo->mem + fifo->readpos;
+  iov[n].iov_len = (len > nrail) ? nrail : len;
+  len -= iov[n++].iov_len;
+
+  if (len) {
+    iov[n].iov_base = fifo->mem;
+    iov[n++].iov_len = len;
+  }
+
+  return n;
+}
+
+// Consume @len bytes from the FIFO without copying them, typically after
+// piperfifo_peek_iov(). Returns the number of bytes dropped.
+unsigned int piperfifo_drop(struct piperfifo *fifo,
+			    unsigned int len) {
+  if (len > fifo->fill)
+    len = fifo->fill;
+
+  fifo->readpos += len;
+  if (fifo->readpos >= fifo->size)
+    fifo->readpos -= fifo->size;
+
+  fifo->fill -= len;
+
+  return len;
+}
+
+// Like piperfifo_write(), but the data is read() directly from @fd into
+// the FIFO's memory. Returns the number of bytes written into the FIFO, or
+// -1 on failure (with errno set). A short count means EOF on @fd or that
+// the FIFO is full.
+int piperfifo_write_fd(struct piperfifo *fifo,
+		       int fd, unsigned int len) {
+  unsigned int done = 0;
+  unsigned int todo = len;
+
+  while (1) {
+    unsigned int nmax = fifo->size - fifo->fill;
+    unsigned int nrail = fifo->size - fifo->writepos;
+    unsigned int n = (todo > nmax) ? nmax : todo;
+    int rc;
+
+    if (n == 0) {
+      if (fifo->fill > fifo->highwater)
+	fifo->highwater = fifo->fill;
+      return done;
+    }
+
+    if (n > nrail)
+      n = nrail;
+
+    rc = read(fd, fifo->mem + fifo->writepos, n);
+
+    if ((rc < 0) && (errno == EINTR))
+      continue;
+
+    if (rc < 0)
+      return -1;
+
+    if (rc == 0)
+      return done;
+
+    done += rc;
+    todo -= rc;
+
+    fifo->writepos += rc;
+    fifo->fill += rc;
+
+    if (fifo->writepos == fifo->size)
+      fifo->writepos = 0;
+  }
+}
@@ -0,0 +1,45 @@
+#include "histogram.h"
+
+// The highest value that falls into bucket @i
+
+static uint64_t hist_upper(int i) {
+  int e, shift;
+  uint64_t sub;
+
+  if (i < (1 << HIST_SUB_BITS))
+    return i;
+
+  e = (i >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+  shift = e - HIST_SUB_BITS;
+  sub = i & ((1 << HIST_SUB_BITS) - 1);
+
+  return ((1ULL << e) | (sub << shift)) + (1ULL << shift) - 1;
+}
+
+// Returns the value below which @fraction (e.g. 0.99) of the values are,
+// to the bucket's resolution. Never more than the actual maximum.
+
+uint64_t hist_percentile(struct piperhist *h, double fraction) {
+  uint64_t target, seen = 0;
+  uint64_t v;
+  int i;
+
+  if (!h->count)
+    return 0;
+
+  target = fraction * h->count;
+
+  if (target >= h->count)
+    target = h->count - 1;
+
+  for (i=0; i<HIST_BUCKETS; i++) {
+    seen += h->bucket[i];
+
+    if (seen > target)
+      break;
+  }
+
+  v = hist_upper(i);
+
+  return (v < h->max) ? v : h->max;
+}
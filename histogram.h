@@ -0,0 +1,45 @@
+#ifndef _HISTOGRAM_H
+#define _HISTOGRAM_H
+
+#include <stdint.h>
+
+// Log-linear histogram of nanosecond values: Each power of two is split
+// into 2^HIST_SUB_BITS buckets, so any value is known within ~6%. The
+// memory is fixed, and adding a value is a handful of instructions.
+
+#define HIST_SUB_BITS 3
+#define HIST_MAX_BITS 40 // 2^40 ns is about 18 minutes. Above that, clamp.
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 2) << HIST_SUB_BITS)
+
+struct piperhist {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t bucket[HIST_BUCKETS];
+};
+
+static inline int hist_index(uint64_t v) {
+  int e, i;
+
+  if (v < (1 << HIST_SUB_BITS))
+    return v;
+
+  e = 63 - __builtin_clzll(v); // floor(log2(v))
+
+  i = ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) |
+    ((v >> (e - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+
+  return (i < HIST_BUCKETS) ? i : HIST_BUCKETS - 1;
+}
+
+static inline void hist_add(struct piperhist *h, uint64_t v) {
+  h->count++;
+  h->sum += v;
+  if (v > h->max)
+    h->max = v;
+  h->bucket[hist_index(v)]++;
+}
+
+uint64_t hist_percentile(struct piperhist *h, double fraction);
+
+#endif
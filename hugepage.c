@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "usbpiper.h"
+
+// Memory for FIFOs and TD buffers. With --huge-pages, large allocations
+// are backed by 2 MiB pages, so that the memcpy() paths don't miss the TLB
+// every 4 kiB: From the hugetlbfs pool if pages have been reserved there
+// (/proc/sys/vm/nr_hugepages), or else with a 2 MiB aligned mapping that
+// is marked for transparent huge pages. Small allocations, all of them
+// without --huge-pages, and those that get no huge pages either way just
+// use malloc(). So whether a block was mapped can't be told from its size,
+// and its owner keeps that, for piper_free(). See also the pool below.
+
+#define HUGE_SIZE (2UL << 20)
+#define HUGE_WASTE 4 // At most 1/HUGE_WASTE of a mapping may be padding
+
+static size_t huge_round(size_t size) {
+  return (size + HUGE_SIZE - 1) & ~(HUGE_SIZE - 1);
+}
+
+// Only allocations that fill most of their 2 MiB pages get them. E.g. a
+// 256 kiB FIFO would otherwise take (and with mlock(), pin) a whole page.
+
+static boolean use_huge(size_t size) {
+  size_t mapped = huge_round(size);
+
+  return config.huge_pages && size && (mapped - size <= mapped / HUGE_WASTE);
+}
+
+// Whether THP is enabled for madvise()d regions at all
+
+static boolean thp_available(void) {
+  static int available = -1;
+  char buf[64];
+  ssize_t len;
+  int fd;
+
+  if (available >= 0)
+    return available;
+
+  available = 0;
+
+  fd = open("/sys/kernel/mm/transparent_hugepage/enabled", O_RDONLY);
+
+  if (fd < 0)
+    return available;
+
+  len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+
+  if (len > 0) {
+    buf[len] = 0;
+    available = !strstr(buf, "[never]");
+  }
+
+  return available;
+}
+
+// A mapping of @size (a multiple of HUGE_SIZE) that begins on a HUGE_SIZE
+// boundary, so THP can cover all of it
+
+static void *thp_map(size_t size) {
+  unsigned char *p, *aligned;
+
+  p = mmap(NULL, size + HUGE_SIZE, PROT_READ | PROT_WRITE,
+	   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (p == MAP_FAILED)
+    return NULL;
+
+  aligned = (void *) (((uintptr_t) p + HUGE_SIZE - 1) & ~(HUGE_SIZE - 1));
+
+  if (aligned > p)
+    munmap(p, aligned - p);
+
+  munmap(aligned + size, (p + HUGE_SIZE) - aligned);
+
+  return aligned;
+}
+
+// @what is for the log message. *@huge is set to whether the block is a
+// mapping of huge pages, which piper_free() must be told. Returns NULL on
+// failure.
+
+void *piper_alloc(size_t size, const char *what, boolean *huge) {
+  void *mem;
+
+  size_t mapped = huge_round(size);
+
+  *huge = false;
+
+  if (!use_huge(size)) {
+    if (config.huge_pages)
+      DEBUG("%s: %lu kiB in regular pages\n", what,
+	    (unsigned long) size >> 10);
+    return malloc(size);
+  }
+
+  mem = mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+  if (mem != MAP_FAILED) {
+    INFO("%s: %lu kiB mapped for %lu kiB, in hugetlbfs pages\n", what,
+	 (unsigned long) mapped >> 10, (unsigned long) size >> 10);
+    *huge = true;
+    return mem;
+  }
+
+  // Without huge pages, the padding of the mapping would only be wasted
+  if (thp_available() && (mem = thp_map(mapped))) {
+    if (!madvise(mem, mapped, MADV_HUGEPAGE)) {
+      INFO("%s: %lu kiB mapped for %lu kiB, in transparent huge pages\n",
+	   what, (unsigned long) mapped >> 10, (unsigned long) size >> 10);
+      *huge = true;
+      return mem;
+    }
+
+    munmap(mem, mapped);
+  }
+
+  WARN("%s: No huge pages available, %lu kiB in regular pages\n",
+       what, (unsigned long) size >> 10);
+
+  return malloc(size);
+}
+
+void piper_free(void *mem, size_t size, boolean huge) {
+  if (!huge) {
+    free(mem);
+    return;
+  }
+
+  if (mem)
+    munmap(mem, huge_round(size));
+}
+
+// With --lazy, the FIFO memory and TD buffers of endpoints whose files are
+// closed go back to a pool shared by all shards, up to config.pool_size
+// bytes, so that opening a file usually doesn't allocate (and mlock())
+// anything. Blocks are reused only for the same size and kind, as FIFO
+// memory is locked and TD buffers aren't. An idle block holds the pool's
+// list node in its first bytes.
+
+struct poolblock {
+  struct poolblock *next;
+  size_t size;
+  enum piperpool kind;
+  boolean huge; // As set by piper_alloc()
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct poolblock *pool;
+static size_t pool_bytes;
+
+// Returns NULL if there's no such block in the pool. *@huge is set as by
+// piper_alloc().
+
+void *pool_get(size_t size, enum piperpool kind, boolean *huge) {
+  struct poolblock **p, *block;
+
+  pthread_mutex_lock(&pool_lock);
+
+  for (p = &pool; (block = *p); p = &block->next)
+    if ((block->size == size) && (block->kind == kind)) {
+      *p = block->next;
+      pool_bytes -= size;
+      *huge = block->huge;
+      break;
+    }
+
+  pthread_mutex_unlock(&pool_lock);
+
+  return block;
+}
+
+// Returns false if the pool is full, so the caller frees @mem instead
+
+boolean pool_put(void *mem, size_t size, enum piperpool kind, boolean huge) {
+  struct poolblock *block = mem;
+  boolean kept = false;
+
+  if (!mem || (size < sizeof(*block)))
+    return false;
+
+  pthread_mutex_lock(&pool_lock);
+
+  if (pool_bytes + size <= config.pool_size) {
+    block->size = size;
+    block->kind = kind;
+    block->huge = huge;
+    block->next = pool;
+    pool = block;
+    pool_bytes += size;
+    kept = true;
+  }
+
+  pthread_mutex_unlock(&pool_lock);
+
+  return kept;
+}
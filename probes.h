@@ -0,0 +1,26 @@
+#ifndef _PROBES_H
+#define _PROBES_H
+
+// USDT probes for SystemTap, bpftrace, perf etc., under the "usbpiper"
+// provider. With sys/sdt.h, each probe is a single NOP in the code until
+// a tracer attaches to it. Without it, the probes compile to nothing.
+// See the bpftrace/ directory for scripts that use them.
+
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+
+#define PROBE1(name, a) DTRACE_PROBE1(usbpiper, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(usbpiper, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(usbpiper, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(usbpiper, name, a, b, c, d)
+#define PROBE5(name, a, b, c, d, e) \
+  DTRACE_PROBE5(usbpiper, name, a, b, c, d, e)
+#else
+#define PROBE1(name, a)
+#define PROBE2(name, a, b)
+#define PROBE3(name, a, b, c)
+#define PROBE4(name, a, b, c, d)
+#define PROBE5(name, a, b, c, d, e)
+#endif
+
+#endif
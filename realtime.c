@@ -0,0 +1,108 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "usbpiper.h"
+
+// Options against latency spikes from being preempted, migrated or paged:
+// --rt-priority for the shards, --shard-cpus and --worker-cpus for CPU
+// affinity and --mlockall. None of them is required for the daemon to
+// work, so a failure (typically for lack of privileges) is only a warning.
+
+#define STACK_PREFAULT (256 << 10) // Bytes of stack touched in advance
+
+// Touch the stack that the thread is going to use, so that it's mapped
+// (and locked, after mlockall()) before the first request arrives.
+// noinline, or the array would be folded into the caller's frame.
+
+static void __attribute__((noinline)) prefault_stack(void) {
+  unsigned char stack[STACK_PREFAULT];
+
+  memset(stack, 0, sizeof(stack));
+
+  // Keep the compiler from dropping the memset() of an unused array
+  __asm__ __volatile__("" : : "r" (stack) : "memory");
+}
+
+// Called once at startup, before any thread is created. Returns 0 also if
+// the memory couldn't be locked.
+
+int realtime_lock_memory(void) {
+  if (!config.mlockall)
+    return 0;
+
+  if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+    WARN("Failed to lock the daemon's memory: %s\n"
+	 "(Needs CAP_IPC_LOCK or a larger ulimit -l)\n", strerror(errno));
+    return 0;
+  }
+
+  prefault_stack();
+  INFO("All memory locked in RAM, current and future\n");
+
+  return 0;
+}
+
+static void set_affinity(const char *name, const int *cpus, int num_cpus) {
+  char list[128];
+  cpu_set_t set;
+  int i, rc, len = 0;
+
+  CPU_ZERO(&set);
+  list[0] = 0;
+
+  for (i=0; i<num_cpus; i++) {
+    CPU_SET(cpus[i], &set);
+
+    if (len < sizeof(list))
+      len += snprintf(list + len, sizeof(list) - len, "%s%d",
+		      i ? "," : "", cpus[i]);
+  }
+
+  rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+  if (rc) {
+    WARN("Failed to pin %s to CPU %s: %s\n", name, list, strerror(rc));
+  } else {
+    INFO("%s pinned to CPU %s\n", name, list);
+  }
+}
+
+static void set_priority(const char *name) {
+  struct sched_param param = { .sched_priority = config.rt_priority };
+  const char *policy = (config.rt_policy == SCHED_RR) ?
+    "SCHED_RR" : "SCHED_FIFO";
+  int rc;
+
+  rc = pthread_setschedparam(pthread_self(), config.rt_policy, &param);
+
+  if (rc) {
+    WARN("Failed to run %s with %s priority %d: %s\n"
+	 "(Needs CAP_SYS_NICE or a large enough ulimit -r)\n",
+	 name, policy, config.rt_priority, strerror(rc));
+  } else {
+    INFO("%s running with %s priority %d\n", name, policy,
+	 config.rt_priority);
+  }
+}
+
+// Called by each thread of the daemon when it starts. @name is for the
+// log messages. The thread is pinned to @cpus unless @num_cpus is zero,
+// and gets the realtime priority of --rt-priority if @realtime.
+
+void realtime_thread(const char *name, const int *cpus, int num_cpus,
+		     boolean realtime) {
+  if (num_cpus)
+    set_affinity(name, cpus, num_cpus);
+
+  if (realtime && config.rt_priority)
+    set_priority(name);
+
+  if (config.mlockall)
+    prefault_stack();
+}
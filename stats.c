@@ -0,0 +1,392 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "usbpiper.h"
+
+// All endpoints of all shards are listed here, so the list is protected by
+// a mutex. The counters themselves aren't: Each is written only by the
+// thread of the endpoint's shard, and a slightly stale value is fine.
+// That includes resetting them, see reset_shard().
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct piperendpoint *all_endpoints = NULL;
+
+static struct piperctl stats_ctl;
+static struct piperusbfile *stats_file;
+
+// "reset" bumps reset_gen ("reset latency" latency_gen) and wakes up the
+// other shards through their eventfds (-1 until the shard has started),
+// each of which then zeroes its own counters.
+
+static unsigned int reset_gen, latency_gen;
+static int stats_wakefds[MAX_SHARDS] = { [0 ... MAX_SHARDS - 1] = -1 };
+static __thread int stats_shard;
+static __thread unsigned int reset_applied; // reset_gen when last reset
+static __thread unsigned int latency_applied;
+static __thread struct pipercallback reset_callback;
+
+struct pipershardstats shard_stats[MAX_SHARDS];
+
+void stats_register(struct piperendpoint *xep) {
+  pthread_mutex_lock(&stats_lock);
+
+  xep->stats_next = all_endpoints;
+  xep->stats_pprev = &all_endpoints;
+
+  if (all_endpoints)
+    all_endpoints->stats_pprev = &xep->stats_next;
+
+  all_endpoints = xep;
+
+  pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_unregister(struct piperendpoint *xep) {
+  if (!xep->stats_pprev)
+    return; // Never registered
+
+  pthread_mutex_lock(&stats_lock);
+
+  *xep->stats_pprev = xep->stats_next;
+
+  if (xep->stats_next)
+    xep->stats_next->stats_pprev = xep->stats_pprev;
+
+  xep->stats_pprev = NULL;
+
+  pthread_mutex_unlock(&stats_lock);
+}
+
+// Appends to @buf as snprintf() would, but never beyond @size, so a long
+// output is just truncated.
+
+static int append(char *buf, int len, int size, const char *fmt, ...) {
+  va_list ap;
+  int n;
+
+  if (len >= size)
+    return size;
+
+  va_start(ap, fmt);
+  n = vsnprintf(buf + len, size - len, fmt, ap);
+  va_end(ap);
+
+  return (len + n < size) ? len + n : size;
+}
+
+static int show_latency(char *buf, int len, int size, char *what,
+			struct piperhist *h) {
+  if (!h->count)
+    return len;
+
+  return append(buf, len, size,
+		"  %s n %llu avg %.1f p50 %.1f p99 %.1f p999 %.1f max %.1f\n",
+		what, (unsigned long long) h->count,
+		h->sum / 1000.0 / h->count,
+		hist_percentile(h, 0.5) / 1000.0,
+		hist_percentile(h, 0.99) / 1000.0,
+		hist_percentile(h, 0.999) / 1000.0,
+		h->max / 1000.0);
+}
+
+static int show_endpoint(struct piperendpoint *xep, uint64_t now,
+			 char *buf, int len, int size) {
+  struct piperepstats *st = &xep->stats;
+  struct piperusbfile *xusb = xep->dev;
+  uint64_t zero_td_ns = st->zero_td_ns;
+  int i, last;
+
+  if (st->zero_td_since)
+    zero_td_ns += now - st->zero_td_since;
+
+  len = append(buf, len, size,
+	       "%s:\n"
+	       "  bytes %llu transfers %llu short %llu\n"
+	       "  fifo_size %u fifo_fill %u fifo_highwater %u\n"
+	       "  queued_tds %d borrowed_tds %d zero_td_ms %llu\n"
+	       "  reads_full %llu reads_timeout %llu reads_interrupted %llu"
+	       " reads_message %llu\n"
+	       "  writes %llu timer_arms %llu\n",
+	       xusb->name,
+	       (unsigned long long) st->bytes,
+	       (unsigned long long) st->transfers,
+	       (unsigned long long) st->short_transfers,
+	       xep->fifo->size, xep->fifo->fill, xep->fifo->highwater,
+	       xep->num_queued_tds, xep->num_borrowed,
+	       (unsigned long long) zero_td_ns / 1000000,
+	       (unsigned long long) xusb->stats.reads_full,
+	       (unsigned long long) xusb->stats.reads_timeout,
+	       (unsigned long long) xusb->stats.reads_interrupted,
+	       (unsigned long long) xusb->stats.reads_message,
+	       (unsigned long long) xusb->stats.writes,
+	       (unsigned long long) xusb->stats.timer_arms);
+
+  if (xep->transfer_type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
+    len = append(buf, len, size,
+		 "  iso_missed %llu iso_underruns %llu iso_dropped %llu\n",
+		 (unsigned long long) xep->iso_missed,
+		 (unsigned long long) xep->iso_underruns,
+		 (unsigned long long) xep->iso_dropped);
+
+  if ((config.device_tds && xep->device) || xep->rate)
+    len = append(buf, len, size,
+		 "  weight %d rate %llu sched_waits %llu throttles %llu\n",
+		 xep->weight, (unsigned long long) xep->rate,
+		 (unsigned long long) st->sched_waits,
+		 (unsigned long long) st->throttles);
+
+  if (xep->tap)
+    len = append(buf, len, size, "  tap_dropped %llu\n",
+		 (unsigned long long) tap_dropped(xep->tap));
+
+  len = show_latency(buf, len, size, "read_latency_us",
+		     &xusb->stats.read_latency);
+  len = show_latency(buf, len, size, "write_latency_us",
+		     &xusb->stats.write_latency);
+  len = show_latency(buf, len, size, "usb_latency_us", &xep->usb_latency);
+
+  // Queue depth distribution, up to the deepest one seen
+
+  for (last = STATS_DEPTHS - 1; (last > 0) && !st->depth[last]; last--)
+    ;
+
+  len = append(buf, len, size, "  depth");
+
+  for (i=0; i<=last; i++)
+    len = append(buf, len, size, " %s%d:%llu",
+		 (i == STATS_DEPTHS - 1) ? ">=" : "", i,
+		 (unsigned long long) st->depth[i]);
+
+  return append(buf, len, size, "\n");
+}
+
+static int show_shards(char *buf, int len, int size) {
+  int i;
+
+  for (i=0; i<config.shards; i++) {
+    struct pipershardstats *st = &shard_stats[i];
+
+    len = append(buf, len, size,
+		 "shard %d:\n"
+		 "  polls %llu spin_ms %llu sleeps %llu\n", i,
+		 (unsigned long long) st->polls,
+		 (unsigned long long) st->spin_ns / 1000000,
+		 (unsigned long long) st->sleeps);
+  }
+
+  return len;
+}
+
+static int stats_show(void *private, char *buf, int size) {
+  struct piperendpoint *xep;
+  uint64_t now = piper_now();
+  int len = 0;
+
+  if (config.busy_poll)
+    len = show_shards(buf, len, size);
+
+  pthread_mutex_lock(&stats_lock);
+
+  for (xep = all_endpoints; xep; xep = xep->stats_next)
+    if (xep->dev) // NULL while the endpoint is being set up
+      len = show_endpoint(xep, now, buf, len, size);
+
+  pthread_mutex_unlock(&stats_lock);
+
+  return len;
+}
+
+static void reset_latency(struct piperendpoint *xep) {
+  memset(&xep->usb_latency, 0, sizeof(xep->usb_latency));
+
+  if (xep->dev) {
+    memset(&xep->dev->stats.read_latency, 0,
+	   sizeof(xep->dev->stats.read_latency));
+    memset(&xep->dev->stats.write_latency, 0,
+	   sizeof(xep->dev->stats.write_latency));
+  }
+}
+
+static void reset_endpoint(struct piperendpoint *xep) {
+  struct piperepstats *st = &xep->stats;
+  uint64_t since = st->zero_td_since;
+
+  memset(st, 0, sizeof(*st));
+  memset(&xep->usb_latency, 0, sizeof(xep->usb_latency));
+  st->zero_td_since = since ? piper_now() : 0;
+
+  xep->fifo->highwater = xep->fifo->fill;
+  xep->iso_missed = 0;
+  xep->iso_underruns = 0;
+  xep->iso_dropped = 0;
+
+  if (xep->dev)
+    memset(&xep->dev->stats, 0, sizeof(xep->dev->stats));
+}
+
+// "fifo NAME SIZE" sets the FIFO size of the endpoint behind device file
+// NAME (e.g. usbpiper_1-4_bulk_in_01), which takes effect when the file is
+// opened next. The endpoint may belong to another shard, so it's only told
+// the new size here.
+
+static int fifo_command(char *cmd) {
+  struct piperendpoint *xep;
+  unsigned long size;
+  char *name = cmd + 5;
+  char *space = strrchr(name, ' ');
+  int rc = -ENODEV;
+
+  if (!space || (space == name) || parse_uint(space + 1, &size) ||
+      !size || (size > FIFO_SIZE_MAX))
+    return -EINVAL;
+
+  *space = 0;
+
+  pthread_mutex_lock(&stats_lock);
+
+  for (xep = all_endpoints; xep; xep = xep->stats_next)
+    if (xep->dev && !xep->is_meta && !strcmp(xep->dev->name, name)) {
+      __atomic_store_n(&xep->fifo_request, size, __ATOMIC_RELEASE);
+      rc = 0;
+    }
+
+  pthread_mutex_unlock(&stats_lock);
+
+  if (!rc)
+    INFO("FIFO of %s will be %lu bytes when opened next\n", name, size);
+
+  return rc;
+}
+
+// Zeroes the counters (or only the histograms) of the calling shard, if
+// there was a "reset" (or "reset latency") since it last did
+
+static void reset_shard(void) {
+  unsigned int gen = __atomic_load_n(&reset_gen, __ATOMIC_ACQUIRE);
+  unsigned int lgen = __atomic_load_n(&latency_gen, __ATOMIC_ACQUIRE);
+  boolean all = (gen != reset_applied);
+  struct piperendpoint *xep;
+
+  if (!all && (lgen == latency_applied))
+    return;
+
+  reset_applied = gen;
+  latency_applied = lgen;
+
+  pthread_mutex_lock(&stats_lock);
+
+  for (xep = all_endpoints; xep; xep = xep->stats_next)
+    if (xep->shard != stats_shard)
+      continue;
+    else if (all)
+      reset_endpoint(xep);
+    else
+      reset_latency(xep);
+
+  pthread_mutex_unlock(&stats_lock);
+
+  if (all)
+    memset(&shard_stats[stats_shard], 0, sizeof(shard_stats[stats_shard]));
+}
+
+// The eventfd is read before reset_gen, so a reset that's requested
+// meanwhile wakes up the shard again
+
+static int reset_event(uint32_t events, void *private) {
+  uint64_t n;
+
+  if ((read(stats_wakefds[stats_shard], &n, sizeof(n)) < 0) &&
+      (errno != EAGAIN)) {
+    perror("Failed to read stats eventfd");
+    return 1;
+  }
+
+  reset_shard();
+  return 0;
+}
+
+static void wake_other_shards(void) {
+  uint64_t one = 1;
+  int i, fd;
+
+  for (i=0; i<MAX_SHARDS; i++) {
+    fd = __atomic_load_n(&stats_wakefds[i], __ATOMIC_ACQUIRE);
+
+    if ((i != stats_shard) && (fd >= 0) &&
+	(write(fd, &one, sizeof(one)) < 0) && (errno != EAGAIN))
+      perror("Failed to write stats eventfd");
+  }
+}
+
+// "reset" zeroes all statistics, "reset latency" only the histograms. The
+// counters of other shards are zeroed by those shards, so they may still
+// show their old values for a moment after the command.
+
+static int stats_command(void *private, char *cmd) {
+  if (!strncmp(cmd, "fifo ", 5))
+    return fifo_command(cmd);
+
+  if (!strcmp(cmd, "reset"))
+    __atomic_add_fetch(&reset_gen, 1, __ATOMIC_RELEASE);
+  else if (!strcmp(cmd, "reset latency"))
+    __atomic_add_fetch(&latency_gen, 1, __ATOMIC_RELEASE);
+  else
+    return -EINVAL;
+
+  reset_shard();
+  wake_other_shards();
+
+  INFO("Statistics reset\n");
+  return 0;
+}
+
+// Called by each shard. The first one also serves the stats file.
+
+int stats_init(int pollfd, int shard) {
+  struct epoll_event event;
+  int fd;
+
+  stats_shard = shard;
+  reset_applied = __atomic_load_n(&reset_gen, __ATOMIC_ACQUIRE);
+  latency_applied = __atomic_load_n(&latency_gen, __ATOMIC_ACQUIRE);
+
+  fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  if (fd < 0) {
+    perror("Failed to create stats eventfd");
+    return 1;
+  }
+
+  reset_callback.callback = reset_event;
+  reset_callback.private = NULL;
+
+  event.events = EPOLLIN;
+  event.data.ptr = &reset_callback;
+
+  if (epoll_ctl(pollfd, EPOLL_CTL_ADD, fd, &event)) {
+    perror("epoll_ctl");
+    close(fd);
+    return 1;
+  }
+
+  __atomic_store_n(&stats_wakefds[shard], fd, __ATOMIC_RELEASE);
+
+  if (shard)
+    return 0;
+
+  stats_ctl.show = stats_show;
+  stats_ctl.command = stats_command;
+  stats_ctl.private = NULL;
+
+  if (!(stats_file = devfile_init(pollfd, "usbpiper_stats")))
+    return 1;
+
+  stats_file->ctl = &stats_ctl;
+  return 0;
+}
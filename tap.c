@@ -0,0 +1,378 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+
+#include "usbpiper.h"
+
+// Endpoint taps (--tap) record the data that goes between USB and an
+// endpoint's FIFO into a capture file, in the format given in tap.h.
+//
+// The shard's thread copies each transfer's data into the tap's ring, and a
+// single background thread writes it out in large sequential chunks. Each
+// ring has one producer and one consumer, which only exchange positions,
+// so there are no locks on the data path. If the ring is full, the data is
+// dropped and counted rather than waited for, and a TAP_DROPPED record in
+// the capture tells how much was lost.
+//
+// The writer sleeps until a ring has a chunk's worth of data, which the
+// shard signals through tap_wakefd, or until some data is due for writing
+// anyhow. taps_lock only protects the list of taps, and is never held
+// during a write(), so tap_open() on a shard doesn't wait for the disk.
+
+#define TAP_CHUNK (1 << 20) // Write out when this much is pending...
+#define TAP_FLUSH_NS 100000000ULL // ... or after 100 ms anyhow
+
+struct pipertap {
+  struct pipertap *next; // In the writer's list
+  unsigned char *ring;
+  uint64_t size; // Of the ring, a power of two
+  uint64_t head; // Updated by the producer only
+  uint64_t tail; // Updated by the writer only
+  uint8_t addr;
+  int fd; // -1 after a write error
+  char *path;
+  boolean closing; // The endpoint is gone: Write out the rest and free
+  boolean done; // Writer only: Written out after closing, to be freed
+  uint64_t last_write; // piper_now() of the last write out
+  uint64_t lost; // Bytes dropped since the last TAP_DROPPED record
+  uint64_t dropped; // Total bytes dropped
+};
+
+// Taps are added at the head of the list by tap_open(), and removed only by
+// the writer thread. flush_lock keeps the writer thread and the exit
+// handler from writing out the same ring at the same time.
+
+static pthread_mutex_t taps_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pipertap *taps;
+static int tap_wakefd = -1; // eventfd, to wake up the writer thread
+
+static void tap_wake(void) {
+  uint64_t one = 1;
+
+  // Never blocks, and a failure only delays the writer until its timeout
+  if (write(tap_wakefd, &one, sizeof(one)) < 0)
+    return;
+}
+
+static void ring_put(struct pipertap *tap, uint64_t pos,
+		     const void *data, unsigned int len) {
+  uint64_t offset = pos & (tap->size - 1);
+  uint64_t first = tap->size - offset;
+
+  if (first > len)
+    first = len;
+
+  memcpy(tap->ring + offset, data, first);
+  memcpy(tap->ring, data + first, len - first);
+}
+
+// Called by the shard's thread. Never blocks.
+
+void tap_record(struct pipertap *tap, void *data, unsigned int len) {
+  static const unsigned char padding[8];
+  uint64_t tail = __atomic_load_n(&tap->tail, __ATOMIC_ACQUIRE);
+  uint64_t head = tap->head;
+  uint64_t was = head - tail; // Pending before this record
+  uint64_t need = sizeof(struct pipertaprecord) + tap_padded(len);
+
+  struct pipertaprecord rec = {
+    .timestamp = piper_now(),
+    .length = len,
+    .addr = tap->addr,
+  };
+
+  if (tap->lost)
+    need += sizeof(rec);
+
+  if (tap->size - (head - tail) < need) {
+    tap->lost += len;
+    tap->dropped += len;
+    return;
+  }
+
+  if (tap->lost) {
+    struct pipertaprecord drop = {
+      .timestamp = rec.timestamp,
+      .length = (tap->lost > UINT32_MAX) ? UINT32_MAX : tap->lost,
+      .addr = tap->addr,
+      .flags = TAP_DROPPED,
+    };
+
+    ring_put(tap, head, &drop, sizeof(drop));
+    head += sizeof(drop);
+    tap->lost = 0;
+  }
+
+  ring_put(tap, head, &rec, sizeof(rec));
+  head += sizeof(rec);
+
+  ring_put(tap, head, data, len);
+  ring_put(tap, head + len, padding, tap_padded(len) - len);
+  head += tap_padded(len);
+
+  __atomic_store_n(&tap->head, head, __ATOMIC_RELEASE);
+
+  // Only when a chunk's worth becomes pending, not for each record
+  if ((was < TAP_CHUNK) && (head - tail >= TAP_CHUNK))
+    tap_wake();
+}
+
+// Write out everything in the ring. With a single writer thread, the data
+// of different taps isn't interleaved in a shared capture file, even when
+// the ring's content wraps around and takes two write() calls.
+
+static void tap_flush(struct pipertap *tap) {
+  uint64_t head = __atomic_load_n(&tap->head, __ATOMIC_ACQUIRE);
+  uint64_t tail = tap->tail;
+  ssize_t rc;
+
+  while (tail != head) {
+    uint64_t offset = tail & (tap->size - 1);
+    uint64_t len = head - tail;
+
+    if (len > tap->size - offset)
+      len = tap->size - offset;
+
+    if (tap->fd < 0) { // After an error, just discard the data
+      tail += len;
+      continue;
+    }
+
+    rc = write(tap->fd, tap->ring + offset, len);
+
+    if ((rc < 0) && (errno == EINTR))
+      continue;
+
+    if (rc <= 0) {
+      ERR("Failed to write to capture file %s, stopping capture:\n",
+	  tap->path);
+      perror("write");
+      close(tap->fd);
+      tap->fd = -1;
+      continue;
+    }
+
+    tail += rc;
+    __atomic_store_n(&tap->tail, tail, __ATOMIC_RELEASE);
+  }
+
+  __atomic_store_n(&tap->tail, tail, __ATOMIC_RELEASE);
+  tap->last_write = piper_now();
+}
+
+static void tap_free(struct pipertap *tap) {
+  if (tap->fd >= 0)
+    close(tap->fd);
+
+  free(tap->ring);
+  free(tap->path);
+  free(tap);
+}
+
+// Unlink the taps that have been written out after closing, and free them.
+// Called with flush_lock held, so tap_flush_all() isn't walking them.
+
+static void tap_reap(void) {
+  struct pipertap **p, *tap, *done = NULL;
+
+  pthread_mutex_lock(&taps_lock);
+
+  for (p = &taps; (tap = *p);) {
+    if (tap->done) {
+      *p = tap->next;
+      tap->next = done;
+      done = tap;
+    } else {
+      p = &tap->next;
+    }
+  }
+
+  pthread_mutex_unlock(&taps_lock);
+
+  while ((tap = done)) {
+    done = tap->next;
+    tap_free(tap);
+  }
+}
+
+// Taps that tap_open() adds while the list is walked are seen on the next
+// round. The links of the taps that are walked don't change meanwhile, as
+// only this thread removes taps.
+
+static void *tap_writer(void *arg) {
+  struct pollfd pfd = { .fd = tap_wakefd, .events = POLLIN };
+  struct pipertap *tap, *first;
+  boolean closing, closed, busy;
+  uint64_t now, pending, wait_ns, count;
+
+  realtime_thread("Capture writer", config.worker_cpus,
+		  config.num_worker_cpus, false);
+
+  while (1) {
+    busy = closed = false;
+    wait_ns = TAP_FLUSH_NS;
+
+    pthread_mutex_lock(&taps_lock);
+    first = taps;
+    pthread_mutex_unlock(&taps_lock);
+
+    pthread_mutex_lock(&flush_lock);
+
+    now = piper_now();
+
+    for (tap = first; tap; tap = tap->next) {
+      closing = __atomic_load_n(&tap->closing, __ATOMIC_ACQUIRE);
+      pending = __atomic_load_n(&tap->head, __ATOMIC_ACQUIRE) - tap->tail;
+
+      if (closing || (pending >= TAP_CHUNK) ||
+	  (pending && ((now - tap->last_write) >= TAP_FLUSH_NS)))
+	tap_flush(tap);
+      else if (pending && (tap->last_write + TAP_FLUSH_NS - now < wait_ns))
+	wait_ns = tap->last_write + TAP_FLUSH_NS - now;
+
+      if (pending >= TAP_CHUNK)
+	busy = true;
+
+      if (closing)
+	tap->done = closed = true;
+    }
+
+    if (closed)
+      tap_reap();
+
+    pthread_mutex_unlock(&flush_lock);
+
+    if (busy)
+      continue;
+
+    // A wakeup that arrives meanwhile is kept in the eventfd's counter
+    if ((poll(&pfd, 1, (wait_ns + 999999) / 1000000) > 0) &&
+	(read(tap_wakefd, &count, sizeof(count)) < 0) && (errno != EAGAIN))
+      perror("Capture writer: read eventfd");
+  }
+
+  return NULL;
+}
+
+// Whatever is in the rings when the daemon quits goes to the files too
+
+static void tap_flush_all(void) {
+  struct pipertap *tap, *first;
+
+  // Under flush_lock, so the writer thread doesn't free any of these
+  pthread_mutex_lock(&flush_lock);
+
+  pthread_mutex_lock(&taps_lock);
+  first = taps;
+  pthread_mutex_unlock(&taps_lock);
+
+  for (tap = first; tap; tap = tap->next)
+    tap_flush(tap);
+
+  pthread_mutex_unlock(&flush_lock);
+}
+
+// Called once, before the shards start, if any tap is configured
+
+int tap_start(void) {
+  pthread_t thread;
+  int rc;
+
+  tap_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  if (tap_wakefd < 0) {
+    perror("Failed to create eventfd for capture writer");
+    return 1;
+  }
+
+  rc = pthread_create(&thread, NULL, tap_writer, NULL);
+
+  if (rc) {
+    ERR("Failed to start capture writer thread: %s\n", strerror(rc));
+    return 1;
+  }
+
+  pthread_detach(thread);
+  atexit(tap_flush_all);
+
+  return 0;
+}
+
+// The capture file is appended to, so that it covers the endpoints of a
+// device that is detached and reattached. Returns NULL on failure, in
+// which case the endpoint just goes without a tap.
+
+struct pipertap *tap_open(uint8_t addr, char *path) {
+  struct pipertap *tap;
+  struct stat st;
+
+  if (!(tap = calloc(1, sizeof(*tap)))) {
+    ERR("Failed to allocate memory for endpoint tap\n");
+    return NULL;
+  }
+
+  tap->fd = -1;
+
+  if (!(tap->path = strdup(path)) || !(tap->ring = malloc(config.tap_size))) {
+    ERR("Failed to allocate memory for endpoint tap\n");
+    goto fail;
+  }
+
+  // Touch all pages now, so that the data path doesn't page fault later
+  memset(tap->ring, 0, config.tap_size);
+
+  tap->size = config.tap_size;
+  tap->addr = addr;
+  tap->last_write = piper_now();
+
+  tap->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+  if (tap->fd < 0) {
+    ERR("Failed to open capture file %s:\n", path);
+    perror("open");
+    goto fail;
+  }
+
+  pthread_mutex_lock(&taps_lock);
+
+  // Under the lock, so that two taps on the same new file don't both
+  // write the header
+  if (!fstat(tap->fd, &st) && (st.st_size == 0) &&
+      (write(tap->fd, TAP_MAGIC, 8) != 8)) {
+    pthread_mutex_unlock(&taps_lock);
+    ERR("Failed to write to capture file %s\n", path);
+    goto fail;
+  }
+
+  tap->next = taps;
+  taps = tap;
+
+  pthread_mutex_unlock(&taps_lock);
+
+  INFO("Capturing endpoint %02x into %s\n", addr, path);
+  return tap;
+
+ fail:
+  tap_free(tap);
+  return NULL;
+}
+
+// The endpoint is going away, so there will be no more tap_record() calls.
+// The writer thread writes out what's left, and frees the tap.
+
+void tap_close(struct pipertap *tap) {
+  __atomic_store_n(&tap->closing, true, __ATOMIC_RELEASE);
+  tap_wake();
+}
+
+uint64_t tap_dropped(struct pipertap *tap) {
+  return tap->dropped;
+}
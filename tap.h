@@ -0,0 +1,31 @@
+#ifndef _TAP_H
+#define _TAP_H
+
+#include <stdint.h>
+
+// Format of the capture files written by the endpoint taps (--tap). A file
+// begins with TAP_MAGIC, followed by records, each a struct pipertaprecord
+// and its payload, padded to a multiple of 8 bytes. A file may hold the
+// records of several endpoints, e.g. when the same capture file is given for
+// more than one endpoint, or when a device is reattached (a capture file is
+// appended to).
+
+#define TAP_MAGIC "USBPTAP1"
+
+enum pipertapflags {
+  TAP_DROPPED = 1, // No payload: @length bytes were lost due to an overrun
+};
+
+struct pipertaprecord {
+  uint64_t timestamp; // CLOCK_MONOTONIC, nanoseconds
+  uint32_t length; // Of the payload, not including padding
+  uint8_t addr; // bEndpointAddress, so bit 7 tells the direction
+  uint8_t flags;
+  uint16_t reserved;
+};
+
+static inline uint32_t tap_padded(uint32_t length) {
+  return (length + 7) & ~7;
+}
+
+#endif
@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "usbpiper.h"
+
+__thread struct pipertracering *trace_ring;
+
+static struct pipertracering *rings[MAX_SHARDS];
+
+// Called by each shard before it starts handling events. @size is the
+// number of events in the ring, which must be a power of two. Zero
+// disables tracing (trace() returns immediately).
+
+int trace_init(int shard, unsigned int size) {
+  struct pipertracering *r;
+
+  if (!size)
+    return 0;
+
+  r = malloc(sizeof(*r));
+
+  if (r)
+    r->events = calloc(size, sizeof(struct pipertraceevent));
+
+  if (!r || !r->events) {
+    ERR("Failed to allocate memory for trace ring\n");
+    free(r);
+    return 1;
+  }
+
+  r->hdr.shard = shard;
+  r->hdr.size = size;
+  r->hdr.head = 0;
+
+  trace_ring = r;
+  __atomic_store_n(&rings[shard], r, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+  const char *p = buf;
+  ssize_t rc;
+
+  while (len) {
+    rc = write(fd, p, len);
+
+    if (rc <= 0)
+      return 1;
+
+    p += rc;
+    len -= rc;
+  }
+
+  return 0;
+}
+
+// Writes the rings to the trace file, while the shards keep running
+
+static void trace_dump(void) {
+  struct pipertracefile file = { .magic = TRACE_MAGIC };
+  struct pipertraceringhdr hdr;
+  struct pipertracering *r;
+  int fd, i;
+
+  for (i=0; i<MAX_SHARDS; i++)
+    if (__atomic_load_n(&rings[i], __ATOMIC_ACQUIRE))
+      file.num_rings++;
+
+  // usbpiper runs as root, so a symlink planted at the path mustn't be
+  // followed into truncating whatever it points at
+  fd = open(config.trace_file,
+	    O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0644);
+
+  if (fd < 0) {
+    WARN("Failed to open trace file %s: %s\n", config.trace_file,
+	 strerror(errno));
+    return;
+  }
+
+  if (write_all(fd, &file, sizeof(file)))
+    goto close;
+
+  for (i=0; i<MAX_SHARDS; i++) {
+    r = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+
+    if (!r)
+      continue;
+
+    hdr = r->hdr;
+    hdr.head = __atomic_load_n(&r->hdr.head, __ATOMIC_ACQUIRE);
+
+    if (write_all(fd, &hdr, sizeof(hdr)) ||
+	write_all(fd, r->events, hdr.size * sizeof(struct pipertraceevent)))
+      break;
+  }
+
+ close:
+  close(fd);
+}
+
+// SIGUSR1 is blocked in all threads, and taken with sigwait() by a thread
+// of its own, which dumps the rings. So the signal never interrupts a
+// shard's epoll_wait(), and the dump isn't limited to async-signal-safe
+// calls. Called before any other thread is created, as they inherit the
+// signal mask.
+
+static void *trace_signal_thread(void *arg) {
+  sigset_t *set = arg;
+  int sig;
+
+  while (1)
+    if (!sigwait(set, &sig)) {
+      trace_dump();
+      INFO("Trace rings dumped to %s\n", config.trace_file);
+    }
+
+  return NULL;
+}
+
+int trace_install_signal(void) {
+  static sigset_t set;
+  pthread_t thread;
+  int rc;
+
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+
+  rc = pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  if (!rc)
+    rc = pthread_create(&thread, NULL, trace_signal_thread, &set);
+
+  if (rc) {
+    ERR("Failed to set up SIGUSR1 for trace dumps: %s\n", strerror(rc));
+    return 1;
+  }
+
+  pthread_detach(thread);
+
+  INFO("Trace rings of %d events per shard. Send SIGUSR1 to dump to %s\n",
+       config.trace_size, config.trace_file);
+
+  return 0;
+}
@@ -0,0 +1,52 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+
+// Format of the binary trace, which is shared with the usbpiper-trace
+// decoder. Each shard records fixed-size events into its own ring, so
+// recording involves no locks or atomic read-modify-write operations.
+
+enum pipertraceid {
+  TRACE_CUSE_REQUEST = 1, // arg0 = fd, arg1 = unique, arg2 = opcode
+  TRACE_READ, // arg0 = fd, arg1 = unique, arg2 = size
+  TRACE_READ_DONE, // arg0 = fd, arg1 = unique, arg2 = count or -errno
+  TRACE_WRITE, // arg0 = fd, arg1 = unique, arg2 = size
+  TRACE_WRITE_DONE, // arg0 = fd, arg1 = unique, arg2 = count or -errno
+  TRACE_INTERRUPT, // arg0 = fd, arg1 = unique of the interrupted request
+  TRACE_TIMER, // arg0 = fd
+  TRACE_TD_SUBMIT, // arg0 = endpoint address, arg1 = length
+  TRACE_TD_DONE, // arg0 = endpoint address, arg1 = actual length,
+		 // arg2 = libusb_transfer_status
+  TRACE_IDS
+};
+
+struct pipertraceevent {
+  uint64_t timestamp; // CLOCK_MONOTONIC, nanoseconds
+  uint32_t id;
+  uint32_t arg0;
+  uint64_t arg1;
+  uint64_t arg2;
+};
+
+// The dump file is a struct pipertracefile, followed by each ring: A struct
+// pipertraceringhdr and its @size events, as they are in memory. Event
+// number @head - 1 is the latest. Since the rings are dumped while being
+// written to, the oldest event may be half-overwritten, so the decoder
+// skips it if the ring has wrapped around.
+
+#define TRACE_MAGIC "USBPTRC1"
+
+struct pipertracefile {
+  char magic[8];
+  uint32_t num_rings;
+  uint32_t reserved;
+};
+
+struct pipertraceringhdr {
+  uint32_t shard;
+  uint32_t size; // Power of two
+  uint64_t head; // Number of events recorded since start
+};
+
+#endif
@@ -10,20 +10,40 @@
 #include <errno.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <pthread.h>
 
 #include "usbpiper.h"
 
 #define FIFOSIZE 262144
-const uint16_t vendorID = 0x1234, prodID = 0x5678;
-const uint8_t int_idx = 0; // Interface Number
-const uint8_t alt_idx = 0; // Alternate setting
+#define FIFO_GROW_HITS 16
+#define FIFO_GROW_WINDOW 1000000000ULL // 1 s
+#define RATE_BURST_NS 10000000ULL // Tokens an idle endpoint collects, 10 ms
 
 const static int td_bufsize = 1 << 16;
 const int numtd = 10;
 
-static libusb_context *ctx = NULL; // A libusb session
-static int global_pollfd;
-struct pipercallback usb_callback_info;
+// Isochronous IN endpoints get a deeper ring of TDs, each consisting of
+// several packets (config.iso_tds and config.iso_packets respectively).
+
+// Everything below is per shard, i.e. each shard's thread has its own
+// libusb session, epoll fd and devices.
+
+static __thread libusb_context *ctx = NULL; // A libusb session
+static __thread const struct pipertransport *transport;
+static __thread int global_pollfd;
+static __thread int usb_max_size;
+static __thread int usb_shard;
+static __thread boolean hotplug;
+static __thread struct pipercallback usb_callback_info;
+
+static __thread struct piperdevice *devices = NULL;
+static __thread boolean devices_pending = false; // Arrivals / departures
+static __thread libusb_hotplug_callback_handle hotplug_handle;
+static __thread boolean sched_pending = false; // Some device's, see sched_run()
+static __thread int sched_timerfd = -1; // For throttled endpoints
+static __thread uint64_t sched_timer_due; // 0 if not armed
+static __thread struct pipercallback sched_callback;
 
 // A few simple list functions. One entry is the header, and the rest are
 // payload entries. Linux kernel style lists, that is.
@@ -48,6 +68,440 @@ static void shutdown_endpoint_on_fail(struct piperendpoint *xep,
     exit(1); // For now, terminate completely
 }
 
+// Called when it turns out that the device has gone away, possibly
+// before libusb has reported its departure through the hotplug callback.
+// The actual teardown is done by usb_process_devices().
+
+static void device_gone(struct piperdevice *device) {
+  if (device->departed)
+    return;
+
+  INFO("USB device %s has been disconnected\n", device->path);
+  device->departed = true;
+  devices_pending = true;
+}
+
+// TDs move between td_pool and td_queued only through these two, which
+// also keep track of the queue depth statistics: The distribution of the
+// number of TDs still queued when one completes, and the time during which
+// the file was open with no TDs queued at all. And the TDs' round-trip
+// times, of course.
+
+static void td_submitted(struct pipertd *td) {
+  struct piperendpoint *xep = td->xep;
+
+  remove_list(td); // Remove entry from td_pool
+  insert_list(td, xep->td_queued->prev); // Last entry in list
+
+  td->submitted = piper_now();
+
+  if (xep->rate)
+    xep->tokens -= td->transfer->length;
+
+  if (xep->transfer_type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
+    xep->device->queued_tds++;
+
+  trace(TRACE_TD_SUBMIT, xep->addr, td->transfer->length, 0);
+  PROBE4(td_submit, xep->addr, td->transfer->length, xep->num_queued_tds,
+	 fifo_fill(xep->fifo));
+
+  if ((xep->num_queued_tds++ == 0) && xep->stats.zero_td_since) {
+    xep->stats.zero_td_ns += td->submitted - xep->stats.zero_td_since;
+    xep->stats.zero_td_since = 0;
+  }
+}
+
+static void td_reaped(struct pipertd *td) {
+  struct piperendpoint *xep = td->xep;
+  int depth = --xep->num_queued_tds;
+  uint64_t now = piper_now();
+
+  remove_list(td); // Remove entry from td_queued
+  insert_list(td, xep->td_pool->prev); // Last entry in list
+
+  xep->stats.depth[(depth < STATS_DEPTHS) ? depth : STATS_DEPTHS - 1]++;
+
+  // Only what was actually transferred is charged to the rate cap
+  if (xep->rate)
+    xep->tokens += td->transfer->length - td->transfer->actual_length;
+
+  // A TD of the device is free, so a waiting endpoint may get it
+  if (xep->transfer_type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+    xep->device->queued_tds--;
+
+    if (config.device_tds)
+      xep->device->sched_pending = sched_pending = true;
+  }
+
+  trace(TRACE_TD_DONE, xep->addr, td->transfer->actual_length,
+	td->transfer->status);
+  PROBE5(td_complete, xep->addr, td->transfer->status,
+	 td->transfer->actual_length, now - td->submitted, depth);
+
+  // Canceled TDs would only skew the round-trip times
+  if (td->transfer->status == LIBUSB_TRANSFER_COMPLETED)
+    hist_add(&xep->usb_latency, now - td->submitted);
+
+  if ((depth == 0) && (xep->dev->state == XUSB_OPEN))
+    xep->stats.zero_td_since = now;
+}
+
+// TD scheduling. By default, each endpoint queues TDs as far as its FIFO
+// allows. With --device-tds, the bulk and interrupt endpoints of a device
+// share that many TDs in flight: An endpoint waits if they're all taken,
+// and also if another endpoint is waiting that has fewer TDs in flight
+// relative to its weight (--ep-weight). Waiting endpoints are served in
+// that order by sched_run() after each batch of events. So busy endpoints
+// end up with queue depths in proportion to their weights, and the next
+// free TD goes to a quiet endpoint with a high weight rather than to a
+// busy one.
+//
+// With --ep-rate, an endpoint's TDs are also admitted only while it has
+// tokens: A TD's length is charged when it's submitted, and whatever
+// wasn't transferred is refunded when it completes. Tokens are added at
+// the endpoint's rate, up to RATE_BURST_NS worth (or one TD). A throttled
+// endpoint is tried again when sched_timerfd expires, as its tokens are
+// due. Isochronous endpoints have reserved bandwidth, and aren't
+// scheduled at all.
+
+// Whether @a's next TD gives it fewer TDs per weight than @b's would
+
+static boolean fewer_per_weight(struct piperendpoint *a,
+			       struct piperendpoint *b) {
+  return (uint64_t) (a->num_queued_tds + 1) * b->weight <
+    (uint64_t) (b->num_queued_tds + 1) * a->weight;
+}
+
+static void refill_tokens(struct piperendpoint *xep, uint64_t now) {
+  uint64_t elapsed = now - xep->tokens_at;
+  int64_t burst = xep->rate * RATE_BURST_NS / 1000000000;
+  int64_t add;
+
+  if (burst < xep->td_bufsize)
+    burst = xep->td_bufsize;
+
+  add = (elapsed / 1000000000) * xep->rate +
+    (elapsed % 1000000000) * xep->rate / 1000000000;
+
+  if (!add)
+    return; // Less than a byte, so keep counting from tokens_at
+
+  xep->tokens = (xep->tokens + add > burst) ? burst : xep->tokens + add;
+  xep->tokens_at = now;
+}
+
+static void sched_arm(uint64_t due) {
+  struct itimerspec t = { };
+
+  if (sched_timer_due && (sched_timer_due <= due))
+    return;
+
+  t.it_value.tv_sec = due / 1000000000;
+  t.it_value.tv_nsec = due % 1000000000;
+
+  if (timerfd_settime(sched_timerfd, TFD_TIMER_ABSTIME, &t, NULL)) {
+    perror("timerfd_settime"); // The endpoint waits for the next event
+    return;
+  }
+
+  sched_timer_due = due;
+}
+
+// Wake up when @xep has a token again
+
+static void sched_throttle(struct piperendpoint *xep, uint64_t now) {
+  xep->throttled = true;
+  sched_arm(now + (1 - xep->tokens) * 1000000000 / xep->rate);
+}
+
+// Called before each TD is submitted. Returns false if @xep must wait.
+
+static boolean td_admit(struct piperendpoint *xep) {
+  struct piperdevice *device = xep->device;
+  struct piperendpoint *other;
+
+  if (xep->rate) {
+    uint64_t now = piper_now();
+
+    refill_tokens(xep, now);
+
+    if (xep->tokens <= 0) {
+      xep->stats.throttles++;
+      sched_throttle(xep, now);
+      return false;
+    }
+  }
+
+  if (!config.device_tds ||
+      (xep->transfer_type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS))
+    return true;
+
+  if (device->queued_tds < config.device_tds) {
+    for (other = device->endpoints; other; other = other->next)
+      if (other->sched_waiting && (other != xep) &&
+	  fewer_per_weight(other, xep))
+	break;
+
+    if (!other) {
+      xep->sched_waiting = false;
+      return true;
+    }
+
+    // The TD goes to @other after this batch of events
+    device->sched_pending = sched_pending = true;
+  }
+
+  xep->sched_waiting = true;
+  xep->stats.sched_waits++;
+  return false;
+}
+
+static void sched_requeue(struct piperendpoint *xep) {
+  enum xusb_state state = xep->dev->state;
+
+  if (xep->addr & LIBUSB_ENDPOINT_IN) {
+    if (state == XUSB_OPEN)
+      shutdown_endpoint_on_fail(xep, try_queue_bulkin(xep));
+  } else if ((state == XUSB_OPEN) || (state == XUSB_RELEASING)) {
+    shutdown_endpoint_on_fail(xep, try_queue_bulkout(xep, false));
+  }
+}
+
+static void sched_device(struct piperdevice *device) {
+  struct piperendpoint *xep, *best;
+  uint64_t now = piper_now();
+  int queued;
+
+  // Throttled endpoints whose tokens are due join the waiting ones
+  for (xep = device->endpoints; xep; xep = xep->next) {
+    if (!xep->throttled)
+      continue;
+
+    refill_tokens(xep, now);
+
+    if (xep->tokens > 0) {
+      xep->throttled = false;
+      xep->sched_waiting = true;
+    } else {
+      sched_throttle(xep, now);
+    }
+  }
+
+  while (!config.device_tds || (device->queued_tds < config.device_tds)) {
+    best = NULL;
+
+    for (xep = device->endpoints; xep; xep = xep->next)
+      if (xep->sched_waiting && (!best || fewer_per_weight(xep, best)))
+	best = xep;
+
+    if (!best)
+      break;
+
+    queued = device->queued_tds;
+    best->sched_waiting = false;
+    sched_requeue(best);
+
+    // Turned away without getting a TD, so no one else gets one either
+    if (best->sched_waiting && (device->queued_tds == queued))
+      break;
+  }
+}
+
+static void sched_run(void) {
+  struct piperdevice *device;
+
+  sched_pending = false;
+
+  for (device = devices; device; device = device->next)
+    if (device->sched_pending && !device->departed) {
+      device->sched_pending = false;
+      sched_device(device);
+    }
+}
+
+static int sched_event(uint32_t events, void *private) {
+  struct piperdevice *device;
+  struct piperendpoint *xep;
+  uint64_t expirations;
+
+  if ((read(sched_timerfd, &expirations, sizeof(expirations)) < 0) &&
+      (errno != EAGAIN)) {
+    perror("read scheduler timerfd");
+    return 1;
+  }
+
+  sched_timer_due = 0;
+
+  for (device = devices; device; device = device->next)
+    for (xep = device->endpoints; xep; xep = xep->next)
+      if (xep->throttled)
+	device->sched_pending = sched_pending = true;
+
+  return 0;
+}
+
+static int sched_init(int pollfd) {
+  struct epoll_event event;
+
+  sched_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+
+  if (sched_timerfd < 0) {
+    perror("timerfd_create");
+    return 1;
+  }
+
+  sched_callback.callback = sched_event;
+  sched_callback.private = NULL;
+
+  event.events = EPOLLIN;
+  event.data.ptr = &sched_callback;
+
+  if (epoll_ctl(pollfd, EPOLL_CTL_ADD, sched_timerfd, &event)) {
+    perror("epoll_ctl");
+    return 1;
+  }
+
+  return 0;
+}
+
+// Each endpoint has its own TDs, which it always has for itself. Beyond
+// these, bulk and interrupt endpoints of all shards borrow spare TDs when
+// theirs are all queued, up to config.td_max TDs in total. A borrowed TD
+// goes back as soon as it's idle, so the spares end up with the endpoints
+// that have traffic. Up to config.td_pool spare TDs are allocated as
+// they're needed. They're kept in classes by buffer size, and a TD is
+// lent only to an endpoint with the same TD size.
+
+struct spareclass {
+  struct spareclass *next;
+  int bufsize;
+  struct pipertd *idle; // Linked through ->next
+};
+
+static pthread_mutex_t spare_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct spareclass *spare_classes;
+static int spare_count; // Allocated so far
+
+static struct spareclass *spare_class(int bufsize) {
+  struct spareclass *c;
+
+  for (c = spare_classes; c; c = c->next)
+    if (c->bufsize == bufsize)
+      return c;
+
+  if (!(c = malloc(sizeof(*c))))
+    return NULL;
+
+  c->bufsize = bufsize;
+  c->idle = NULL;
+  c->next = spare_classes;
+  spare_classes = c;
+
+  return c;
+}
+
+static void free_spare_td(struct pipertd *td) {
+  if (td->transfer) {
+    free(td->transfer->buffer);
+    transport->free_transfer(td->transfer);
+  }
+
+  free(td);
+}
+
+static struct pipertd *new_spare_td(int bufsize) {
+  struct pipertd *td;
+
+  if (!(td = malloc(sizeof(*td))))
+    return NULL;
+
+  if (!(td->transfer = transport->alloc_transfer(0)) ||
+      !(td->transfer->buffer = malloc(bufsize))) {
+    free_spare_td(td);
+    return NULL;
+  }
+
+  td->transfer->user_data = td;
+  td->borrowed = true;
+
+  return td;
+}
+
+// Add a spare TD to @xep's td_pool. Returns false if there's none for it.
+
+static boolean borrow_td(struct piperendpoint *xep) {
+  struct spareclass *c;
+  struct pipertd *td = NULL;
+  boolean allocate = false;
+
+  if (!config.td_pool ||
+      (xep->transfer_type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) ||
+      (xep->num_tds + xep->num_borrowed >= config.td_max))
+    return false;
+
+  pthread_mutex_lock(&spare_lock);
+
+  if ((c = spare_class(xep->td_bufsize)) && (td = c->idle))
+    c->idle = td->next;
+  else if (spare_count < config.td_pool)
+    allocate = ++spare_count;
+
+  pthread_mutex_unlock(&spare_lock);
+
+  if (allocate && !(td = new_spare_td(xep->td_bufsize))) {
+    pthread_mutex_lock(&spare_lock);
+    spare_count--;
+    pthread_mutex_unlock(&spare_lock);
+  }
+
+  if (!td)
+    return false;
+
+  td->xep = xep;
+  td->transfer->flags = 0;
+  insert_list(td, xep->td_pool);
+  xep->num_borrowed++;
+
+  return true;
+}
+
+static void return_td(struct pipertd *td) {
+  struct spareclass *c;
+
+  remove_list(td);
+  td->xep->num_borrowed--;
+
+  pthread_mutex_lock(&spare_lock);
+
+  if ((c = spare_class(td->xep->td_bufsize))) {
+    td->next = c->idle;
+    c->idle = td;
+  } else {
+    spare_count--;
+  }
+
+  pthread_mutex_unlock(&spare_lock);
+
+  if (!c)
+    free_spare_td(td);
+}
+
+// Give back the borrowed TDs that are in @xep's td_pool
+
+static void return_idle_tds(struct piperendpoint *xep) {
+  struct pipertd *td, *next;
+
+  if (!xep->num_borrowed)
+    return;
+
+  for (td = xep->td_pool->next; td != xep->td_pool; td = next) {
+    next = td->next;
+
+    if (td->borrowed)
+      return_td(td);
+  }
+}
+
 static void transfer_in_callback(struct libusb_transfer *transfer) {
   struct pipertd *td = transfer->user_data;
   struct piperendpoint *xep = td->xep;
@@ -58,19 +512,44 @@ static void transfer_in_callback(struct libusb_transfer *transfer) {
   // because try_queue_bulkin() is called only after the data has been reaped,
   // and this runs single threaded.
 
-  remove_list(td); // Remove entry from td_queued
-  insert_list(td, xep->td_pool->prev); // Last entry in list
-
-  xep->num_queued_tds--;
+  td_reaped(td);
 
   switch(transfer->status) {
   case LIBUSB_TRANSFER_COMPLETED:
-    if (piperfifo_write(xep->fifo, transfer->buffer, len) != len) {
+    xep->stats.bytes += len;
+    xep->stats.transfers++;
+
+    if (len < transfer->length)
+      xep->stats.short_transfers++;
+
+    // In packet mode, each transfer becomes a message in the FIFO, preceded
+    // by its length. Zero-length transfers are ignored, as a READ returning
+    // zero means EOF.
+
+    if (xep->packet_mode) {
+      piperpkthdr hdr = len;
+
+      if (fifo_vacant(xep->fifo) < sizeof(hdr) + len) {
+	BUG("Overflow on BULK IN FIFO of %s\n", xep->dev->name);
+	shutdown_endpoint_on_fail(xep, 1);
+	return;
+      }
+
+      if (len) {
+	piperfifo_write(xep->fifo, &hdr, sizeof(hdr));
+	piperfifo_write(xep->fifo, transfer->buffer, len);
+      }
+    } else if (piperfifo_write(xep->fifo, transfer->buffer, len) != len) {
       BUG("Overflow on BULK IN FIFO of %s\n", xep->dev->name);
       shutdown_endpoint_on_fail(xep, 1);
       return;
     }
 
+    if (xep->tap && len)
+      tap_record(xep->tap, transfer->buffer, len);
+
+    PROBE3(fifo_fill, xep->addr, fifo_fill(xep->fifo), xep->fifo->size);
+
     if (xep->dev->unique_up)
       shutdown_endpoint_on_fail(xep, try_complete_read(xep->dev));
 
@@ -82,6 +561,10 @@ static void transfer_in_callback(struct libusb_transfer *transfer) {
   case LIBUSB_TRANSFER_CANCELLED:
     break;
 
+  case LIBUSB_TRANSFER_NO_DEVICE:
+    device_gone(xep->device);
+    break;
+
   default:
     ERR("On BULK IN endpoint %d (%s)\n", xep->ep, xep->dev->name);
     print_xfererr(transfer->status, "Transfer result");
@@ -91,17 +574,124 @@ static void transfer_in_callback(struct libusb_transfer *transfer) {
   if (state == XUSB_RELEASING)
     shutdown_endpoint_on_fail(xep,
 			      try_complete_release(xep->dev));
+
+  return_idle_tds(xep);
 }
 
-static void transfer_out_callback(struct libusb_transfer *transfer) {
+// Isochronous data can't wait, so unlike BULK IN, data that doesn't fit
+// into the FIFO is dropped (and counted). This doesn't happen in practice,
+// since TDs are queued only when there's room for their full length.
+//
+// The payload of the packets that arrived is written into the FIFO back to
+// back, so the stream has no gaps. If the endpoint has a side channel
+// (xep->meta), a struct piperisorecord is written into its FIFO for each
+// packet, including missed ones, to tell where packets begin and when
+// they arrived.
+
+static void transfer_iso_in_callback(struct libusb_transfer *transfer) {
   struct pipertd *td = transfer->user_data;
   struct piperendpoint *xep = td->xep;
+  struct piperendpoint *meta = xep->meta;
   enum xusb_state state = xep->dev->state;
+  uint64_t now;
+  int i;
 
-  remove_list(td); // Remove entry from td_queued
-  insert_list(td, xep->td_pool->prev); // Last entry in list
+  td_reaped(td);
+
+  switch(transfer->status) {
+  case LIBUSB_TRANSFER_COMPLETED:
+    if ((xep->num_queued_tds == 0) && (state == XUSB_OPEN)) {
+      // The ring ran dry, so the device surely had data to drop
+      xep->iso_underruns++;
+    }
+
+    now = piper_now();
+    xep->stats.transfers++;
+
+    for (i=0; i<transfer->num_iso_packets; i++) {
+      struct libusb_iso_packet_descriptor *pkt = &transfer->iso_packet_desc[i];
+      unsigned char *data = libusb_get_iso_packet_buffer_simple(transfer, i);
+      uint64_t offset = xep->iso_offset;
+      unsigned int len = 0, written;
 
-  xep->num_queued_tds--;
+      if (pkt->status == LIBUSB_TRANSFER_COMPLETED) {
+	len = pkt->actual_length;
+	xep->stats.bytes += len;
+
+	if (len < xep->iso_packet_size)
+	  xep->stats.short_transfers++; // Counted per packet
+
+	written = piperfifo_write(xep->fifo, data, len);
+
+	if (written != len)
+	  xep->iso_dropped++;
+	else if (xep->tap && len)
+	  tap_record(xep->tap, data, len);
+
+	// Only what's in the stream, as that's what the record refers to
+	len = written;
+	xep->iso_offset += len;
+      } else {
+	if (!xep->iso_missed)
+	  WARN("Missed isochronous packets on %s\n", xep->dev->name);
+
+	xep->iso_missed++;
+      }
+
+      if (meta && (meta->dev->state == XUSB_OPEN)) {
+	struct piperisorecord rec = {
+	  .timestamp = now - (transfer->num_iso_packets - 1 - i) *
+	               xep->iso_interval_ns,
+	  .offset = offset,
+	  .length = len,
+	  .status = pkt->status,
+	};
+
+	// Whole records only, or the side channel would lose its framing
+	if (fifo_vacant(meta->fifo) >= sizeof(rec))
+	  piperfifo_write(meta->fifo, &rec, sizeof(rec));
+	else
+	  meta->iso_dropped++;
+      }
+    }
+
+    if (xep->dev->unique_up)
+      shutdown_endpoint_on_fail(xep, try_complete_read(xep->dev));
+
+    if (meta && meta->dev->unique_up)
+      shutdown_endpoint_on_fail(meta, try_complete_read(meta->dev));
+
+    if (state == XUSB_OPEN)
+      shutdown_endpoint_on_fail(xep, try_queue_bulkin(xep));
+
+    break;
+
+  case LIBUSB_TRANSFER_CANCELLED:
+    break;
+
+  case LIBUSB_TRANSFER_NO_DEVICE:
+    device_gone(xep->device);
+    break;
+
+  default:
+    ERR("On ISOCHRONOUS IN endpoint %d (%s)\n", xep->ep, xep->dev->name);
+    print_xfererr(transfer->status, "Transfer result");
+    shutdown_endpoint_on_fail(xep, 1);
+  }
+
+  if (state == XUSB_RELEASING)
+    shutdown_endpoint_on_fail(xep,
+			      try_complete_release(xep->dev));
+
+  return_idle_tds(xep);
+}
+
+static void transfer_out_callback(struct libusb_transfer *transfer) {
+  struct pipertd *td = transfer->user_data;
+  struct piperendpoint *xep = td->xep;
+  enum xusb_state state = xep->dev->state;
+
+  td_reaped(td);
 
   switch(transfer->status) {
   case LIBUSB_TRANSFER_COMPLETED:
@@ -114,6 +704,12 @@ static void transfer_out_callback(struct libusb_transfer *transfer) {
       return;
     }
 
+    xep->stats.bytes += transfer->actual_length;
+    xep->stats.transfers++;
+
+    if (transfer->length < xep->td_bufsize)
+      xep->stats.short_transfers++;
+
     // Queue TDs for BULK OUT even in XUSB_RELEASING state, as this is part
     // of flushing existing data.
     shutdown_endpoint_on_fail(xep, try_queue_bulkout(xep, false));
@@ -123,398 +719,1299 @@ static void transfer_out_callback(struct libusb_transfer *transfer) {
   case LIBUSB_TRANSFER_CANCELLED:
     break;
 
+  case LIBUSB_TRANSFER_NO_DEVICE:
+    device_gone(xep->device);
+    break;
+
   default:
     ERR("On BULK OUT endpoint %d (%s)\n", xep->ep, xep->dev->name);
     print_xfererr(transfer->status, "Transfer result");
     shutdown_endpoint_on_fail(xep, 1);
   }
 
-  if (state == XUSB_RELEASING)
-    shutdown_endpoint_on_fail(xep,
-			      try_complete_release(xep->dev));
-}
+  if (state == XUSB_RELEASING)
+    shutdown_endpoint_on_fail(xep,
+			      try_complete_release(xep->dev));
+
+  return_idle_tds(xep);
+}
+
+// Each queued TD reserves room in the FIFO for its full length (plus the
+// header in packet mode), so its data can always be written into the FIFO.
+
+static inline int td_reserve(struct piperendpoint *xep) {
+  return xep->td_bufsize + (xep->packet_mode ? sizeof(piperpkthdr) : 0);
+}
+
+// In loopback mode, the two files' endpoints share a FIFO, and have no TDs
+// and no device. Data entering the FIFO may complete a READ on the other
+// side, and data leaving it may complete a WRITE or a RELEASE there. These
+// are called instead of queueing TDs.
+
+static int loopback_pull(struct piperendpoint *xep) {
+  struct piperusbfile *writer = xep->dev->counterpart;
+
+  if (writer->unique_down && (writer->state == XUSB_OPEN))
+    return try_complete_write(writer);
+
+  if (writer->state == XUSB_RELEASING)
+    return try_complete_release(writer);
+
+  return 0;
+}
+
+static int loopback_push(struct piperendpoint *xep, boolean try_complete) {
+  struct piperusbfile *reader = xep->dev->counterpart;
+  struct piperusbfile *writer = xep->dev;
+  int rc = 0;
+
+  if (reader->unique_up && (reader->state == XUSB_OPEN))
+    rc = try_complete_read(reader); // Calls loopback_pull()
+
+  if (try_complete && writer->unique_down && (writer->state == XUSB_OPEN))
+    rc |= try_complete_write(writer);
+
+  return rc;
+}
+
+int try_queue_bulkin(struct piperendpoint *xep) {
+  int reserve = td_reserve(xep);
+  int fifo_left = fifo_vacant(xep->fifo) - xep->num_queued_tds * reserve;
+  int rc;
+
+  if (xep->dev && xep->dev->counterpart)
+    return loopback_pull(xep);
+
+  if (xep->device->departed)
+    return 0;
+
+  fifo_check_drained(xep);
+
+  // No TD in flight because the FIFO is full: USB data is held back.
+  // fifo_full() may grow the FIFO for that, so the room is looked at
+  // again.
+  if ((fifo_left < reserve) && !xep->num_queued_tds &&
+      !empty_list(xep->td_pool) && fifo_full(xep))
+    fifo_left = fifo_vacant(xep->fifo);
+
+  while (fifo_left >= reserve) {
+    struct pipertd *td;
+
+    if (!td_admit(xep))
+      break;
+
+    if (empty_list(xep->td_pool) && !borrow_td(xep))
+      break;
+
+    td = xep->td_pool->next;
+
+    switch (xep->transfer_type) {
+    case LIBUSB_TRANSFER_TYPE_BULK:
+      libusb_fill_bulk_transfer(td->transfer, td->xep->usbdevice,
+				(td->xep->ep | LIBUSB_ENDPOINT_IN),
+				td->transfer->buffer, xep->td_bufsize,
+				transfer_in_callback, td, 0);
+      break;
+    case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+      libusb_fill_interrupt_transfer(td->transfer, td->xep->usbdevice,
+				     (td->xep->ep | LIBUSB_ENDPOINT_IN),
+				     td->transfer->buffer, xep->td_bufsize,
+				     transfer_in_callback, td, 0);
+      break;
+    case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+      libusb_fill_iso_transfer(td->transfer, td->xep->usbdevice,
+			       (td->xep->ep | LIBUSB_ENDPOINT_IN),
+			       td->transfer->buffer,
+			       xep->iso_packets * xep->iso_packet_size,
+			       xep->iso_packets, transfer_iso_in_callback,
+			       td, 0);
+      libusb_set_iso_packet_lengths(td->transfer, xep->iso_packet_size);
+      break;
+    default:
+      BUG("try_queue_bulkin: Unexpected transfer type %d\n",
+	  xep->transfer_type);
+      return 1;
+    }
+
+    rc = transport->submit(td->transfer);
+
+    if (rc == LIBUSB_ERROR_NO_DEVICE) {
+      device_gone(xep->device);
+      return 0;
+    }
+
+    if (rc < 0) {
+      ERR("While queueing BULK IN TD on endpoint %d on behalf of %s:\n",
+	  xep->ep, xep->dev->name);
+      print_usberr(rc, "libusb_submit_transfer");
+      return 1;
+    }
+
+    td_submitted(td);
+    fifo_left -= reserve;
+  }
+
+  return_idle_tds(xep);
+  return 0;
+}
+
+int try_queue_bulkout(struct piperendpoint *xep,
+		      boolean try_complete) {
+  int rc;
+  struct piperfifo *fifo = xep->fifo;
+  boolean try_write = try_complete;
+
+  if (xep->dev->counterpart)
+    return loopback_push(xep, try_complete);
+
+  while (!xep->device->departed) {
+    struct pipertd *td;
+    unsigned int fill = fifo_fill(fifo);
+    unsigned int len;
+
+    if (!fill)
+      break;
+
+    // Send a partially filled TD only if there's no other one currently
+    // queued. This is a balance between fairly low latency an not wasting
+    // too much resources on low-bandwidth data sources.
+
+    if (!xep->packet_mode && (fill < xep->td_bufsize) &&
+	!empty_list(xep->td_queued))
+      break;
+
+    if (!td_admit(xep))
+      break;
+
+    if (empty_list(xep->td_pool) && !borrow_td(xep))
+      break;
+
+    td = xep->td_pool->next;
+
+    // In packet mode, each message goes into a TD of its own. The message
+    // was checked to fit into a TD when it was written into the FIFO.
+
+    if (xep->packet_mode) {
+      piperpkthdr hdr;
+
+      piperfifo_read(fifo, &hdr, sizeof(hdr));
+      len = piperfifo_read(fifo, td->transfer->buffer, hdr);
+    } else {
+      len = piperfifo_read(fifo, td->transfer->buffer, xep->td_bufsize);
+    }
+
+    if (xep->tap)
+      tap_record(xep->tap, td->transfer->buffer, len);
+
+    switch (xep->transfer_type) {
+    case LIBUSB_TRANSFER_TYPE_BULK:
+      libusb_fill_bulk_transfer(td->transfer, td->xep->usbdevice,
+				(td->xep->ep | LIBUSB_ENDPOINT_OUT),
+				td->transfer->buffer, len,
+				transfer_out_callback, td, 0);
+
+      // Terminate a message with a ZLP if it ends with a full packet
+      if (xep->packet_mode)
+	td->transfer->flags = LIBUSB_TRANSFER_ADD_ZERO_PACKET;
+      break;
+    case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+      libusb_fill_interrupt_transfer(td->transfer, td->xep->usbdevice,
+				     (td->xep->ep | LIBUSB_ENDPOINT_OUT),
+				     td->transfer->buffer, len,
+				     transfer_out_callback, td, 0);
+      break;
+    default:
+      BUG("try_queue_bulkout: Unexpected transfer type %d\n",
+	  xep->transfer_type);
+      return 1;
+    }
+
+    rc = transport->submit(td->transfer);
+
+    if (rc == LIBUSB_ERROR_NO_DEVICE) {
+      device_gone(xep->device);
+      break;
+    }
+
+    if (rc < 0) {
+      ERR("While queueing BULK OUT TD on endpoint %d on behalf of %s:\n",
+	  xep->ep, xep->dev->name);
+      print_usberr(rc, "libusb_submit_transfer");
+      return 1;
+    }
+
+    td_submitted(td);
+
+    try_write = true;
+  }
+
+  return_idle_tds(xep);
+
+  if (try_write && xep->dev->unique_down && (xep->dev->state == XUSB_OPEN))
+     return try_complete_write(xep->dev);
+
+  // try_complete_release() is called elsewhere when relevant
+
+  return 0;
+}
+
+static int usb_epoll_callback(uint32_t events, void *private) {
+  libusb_context *cb_ctx;
+  struct timeval zero_tv = { 0, 0 };
+  int rc;
+
+  cb_ctx = private;
+
+  rc = libusb_handle_events_timeout(cb_ctx, &zero_tv);
+
+  if (!rc)
+    return 0;
+
+  print_usberr(rc, "libusb_handle_events_timeout");
+  return 1;
+}
+
+static void usb_epoll_add(int fd, short events, void *user_data) {
+  int cb_pollfd = *(int *)user_data;
+  struct epoll_event event;
+
+  event.events = events;
+  event.data.ptr = &usb_callback_info;
+
+  if (epoll_ctl(cb_pollfd, EPOLL_CTL_ADD, fd, &event)) {
+    ERR("While attempting to add epoll event for libusb:\n");
+    perror("epoll_ctl");
+    exit(1);
+  }
+
+  DEBUG("callback: libusb fd %d added to pollfd\n", fd);
+}
+
+static void usb_epoll_remove(int fd, void *user_data) {
+  int cb_pollfd = *(int *)user_data;
+
+  if (epoll_ctl(cb_pollfd, EPOLL_CTL_DEL, fd, NULL)) {
+    ERR("While attempting to remove epoll event for libusb:\n");
+    perror("epoll_ctl");
+    exit(1);
+  }
+
+  DEBUG("callback: libusb fd %d removed from pollfd\n", fd);
+}
+
+// Build a name for the device from its bus and port numbers, e.g. "1-4.2",
+// so that device files of identical devices are told apart, and each
+// device keeps its names as long as it's plugged into the same port.
+
+static char *device_path(libusb_device *dev) {
+  uint8_t ports[8];
+  char path[64];
+  int num, len, i;
+
+  num = libusb_get_port_numbers(dev, ports, sizeof(ports));
+
+  if (num <= 0) {
+    snprintf(path, sizeof(path), "%d-a%d", libusb_get_bus_number(dev),
+	     libusb_get_device_address(dev));
+  } else {
+    len = sprintf(path, "%d-%d", libusb_get_bus_number(dev), ports[0]);
+
+    for (i=1; i<num; i++)
+      len += sprintf(path + len, ".%d", ports[i]);
+  }
+
+  return strdup(path);
+}
+
+// Each shard sees all devices, and picks those that belong to it: Either
+// as assigned with --shard-of, or by a hash of the bus/port path.
+
+static int shard_of(char *path) {
+  struct pipershardmap *entry;
+  unsigned int hash = 5381;
+  char *p;
+
+  for (entry = config.shard_map; entry; entry = entry->next)
+    if (!strcmp(entry->path, path))
+      return entry->shard;
+
+  for (p = path; *p; p++)
+    hash = hash * 33 + *p;
+
+  return hash % config.shards;
+}
+
+// @path is consumed (freed or kept) in any case. @dev is NULL for a
+// simulated device.
+
+static int add_device(char *path, libusb_device *dev) {
+  struct piperdevice *device;
+
+  if (!path) {
+    ERR("Failed to allocate memory for device path\n");
+    return 1;
+  }
+
+  if (shard_of(path) != usb_shard) {
+    free(path);
+    return 0;
+  }
+
+  if (!(device = malloc(sizeof(*device)))) {
+    ERR("Failed to allocate memory for struct piperdevice\n");
+    free(path);
+    return 1;
+  }
+
+  device->path = path;
+
+  device->dev = dev ? libusb_ref_device(dev) : NULL;
+  device->handle = NULL;
+  device->cfg = NULL;
+  device->interfaces = NULL;
+  device->num_interfaces = 0;
+  device->endpoints = NULL;
+  device->departed = false;
+  device->failed = false;
+  device->queued_tds = 0;
+  device->sched_pending = false;
+
+  device->next = devices;
+  devices = device;
+  devices_pending = true;
+
+  if (config.shards > 1) {
+    INFO("USB device %04x/%04x found at %s, served by shard %d\n",
+	 config.vendor, config.product, device->path, usb_shard);
+  } else {
+    INFO("USB device %04x/%04x found at %s\n",
+	 config.vendor, config.product, device->path);
+  }
+
+  return 0;
+}
+
+// Hotplug callbacks are called from within libusb_handle_events_timeout()
+// and while registering the callback. Only bookkeeping is done here, so
+// that libusb isn't reentered from the callback.
+
+static int hotplug_callback(libusb_context *cb_ctx, libusb_device *dev,
+			    libusb_hotplug_event event, void *user_data) {
+  struct piperdevice *device;
+
+  if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+    (void) add_device(device_path(dev), dev); // Not fatal, so ignore a failure
+    return 0;
+  }
+
+  for (device = devices; device; device = device->next)
+    if (device->dev == dev)
+      device_gone(device);
+
+  return 0; // Returning 1 would deregister the callback
+}
+
+static int scan_devices(void) {
+  int rc;
+  int i;
+
+  struct libusb_device **devs;
+  struct libusb_device_descriptor desc;
+
+  rc = libusb_get_device_list(ctx, &devs);
+  if (rc < 0) {
+    print_usberr(rc, "Failed to get device list");
+    return 1;
+  }
+
+  for (i=0; devs[i]; i++) {
+    rc = libusb_get_device_descriptor(devs[i], &desc);
+    if (rc) {
+      print_usberr(rc, "Failed to get device descriptor");
+      libusb_free_device_list(devs, 1);
+      return 1;
+    }
+
+    if ((desc.idVendor == config.vendor) &&
+	(desc.idProduct == config.product) &&
+	add_device(device_path(devs[i]), devs[i])) {
+      libusb_free_device_list(devs, 1);
+      return 1;
+    }
+  }
+
+  libusb_free_device_list(devs, 1);
+
+  // With several shards, some of them may legitimately end up idle
+  if (!devices && (config.shards == 1)) {
+    ERR("Failed to find USB device %04x/%04x\n",
+	config.vendor, config.product);
+    return 1;
+  }
+
+  return 0;
+}
+
+static void destroy_endpoint(struct piperendpoint *xep) {
+  struct pipertd *td;
+
+  return_idle_tds(xep);
+
+  // Only called when no TDs are queued, so they're all in td_pool
+  for (td = xep->td_pool->next; td != xep->td_pool; td = td->next)
+    transport->free_transfer(td->transfer);
+
+  piper_free(xep->td_bufs, xep->td_bufs_size, xep->td_bufs_huge);
+
+  stats_unregister(xep);
+
+  if (xep->tap)
+    tap_close(xep->tap);
+
+  if (xep->dev)
+    devfile_destroy(xep->dev);
+
+  piperfifo_put_mem(&xep->fifo_store, false);
+  free(xep); // Also the TD array
+}
+
+static void destroy_endpoints(struct piperdevice *device) {
+  struct piperendpoint *xep;
+  int i;
+
+  while ((xep = device->endpoints)) {
+    device->endpoints = xep->next;
+    destroy_endpoint(xep);
+  }
+
+  for (i=0; i<device->num_interfaces; i++)
+    if (device->interfaces[i].ctl)
+      devfile_destroy(device->interfaces[i].ctl);
+
+  free(device->interfaces);
+  device->interfaces = NULL;
+  device->num_interfaces = 0;
+
+  if (device->cfg)
+    transport->free_config(device->cfg);
+  device->cfg = NULL;
+}
+
+// If @lazy, the FIFO's memory and the TD buffers are allocated only when
+// the endpoint's file is opened, see endpoint_activate(). The struct, its
+// FIFO struct and its TDs are one cache-aligned allocation.
+
+static struct piperendpoint *new_endpoint(struct piperdevice *device,
+					  int transfer_type,
+					  int fifo_size,
+					  int num_tds, int bufsize,
+					  int iso_packets, boolean lazy) {
+  struct piperendpoint *xep;
+  struct pipertd *td_array, *last_td;
+  int i;
+
+  if (posix_memalign((void **) &xep, CACHE_LINE, sizeof(*xep) +
+		     (num_tds + 2) * sizeof(*td_array))) {
+    ERR("Failed to allocate memory for struct piperendpoint\n");
+    return NULL;
+  }
+
+  td_array = (struct pipertd *) &xep[1];
+
+  xep->fifo = &xep->fifo_store;
+  piperfifo_init(xep->fifo, fifo_size);
+
+  if (!lazy && piperfifo_get_mem(xep->fifo))
+    goto err1;
+
+  // One block for all buffers, so they can share huge pages
+  xep->td_bufs_size = (size_t) num_tds * bufsize;
+  xep->td_bufs = NULL;
+  xep->td_bufs_huge = false;
+  xep->lazy = lazy;
+
+  if (!lazy &&
+      !(xep->td_bufs = piper_alloc(xep->td_bufs_size, "TD buffers",
+				   &xep->td_bufs_huge))) {
+    ERR("Failed to allocate memory for TD buffers\n");
+    goto err2;
+  }
+
+  xep->device = device;
+  xep->dev = NULL;
+  xep->usbdevice = device ? device->handle : NULL;
+  xep->transfer_type = transfer_type;
+  xep->td_bufsize = bufsize;
+  xep->packet_mode = false;
+  xep->weight = 1;
+  xep->sched_waiting = false;
+  xep->throttled = false;
+  xep->rate = 0;
+  xep->tokens = 0;
+  xep->tokens_at = 0;
+  xep->iso_packets = iso_packets;
+  xep->shard = usb_shard;
+  xep->meta = NULL;
+  xep->is_meta = false;
+  xep->iso_offset = 0;
+  xep->iso_missed = 0;
+  xep->iso_underruns = 0;
+  xep->iso_dropped = 0;
+  xep->tap = NULL;
+  xep->fifo_extra = 0;
+  xep->fifo_request = 0;
+  xep->fifo_full_hits = 0;
+  xep->fifo_full_since = 0;
+  xep->fifo_was_full = false;
+  memset(&xep->stats, 0, sizeof(xep->stats));
+  memset(&xep->usb_latency, 0, sizeof(xep->usb_latency));
+  xep->stats_next = NULL;
+  xep->stats_pprev = NULL;
+  xep->td_pool = td_array++;
+  xep->td_queued = td_array++;
+
+  xep->td_pool->prev = xep->td_pool->next = xep->td_pool;
+  xep->td_pool->transfer = NULL;
+
+  xep->td_queued->prev = xep->td_queued->next = xep->td_queued;
+  xep->td_queued->transfer = NULL;
+  xep->num_queued_tds = 0;
+  xep->num_tds = num_tds;
+  xep->num_borrowed = 0;
+
+  last_td = xep->td_pool;
+
+  for (i=0; i<num_tds; i++) {
+    struct pipertd *td = td_array++;
+
+    td->transfer = transport->alloc_transfer(iso_packets);
+
+    if (!td->transfer) {
+      ERR("Failed to allocate memory for transfer struct\n");
+      destroy_endpoint(xep); // Releases the TDs in td_pool
+      return NULL;
+    }
+
+    td->xep = xep;
+    td->borrowed = false;
+    td->transfer->user_data = td;
+    td->transfer->buffer = lazy ? NULL :
+      (unsigned char *) xep->td_bufs + (size_t) i * bufsize;
+
+    insert_list(td, last_td);
+    last_td = td;
+  }
+
+  stats_register(xep);
+  return xep;
+
+ err2:
+  piperfifo_put_mem(xep->fifo, false);
+ err1:
+  free(xep);
+  return NULL;
+}
+
+static struct piperendpoint *find_endpoint(struct piperdevice *device,
+					   uint8_t addr) {
+  struct piperendpoint *xep;
+
+  for (xep = device->endpoints; xep; xep = xep->next)
+    if ((xep->addr == addr) && !xep->is_meta)
+      return xep;
+
+  return NULL;
+}
+
+// The isochronous packet size in one alternate setting, including
+// high-bandwidth multipliers and SuperSpeed bursts, and the interval between
+// packets in nanoseconds. It's calculated from that setting's descriptor,
+// because libusb_get_max_iso_packet_size() looks only at the first setting
+// where the endpoint appears, which is typically the smallest one.
+
+static int iso_geometry(struct piperdevice *device,
+			const struct libusb_endpoint_descriptor *ep,
+			uint64_t *interval_ns) {
+  struct libusb_ss_endpoint_companion_descriptor *comp;
+  int speed = device->dev ?
+    libusb_get_device_speed(device->dev) : LIBUSB_SPEED_HIGH;
+  int exponent = ep->bInterval ? ep->bInterval - 1 : 0;
+  int size = (ep->wMaxPacketSize & 0x7ff) *
+    (1 + ((ep->wMaxPacketSize >> 11) & 3));
+
+  if ((speed >= LIBUSB_SPEED_SUPER) &&
+      !libusb_get_ss_endpoint_companion_descriptor(ctx, ep, &comp)) {
+    size = comp->wBytesPerInterval;
+    libusb_free_ss_endpoint_companion_descriptor(comp);
+  }
+
+  if (speed >= LIBUSB_SPEED_HIGH)
+    *interval_ns = 125000ULL << exponent; // Microframes
+  else
+    *interval_ns = 1000000ULL << exponent; // Frames
+
+  return size;
+}
+
+// The largest packet size of isochronous endpoint @addr in any of @intf's
+// alternate settings. Its TDs and FIFO are sized for that, so that switching
+// to another setting requires no reallocation.
+
+static int iso_max_packet_size(struct piperinterface *intf, uint8_t addr) {
+  uint64_t interval_ns;
+  int alt, i, size, max = 0;
+
+  for (alt=0; alt<intf->desc->num_altsetting; alt++) {
+    const struct libusb_interface_descriptor *setting =
+      &intf->desc->altsetting[alt];
+
+    for (i=0; i<setting->bNumEndpoints; i++) {
+      if (setting->endpoint[i].bEndpointAddress != addr)
+	continue;
+
+      size = iso_geometry(intf->device, &setting->endpoint[i], &interval_ns);
+
+      if (size > max)
+	max = size;
+    }
+  }
+
+  return max;
+}
+
+// The descriptor of @intf's alternate setting @alt (bAlternateSetting, which
+// needn't be its index in altsetting[]), or NULL if there's none
+
+static const struct libusb_interface_descriptor *
+find_altsetting(struct piperinterface *intf, int alt) {
+  int i;
+
+  for (i=0; i<intf->desc->num_altsetting; i++)
+    if (intf->desc->altsetting[i].bAlternateSetting == alt)
+      return &intf->desc->altsetting[i];
+
+  return NULL;
+}
+
+// Mark the endpoints of @intf that exist in its current alternate setting
+// as present. Device files of other endpoints refuse to open. Isochronous
+// endpoints take the packet size and interval of the current setting, and
+// aren't present in a setting without bandwidth.
+
+static void update_endpoints(struct piperinterface *intf) {
+  const struct libusb_interface_descriptor *setting =
+    find_altsetting(intf, intf->alt);
+  struct piperendpoint *xep;
+  int i;
+
+  for (xep = intf->device->endpoints; xep; xep = xep->next)
+    if (xep->intf == intf)
+      xep->present = false;
+
+  for (i=0; i<setting->bNumEndpoints; i++) {
+    const struct libusb_endpoint_descriptor *ep = &setting->endpoint[i];
+
+    if ((xep = find_endpoint(intf->device, ep->bEndpointAddress))) {
+      xep->present = true;
+      xep->transfer_type = ep->bmAttributes & 0x3;
+
+      if (xep->transfer_type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+	xep->iso_packet_size = iso_geometry(intf->device, ep,
+					    &xep->iso_interval_ns);
+	xep->present = (xep->iso_packet_size > 0);
+      }
+    }
+  }
+
+  for (xep = intf->device->endpoints; xep; xep = xep->next)
+    if ((xep->intf == intf) && xep->meta)
+      xep->meta->present = xep->present;
+}
+
+// With --lazy, an endpoint has FIFO memory and TD buffers only while its
+// file is open. They're taken from the pool (see hugepage.c) on OPEN, and
+// returned there when RELEASE completes, at which point no TDs are queued
+// and the FIFO's content has been discarded. Returns 1 on failure.
+
+int endpoint_activate(struct piperendpoint *xep) {
+  struct pipertd *td;
+  unsigned char *buf;
+
+  if (piperfifo_get_mem(xep->fifo))
+    return 1;
+
+  if (!xep->lazy || xep->td_bufs)
+    return 0;
+
+  if (!(buf = pool_get(xep->td_bufs_size, POOL_TD, &xep->td_bufs_huge)) &&
+      !(buf = piper_alloc(xep->td_bufs_size, "TD buffers",
+			  &xep->td_bufs_huge))) {
+    ERR("Failed to allocate memory for TD buffers\n");
+    piperfifo_put_mem(xep->fifo, true);
+    return 1;
+  }
+
+  xep->td_bufs = buf;
+
+  // All TDs are in td_pool, and borrowed ones have buffers of their own
+  for (td = xep->td_pool->next; td != xep->td_pool; td = td->next)
+    if (!td->borrowed) {
+      td->transfer->buffer = buf;
+      buf += xep->td_bufsize;
+    }
+
+  return 0;
+}
+
+void endpoint_deactivate(struct piperendpoint *xep) {
+  if (!xep->lazy)
+    return;
+
+  piperfifo_put_mem(xep->fifo, true);
+
+  if (!pool_put(xep->td_bufs, xep->td_bufs_size, POOL_TD,
+		xep->td_bufs_huge))
+    piper_free(xep->td_bufs, xep->td_bufs_size, xep->td_bufs_huge);
+
+  xep->td_bufs = NULL;
+}
+
+// The size of an endpoint's FIFO as configured, without fifo_extra
+
+static unsigned int fifo_base_size(uint8_t addr) {
+  if (config.fifo_sizes[ep_index(addr)])
+    return config.fifo_sizes[ep_index(addr)];
+
+  return config.fifo_size ? config.fifo_size : FIFOSIZE;
+}
+
+// The FIFO may contain data (and be shared with a loopback counterpart),
+// so this fails if it doesn't fit into the new size
+
+static boolean resize_fifo(struct piperendpoint *xep, unsigned int size) {
+  unsigned int old = xep->fifo->size;
+
+  size += xep->fifo_extra;
+
+  // An IN FIFO must have room for at least one TD
+  if (xep->td_bufsize && (size < td_reserve(xep)))
+    size = td_reserve(xep);
+
+  if (piperfifo_resize(xep->fifo, size)) {
+    WARN("Failed to resize the FIFO of %s from %u to %u bytes\n",
+	 xep->dev->name, old, size);
+    return false;
+  }
+
+  INFO("Resized the FIFO of %s from %u to %u bytes\n", xep->dev->name,
+       old, size);
+  return true;
+}
+
+// A size requested through the statistics file (see stats.c) takes effect
+// when the endpoint's file is opened next. The FIFO is empty and idle then,
+// as RELEASE waits for that.
+
+void fifo_open_resize(struct piperendpoint *xep) {
+  unsigned int size = __atomic_exchange_n(&xep->fifo_request, 0,
+					  __ATOMIC_ACQ_REL);
+
+  if (size)
+    resize_fifo(xep, size);
+}
+
+// Called when @xep's FIFO was found full, so that either USB or the WRITE
+// request waits. Only the first call counts until the FIFO has drained to
+// half its size (see fifo_check_drained()): A steady consumer that is
+// slower than the producer keeps the FIFO about full, and no size would
+// help with that. A bursty one drains it, and then a larger FIFO absorbs
+// the bursts. If FIFO_GROW_HITS such episodes occur within
+// FIFO_GROW_WINDOW, the FIFO is doubled, up to config.fifo_max. Returns
+// true if it was.
+
+boolean fifo_full(struct piperendpoint *xep) {
+  unsigned int size = xep->fifo->size - xep->fifo_extra;
+  uint64_t now;
+
+  if (!config.fifo_max || (size >= config.fifo_max) || xep->fifo_was_full)
+    return false;
+
+  xep->fifo_was_full = true;
+  now = piper_now();
+
+  if ((now - xep->fifo_full_since) > FIFO_GROW_WINDOW) {
+    xep->fifo_full_since = now;
+    xep->fifo_full_hits = 0;
+  }
+
+  if (++xep->fifo_full_hits < FIFO_GROW_HITS)
+    return false;
+
+  xep->fifo_full_hits = 0;
+
+  size = (size > config.fifo_max / 2) ? config.fifo_max : 2 * size;
+
+  return resize_fifo(xep, size);
+}
+
+// The side channel of an isochronous endpoint has a FIFO but no TDs. It's
+// fed by transfer_iso_in_callback() of the endpoint it belongs to.
+
+static int setup_iso_meta(struct piperendpoint *parent) {
+  struct piperdevice *device = parent->device;
+  struct piperendpoint *meta;
+  int fifo_size = FIFOSIZE;
+  char n[64];
+
+  if (!(meta = new_endpoint(device, LIBUSB_TRANSFER_TYPE_ISOCHRONOUS,
+			    fifo_size, 0, 0, 0, false)))
+    return 1;
+
+  meta->next = device->endpoints;
+  device->endpoints = meta;
+  meta->intf = parent->intf;
+  meta->addr = parent->addr;
+  meta->ep = parent->ep;
+  meta->is_meta = true;
+  meta->present = parent->present;
+  parent->meta = meta;
+
+  snprintf(n, sizeof(n), "usbpiper_%s_iso_in_%02d_meta",
+	   device->path, parent->ep);
+
+  if (!(meta->dev = devfile_init(global_pollfd, n)))
+    return 1;
+
+  meta->dev->source = meta;
+  return 0;
+}
+
+// Device files are created for all bulk and interrupt endpoints that
+// appear in any of the interface's alternate settings.
+
+static int setup_streams(struct piperinterface *intf, int max_size) {
+  struct piperdevice *device = intf->device;
+  int alt, ii;
+  char n[64];
+
+  for (alt=0; alt<intf->desc->num_altsetting; alt++) {
+    const struct libusb_interface_descriptor *setting =
+      &intf->desc->altsetting[alt];
+    const struct libusb_endpoint_descriptor *ep = setting->endpoint;
+
+    for (ii=0; ii<setting->bNumEndpoints; ii++, ep++) {
+      struct piperendpoint *xep;
+      int fifo_size, d, e, transfer_type;
+      int num_tds = numtd, bufsize = td_bufsize, iso_packets = 0;
+      int iso_packet_size = 0;
+
+      if (find_endpoint(device, ep->bEndpointAddress))
+	continue; // Already set up for another alternate setting
+
+      DEBUG("bEndpointAddress: %02x,  bmAttributes: %02x\n",
+	    ep->bEndpointAddress, ep->bmAttributes);
+
+      // Prepare endpoints
+
+      d = (ep->bEndpointAddress & 0x80) ? 1 : 0;
+      e = ep->bEndpointAddress & 0x0f;
+      transfer_type = ep->bmAttributes & 0x3;
+
+      if ((transfer_type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) && !d) {
+	WARN("Isochronous OUT endpoints not supported, skipping %02x\n",
+	     ep->bEndpointAddress);
+	continue;
+      }
+
+      if (transfer_type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+	WARN("Control endpoints (?!!) not expected, skipping %02x\n",
+	     ep->bEndpointAddress);
+	continue;
+      }
+
+      fifo_size = fifo_base_size(ep->bEndpointAddress) + (d ? 0 : max_size);
+
+      if (transfer_type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+	iso_packet_size = iso_max_packet_size(intf, ep->bEndpointAddress);
+
+	if (iso_packet_size <= 0) {
+	  WARN("Isochronous endpoint %02x has no bandwidth, skipping\n",
+	       ep->bEndpointAddress);
+	  continue;
+	}
+
+	num_tds = config.iso_tds;
+	iso_packets = config.iso_packets;
+	bufsize = iso_packets * iso_packet_size;
+
+	// Room for a full ring of TDs, and as much again for the consumer
+	if (fifo_size < 2 * num_tds * bufsize)
+	  fifo_size = 2 * num_tds * bufsize;
+      }
+
+      // Room for at least one TD's data, or it's never queued
+      if (d && (fifo_size < bufsize + sizeof(piperpkthdr)))
+	fifo_size = bufsize + sizeof(piperpkthdr);
 
-int try_queue_bulkin(struct piperendpoint *xep) {
-  int fifo_left = fifo_vacant(xep->fifo) - xep->num_queued_tds * td_bufsize;
-  int rc;
+      if (!(xep = new_endpoint(device, transfer_type, fifo_size,
+			       num_tds, bufsize, iso_packets, config.lazy)))
+	return 1;
 
-  while ((fifo_left >= td_bufsize) && !empty_list(xep->td_pool)) {
-    struct pipertd *td = xep->td_pool->next;
+      // Link the endpoint into the device immediately, so it's released
+      // along with the device if something fails later on.
+
+      xep->next = device->endpoints;
+      device->endpoints = xep;
+      xep->intf = intf;
+      xep->addr = ep->bEndpointAddress;
+      xep->ep = e;
+      xep->fifo_extra = d ? 0 : max_size;
+      xep->present = false;
+      xep->packet_mode = (transfer_type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) &&
+	((config.packet_eps & ep_bit(xep->addr)) ||
+	 (config.packet_interrupt &&
+	  (transfer_type == LIBUSB_TRANSFER_TYPE_INTERRUPT)));
+
+      if (transfer_type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+	xep->rate = config.ep_rates[ep_index(xep->addr)];
+
+	if (config.ep_weights[ep_index(xep->addr)])
+	  xep->weight = config.ep_weights[ep_index(xep->addr)];
+      }
 
-    switch (xep->transfer_type) {
-    case LIBUSB_TRANSFER_TYPE_BULK:
-      libusb_fill_bulk_transfer(td->transfer, td->xep->usbdevice,
-				(td->xep->ep | LIBUSB_ENDPOINT_IN),
-				td->transfer->buffer, td_bufsize,
-				transfer_in_callback, td, 0);
-      break;
-    case LIBUSB_TRANSFER_TYPE_INTERRUPT:
-      libusb_fill_interrupt_transfer(td->transfer, td->xep->usbdevice,
-				     (td->xep->ep | LIBUSB_ENDPOINT_IN),
-				     td->transfer->buffer, td_bufsize,
-				     transfer_in_callback, td, 0);
-      break;
-    default:
-      BUG("try_queue_bulkin: Unexpected transfer type %d\n",
-	  xep->transfer_type);
-      return 1;
-    }
+      snprintf(n, sizeof(n), "usbpiper_%s_%s_%s_%02d",
+	       device->path,
+	       transfer_type == LIBUSB_TRANSFER_TYPE_BULK ? "bulk" :
+	       transfer_type == LIBUSB_TRANSFER_TYPE_INTERRUPT ? "interrupt" :
+	       "iso",
+	       d ? "in" : "out",
+	       e);
 
-    rc = libusb_submit_transfer(td->transfer);
+      if (!(xep->dev = devfile_init(global_pollfd, n)))
+	return 1;
 
-    if (rc < 0) {
-      ERR("While queueing BULK IN TD on endpoint %d on behalf of %s:\n",
-	  xep->ep, xep->dev->name);
-      print_usberr(rc, "libusb_submit_transfer");
-      return 1;
-    }
+      // A tap that fails to open is reported, but isn't a reason to fail
+      if (config.tap_files[ep_index(xep->addr)])
+	xep->tap = tap_open(xep->addr, config.tap_files[ep_index(xep->addr)]);
 
-    remove_list(td); // Remove entry from td_pool
-    insert_list(td, xep->td_queued->prev); // Last entry in list
+      if (d) {
+	xep->dev->source = xep;
+	xep->dev->sink = NULL;
+      } else {
+	xep->dev->source = NULL;
+	xep->dev->sink = xep;
+      }
 
-    xep->num_queued_tds++;
-    fifo_left -= td_bufsize;
+      if ((transfer_type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) &&
+	  config.iso_meta && setup_iso_meta(xep))
+	return 1;
+    }
   }
 
+  update_endpoints(intf);
   return 0;
 }
 
-int try_queue_bulkout(struct piperendpoint *xep,
-		      boolean try_complete) {
-  int rc;
-  struct piperfifo *fifo = xep->fifo;
-  boolean try_write = try_complete;
+// The interface's control file shows the current alternate setting, and
+// switches to another one when e.g. "alt 1" is written to it. This is
+// allowed only while all the interface's device files are closed.
 
-  while (!empty_list(xep->td_pool)) {
-    struct pipertd *td = xep->td_pool->next;
-    unsigned int fill = fifo_fill(fifo);
-    unsigned int len;
+static int interface_show(void *private, char *buf, int size) {
+  struct piperinterface *intf = private;
+  struct piperendpoint *xep;
+  int len, i;
 
-    if (!fill)
-      break;
+  len = snprintf(buf, size, "alt %d\nalts", intf->alt);
 
-    // Send a partially filled TD only if there's no other one currently
-    // queued. This is a balance between fairly low latency an not wasting
-    // too much resources on low-bandwidth data sources.
+  for (i=0; (i<intf->desc->num_altsetting) && (len < size); i++)
+    len += snprintf(buf + len, size - len, " %d",
+		    intf->desc->altsetting[i].bAlternateSetting);
 
-    if ((fill < td_bufsize) && !empty_list(xep->td_queued))
-      break;
+  if (len < size)
+    len += snprintf(buf + len, size - len, "\nendpoints");
 
-    len = piperfifo_read(fifo, td->transfer->buffer, td_bufsize);
+  for (xep = intf->device->endpoints; xep && (len < size); xep = xep->next)
+    if ((xep->intf == intf) && xep->present)
+      len += snprintf(buf + len, size - len, " %02x", xep->addr);
 
-    switch (xep->transfer_type) {
-    case LIBUSB_TRANSFER_TYPE_BULK:
-      libusb_fill_bulk_transfer(td->transfer, td->xep->usbdevice,
-				(td->xep->ep | LIBUSB_ENDPOINT_OUT),
-				td->transfer->buffer, len,
-				transfer_out_callback, td, 0);
-      break;
-    case LIBUSB_TRANSFER_TYPE_INTERRUPT:
-      libusb_fill_interrupt_transfer(td->transfer, td->xep->usbdevice,
-				     (td->xep->ep | LIBUSB_ENDPOINT_OUT),
-				     td->transfer->buffer, len,
-				     transfer_out_callback, td, 0);
-      break;
-    default:
-      BUG("try_queue_bulkout: Unexpected transfer type %d\n",
-	  xep->transfer_type);
-      return 1;
-    }
+  if (len < size)
+    len += snprintf(buf + len, size - len, "\n");
 
-    rc = libusb_submit_transfer(td->transfer);
+  return (len < size) ? len : size;
+}
 
-    if (rc < 0) {
-      ERR("While queueing BULK OUT TD on endpoint %d on behalf of %s:\n",
-	  xep->ep, xep->dev->name);
-      print_usberr(rc, "libusb_submit_transfer");
-      return 1;
-    }
+static int interface_command(void *private, char *cmd) {
+  struct piperinterface *intf = private;
+  struct piperendpoint *xep;
+  unsigned long alt;
+  int rc;
 
-    remove_list(td); // Remove entry from td_pool
-    insert_list(td, xep->td_queued->prev); // Last entry in list
+  if (!strncmp(cmd, "alt", 3))
+    cmd += 3;
 
-    xep->num_queued_tds++;
+  while (*cmd == ' ')
+    cmd++;
 
-    try_write = true;
+  if (parse_uint(cmd, &alt) || (alt > 255) || !find_altsetting(intf, alt))
+    return -EINVAL;
+
+  if (alt == intf->alt)
+    return 0;
+
+  for (xep = intf->device->endpoints; xep; xep = xep->next)
+    if ((xep->intf == intf) &&
+	((xep->dev->state != XUSB_CLOSED) || !empty_list(xep->td_queued)))
+      return -EBUSY;
+
+  // This is a blocking control transfer, but a short one
+  rc = transport->set_alt(intf, alt);
+
+  if (rc) {
+    ERR("On interface %d of %s:\n", intf->number, intf->device->path);
+    print_usberr(rc, "Failed to set alternate setting");
+    return (rc == LIBUSB_ERROR_NO_DEVICE) ? -ENODEV : -EIO;
   }
 
-  if (try_write && xep->dev->unique_down && (xep->dev->state == XUSB_OPEN))
-     return try_complete_write(xep->dev);
+  intf->alt = alt;
+  update_endpoints(intf);
 
-  // try_complete_release() is called elsewhere when relevant
+  INFO("Interface %d of %s switched to alternate setting %d\n",
+       intf->number, intf->device->path, intf->alt);
 
   return 0;
 }
 
-static int usb_epoll_callback(uint32_t events, void *private) {
-  static libusb_context *cb_ctx;
-  struct timeval zero_tv = { 0, 0 };
+static int libusb_transport_claim(struct piperinterface *intf) {
+  libusb_device_handle *dev_handle = intf->device->handle;
   int rc;
 
-  cb_ctx = private;
-
-  rc = libusb_handle_events_timeout(cb_ctx, &zero_tv);
+  rc = libusb_kernel_driver_active(dev_handle, intf->number);
 
-  if (!rc)
-    return 0;
+  if (rc == 1) {
+    INFO("A kernel driver is active on interface %d. Taking control instead.\n",
+	 intf->number);
 
-  print_usberr(rc, "libusb_handle_events_timeout");
-  return 1;
-}
+    rc = libusb_detach_kernel_driver(dev_handle, intf->number);
 
-static void usb_epoll_add(int fd, short events, void *user_data) {
-  int cb_pollfd = *(int *)user_data;
-  struct epoll_event event;
+    if (rc) {
+      print_usberr(rc, "Failed to detach kernel driver");
+      return rc;
+    }
+  } else if (rc) {
+     print_usberr(rc, "Failed to access device");
+     return rc;
+  }
 
-  event.events = events;
-  event.data.ptr = &usb_callback_info;
+  rc = libusb_claim_interface(dev_handle, intf->number);
 
-  if (epoll_ctl(cb_pollfd, EPOLL_CTL_ADD, fd, &event)) {
-    ERR("While attempting to add epoll event for libusb:\n");
-    perror("epoll_ctl");
-    exit(1);
+  if (rc) {
+    print_usberr(rc, "Failed to claim interface");
+    return rc;
   }
 
-  DEBUG("callback: libusb fd %d added to pollfd\n", fd);
-}
+  rc = libusb_set_interface_alt_setting(dev_handle, intf->number, intf->alt);
 
-static void usb_epoll_remove(int fd, void *user_data) {
-  int cb_pollfd = *(int *)user_data;
+  if (rc)
+    print_usberr(rc, "Failed to set interface / alternate setting");
 
-  if (epoll_ctl(cb_pollfd, EPOLL_CTL_DEL, fd, NULL)) {
-    ERR("While attempting to remove epoll event for libusb:\n");
-    perror("epoll_ctl");
-    exit(1);
-  }
+  return rc;
+}
 
-  DEBUG("callback: libusb fd %d removed from pollfd\n", fd);
+static int libusb_transport_set_alt(struct piperinterface *intf, int alt) {
+  return libusb_set_interface_alt_setting(intf->device->handle,
+					  intf->number, alt);
 }
 
-static int find_device(struct libusb_device **dev,
-		       libusb_device_handle **dev_handle,
-		       struct libusb_device_descriptor *desc) {
+static int libusb_transport_open(struct piperdevice *device) {
+  libusb_device_handle *dev_handle;
   int rc;
-  int i;
 
-  struct libusb_device **devs;
+  rc = libusb_open(device->dev, &dev_handle);
 
-  rc = libusb_get_device_list(ctx, &devs);
-  if (rc < 0) {
-    print_usberr(rc, "Failed to get device list");
-    return 1;
+  if (rc) {
+    print_usberr(rc, "Device found, but failed to open it");
+    return rc;
   }
 
-  for (i=0; devs[i]; i++) {
-    rc = libusb_get_device_descriptor(devs[i], desc);
-    if (rc) {
-      print_usberr(rc, "Failed to get device descriptor");
-      libusb_free_device_list(devs, 1);
-      return 1;
-    }
-
-    if ((desc->idVendor == vendorID) && (desc->idProduct == prodID)) {
-      rc = libusb_open(devs[i], dev_handle);
+  device->handle = dev_handle;
 
-      if (rc) {
-	print_usberr(rc, "Device found, but failed to open it");
-	libusb_free_device_list(devs, 1);
-	return 1;
-      }
+  // The config descriptor is kept, as alternate settings may be switched
+  rc = libusb_get_active_config_descriptor(device->dev, &device->cfg);
 
-      *dev = devs[i];
-      return 0;
-    }
+  if (rc) {
+    device->cfg = NULL;
+    print_usberr(rc, "Failed to obtain config descriptor");
   }
-  ERR("Failed to find USB device %04x/%04x\n", vendorID, prodID);
-  return 1;
+
+  return rc;
 }
 
-static int setup_streams(libusb_device_handle *dev_handle,
-			 const struct libusb_endpoint_descriptor *ep,
-			 int num_ep, int max_size) {
-  int i, ii;
-  char n[32];
+static void libusb_transport_close(struct piperdevice *device) {
+  libusb_close(device->handle);
+}
 
-  for (ii=0; ii<num_ep; ii++, ep++) {
-    struct piperendpoint *xep;
-    int fifo_size, d, e, transfer_type;
-    struct pipertd *td_array, *last_td;
+static int setup_device(struct piperdevice *device, int max_size) {
+  int i;
+  char n[64];
 
-    DEBUG("bEndpointAddress: %02x,  bmAttributes: %02x\n",
-	  ep->bEndpointAddress, ep->bmAttributes);
+  if (transport->open(device))
+    return 1;
 
-    // Prepare endpoints
+  device->num_interfaces = device->cfg->bNumInterfaces;
+  device->interfaces = calloc(device->num_interfaces,
+			      sizeof(*device->interfaces));
 
-    d = (ep->bEndpointAddress & 0x80) ? 1 : 0;
-    e = ep->bEndpointAddress & 0x0f;
-    transfer_type = ep->bmAttributes & 0x3;
+  if (!device->interfaces) {
+    ERR("Failed to allocate memory for interfaces\n");
+    return 1;
+  }
 
-    if (transfer_type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
-      WARN("Isochronous endpoints not supported, skipping %02x\n",
-	   ep->bEndpointAddress);
-      continue;
-    }
+  for (i=0; i<device->num_interfaces; i++) {
+    struct piperinterface *intf = &device->interfaces[i];
+    boolean requested;
 
-    if (transfer_type == LIBUSB_TRANSFER_TYPE_CONTROL) {
-      WARN("Control endpoints (?!!) not expected, skipping %02x\n",
-	   ep->bEndpointAddress);
-      continue;
-    }
+    intf->device = device;
+    intf->desc = &device->cfg->interface[i];
+    intf->number = intf->desc->altsetting[0].bInterfaceNumber;
+    intf->alt = 0;
+    intf->ctl = NULL;
 
-    fifo_size = d ? FIFOSIZE : FIFOSIZE + max_size;
+    requested = (intf->number < 32) &&
+      ((config.interfaces >> intf->number) & 1);
 
-    if (!(xep = malloc(sizeof(*xep)))) {
-      ERR("Failed to allocate memory for struct piperendpoint\n");
-      return 1;
-    }
+    if (!requested)
+      continue;
 
-    if (!(td_array = malloc((numtd + 2) * sizeof(*td_array)))) {
-      ERR("Failed to allocate memory for array of TDs\n");
+    if (!find_altsetting(intf, config.alt[intf->number])) {
+      ERR("Interface %d has no alternate setting %d\n",
+	  intf->number, config.alt[intf->number]);
       return 1;
     }
 
-    if (!(xep->fifo = piperfifo_new(fifo_size)))
-      return 1;
+    intf->alt = config.alt[intf->number];
 
-    sprintf(n, "usbpiper_%s_%s_%02d",
-	    transfer_type == LIBUSB_TRANSFER_TYPE_BULK ? "bulk" : "interrupt",
-	    d ? "in" : "out",
-	    e);
+    // An interface that wasn't asked for explicitly may be taken by
+    // someone else. That's fine, as long as there's something to serve.
 
-    if (!(xep->dev = devfile_init(global_pollfd, n)))
-      return 1;
+    if (transport->claim_interface(intf)) {
+      if (config.interfaces_requested)
+	return 1;
 
-    if (d) {
-      xep->dev->source = xep;
-      xep->dev->sink = NULL;
-    } else {
-      xep->dev->source = NULL;
-      xep->dev->sink = xep;
+      WARN("Skipping interface %d of %s\n", intf->number, device->path);
+      continue;
     }
 
-    xep->usbdevice = dev_handle;
-    xep->ep = e;
-    xep->transfer_type = transfer_type;
-    xep->td_pool = td_array++;
-    xep->td_queued = td_array++;
-
-    xep->td_pool->prev = xep->td_pool->next = xep->td_pool;
-    xep->td_pool->transfer = NULL;
-
-    xep->td_queued->prev = xep->td_queued->next = xep->td_queued;
-    xep->td_queued->transfer = NULL;
-    xep->num_queued_tds = 0;
-
-    last_td = xep->td_pool;
-
-    for (i=0; i<numtd; i++) {
-      struct pipertd *td = td_array++;
+    if (setup_streams(intf, max_size))
+      return 1;
 
-      void *tdbuf;
+    if (intf->desc->num_altsetting > 1) {
+      intf->ctlops.show = interface_show;
+      intf->ctlops.command = interface_command;
+      intf->ctlops.private = intf;
 
-      td->transfer = libusb_alloc_transfer(0);
-      tdbuf = malloc(td_bufsize);
+      snprintf(n, sizeof(n), "usbpiper_%s_if%02d",
+	       device->path, intf->number);
 
-      if (!tdbuf || !td->transfer) {
-	ERR("Failed to allocate memory for transfer struct\n");
+      if (!(intf->ctl = devfile_init(global_pollfd, n)))
 	return 1;
-      }
 
-      td->xep = xep;
-      td->transfer->user_data = td;
-      td->transfer->buffer = tdbuf;
-
-      insert_list(td, last_td);
-      last_td = td;
+      intf->ctl->ctl = &intf->ctlops;
     }
   }
+
+  if (!device->endpoints) {
+    ERR("No bulk / interrupt endpoints to serve on %s\n", device->path);
+    return 1;
+  }
+
   return 0;
 }
 
-static int setup_device(struct libusb_device *dev,
-			libusb_device_handle *dev_handle,
-			struct libusb_device_descriptor *desc,
-			int max_size) {
-  int rc;
-  struct libusb_config_descriptor *config;
-  const struct libusb_interface *interface;
-  const struct libusb_interface_descriptor *setting;
+// Release everything related to a departed device. Returns 1 if this
+// isn't possible yet, because TDs are still queued. In that case, their
+// completion (or cancellation) will lead to another attempt.
 
-  uint8_t num_int, num_alt;
+static int teardown_device(struct piperdevice *device) {
+  struct piperendpoint *xep;
+  int busy = 0;
 
-  rc = libusb_get_active_config_descriptor(dev, &config);
+  for (xep = device->endpoints; xep; xep = xep->next)
+    if (!empty_list(xep->td_queued)) {
+      (void) cancel_all(xep); // libusb usually reaps them by itself
+      busy = 1;
+    }
 
-  if (rc) {
-    print_usberr(rc, "Failed to obtain config descriptor");
+  if (busy)
     return 1;
-  }
 
-  num_int = config->bNumInterfaces;
+  destroy_endpoints(device);
 
-  if (num_int <= int_idx) {
-    ERR("There are only %d interfaces, hence requested interface %d is illegal.\n",
-	num_int, int_idx);
-    goto err;
-  }
+  if (device->handle)
+    transport->close(device);
 
-  interface = &config->interface[int_idx];
-  num_alt = interface->num_altsetting;
+  if (device->dev)
+    libusb_unref_device(device->dev);
 
-  if (num_alt <= alt_idx) {
-    ERR("Interface %d has only %d alternate settings.\n"
-	"Hence requested alternate setting %d is illegal.\n",
-	int_idx, num_alt, alt_idx);
-    goto err;
-  }
+  INFO("Released USB device %s\n", device->path);
+
+  free(device->path);
+  return 0;
+}
 
-  rc = libusb_kernel_driver_active(dev_handle, int_idx);
+// usb_process_devices() sets up newly arrived devices and tears down
+// departed ones. It's called between batches of epoll events, so nothing
+// that it frees is referred to by a pending event. It also gives TDs to
+// the endpoints that are waiting for them, see td_admit().
 
-  if (rc == 1) {
-    INFO("A kernel driver is active on the device. Taking control instead.\n");
+int usb_process_devices(void) {
+  struct piperdevice **p = &devices;
 
-    rc = libusb_detach_kernel_driver(dev_handle, int_idx);
+  if (sched_pending)
+    sched_run();
 
-    if (rc) {
-      print_usberr(rc, "Failed to detach kernel driver");
-      goto err;
+  if (!devices_pending)
+    return 0;
+
+  devices_pending = false;
+
+  while (*p) {
+    struct piperdevice *device = *p;
+
+    if (device->departed) {
+      if (teardown_device(device)) {
+	devices_pending = true; // Try again later
+	p = &device->next;
+	continue;
+      }
+
+      *p = device->next;
+      free(device);
+      continue;
     }
-  } else if (rc) {
-     print_usberr(rc, "Failed to access device");
-     goto err;
-  }
 
-  rc = libusb_claim_interface(dev_handle, int_idx);
+    if (!device->handle && !device->failed &&
+	setup_device(device, usb_max_size)) {
+      ERR("Failed to set up USB device %s, ignoring it\n", device->path);
 
-  if (rc) {
-    print_usberr(rc, "Failed to claim interface");
-    goto err;
-  }
+      destroy_endpoints(device);
 
-  rc = libusb_set_interface_alt_setting(dev_handle, int_idx, alt_idx);
+      if (device->handle)
+	transport->close(device);
 
-  if (rc) {
-    print_usberr(rc, "Failed to set interface / alternate setting");
-    goto err;
-  }
+      device->handle = NULL;
+      device->failed = true;
 
-  setting = &interface->altsetting[alt_idx];
+      if (!hotplug)
+	return 1;
+    }
 
-  if (setup_streams(dev_handle, setting->endpoint, setting->bNumEndpoints,
-		    max_size))
-    goto err;
+    p = &device->next;
+  }
 
-  libusb_free_config_descriptor(config);
   return 0;
-
- err:
-  libusb_free_config_descriptor(config);
-  return 1;
 }
 
-int init_usb(int pollfd, int max_size) {
-  struct libusb_device *dev;
-  libusb_device_handle *dev_handle;
-  struct libusb_device_descriptor desc;
+static int libusb_transport_init(int pollfd) {
   const struct libusb_pollfd **fdarray, **entry;
   struct epoll_event event;
 
@@ -558,19 +2055,135 @@ int init_usb(int pollfd, int max_size) {
     DEBUG("init: libusb fd %d added to pollfd\n", p->fd);
   }
 
-  // This isn't very pretty, but since ctx is global, it's pointless
-  // pretending that the pollfd is anything but global.
-  global_pollfd = pollfd;
-
+  // This isn't very pretty, but since ctx is global (within the shard),
+  // it's pointless pretending that the pollfd is anything but global.
   libusb_set_pollfd_notifiers(ctx, usb_epoll_add, usb_epoll_remove,
 			      &global_pollfd);
 
   // libusb_free_pollfds(fdarray); -- Commented out, not always supported
 
-  if (find_device(&dev, &dev_handle, &desc))
+  return 0;
+}
+
+static struct libusb_transfer *libusb_transport_alloc(int iso_packets) {
+  return libusb_alloc_transfer(iso_packets);
+}
+
+static const struct pipertransport libusb_transport = {
+  .name = "libusb",
+  .init = libusb_transport_init,
+  .alloc_transfer = libusb_transport_alloc,
+  .free_transfer = libusb_free_transfer,
+  .submit = libusb_submit_transfer,
+  .cancel = libusb_cancel_transfer,
+  .open = libusb_transport_open,
+  .close = libusb_transport_close,
+  .free_config = libusb_free_config_descriptor,
+  .claim_interface = libusb_transport_claim,
+  .set_alt = libusb_transport_set_alt,
+};
+
+// The loopback files are a baseline for the daemon's own throughput and
+// latency: Data written to usbpiper_loop_out goes through the same FIFO
+// and completion logic as with USB, and is read from usbpiper_loop_in.
+
+static int setup_loopback(int max_size) {
+  struct piperendpoint *out, *in;
+
+  if (!(out = new_endpoint(NULL, LIBUSB_TRANSFER_TYPE_BULK,
+			   FIFOSIZE + max_size, 0, 0, 0, false)) ||
+      !(in = new_endpoint(NULL, LIBUSB_TRANSFER_TYPE_BULK,
+			  FIFOSIZE + max_size, 0, 0, 0, false)))
+    return 1;
+
+  // Share the OUT endpoint's FIFO
+  in->fifo = out->fifo;
+  piperfifo_put_mem(&in->fifo_store, false);
+
+  out->addr = out->ep = 1;
+  out->fifo_extra = in->fifo_extra = max_size;
+  in->addr = 0x81;
+  in->ep = 1;
+  out->present = in->present = true;
+
+  if (!(out->dev = devfile_init(global_pollfd, "usbpiper_loop_out")) ||
+      !(in->dev = devfile_init(global_pollfd, "usbpiper_loop_in")))
+    return 1;
+
+  out->dev->sink = out;
+  in->dev->source = in;
+  out->dev->counterpart = in->dev;
+  in->dev->counterpart = out->dev;
+
+  INFO("Loopback device files usbpiper_loop_out -> usbpiper_loop_in\n");
+  return 0;
+}
+
+int init_usb(int pollfd, int max_size, int shard) {
+  int rc;
+
+  global_pollfd = pollfd;
+  usb_max_size = max_size;
+  usb_shard = shard;
+  hotplug = config.hotplug;
+
+  transport = config.simulate ? &sim_transport : &libusb_transport;
+
+  if (transport->init(pollfd))
+    return 1;
+
+  if (config.ep_rates_set && sched_init(pollfd))
+    return 1;
+
+  if (config.loopback && (shard == 0) && setup_loopback(max_size))
+    return 1;
+
+  // The simulated device is always there, and in a single shard
+
+  if (config.simulate) {
+    hotplug = false;
+
+    if (add_device(strdup("sim"), NULL))
+      return 1;
+
+    return usb_process_devices();
+  }
+
+  if (hotplug && !libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+    WARN("libusb has no hotplug support, scanning for devices once\n");
+    hotplug = false;
+  }
+
+  if (!hotplug) {
+    if (scan_devices())
+      return 1;
+
+    return usb_process_devices();
+  }
+
+  // With LIBUSB_HOTPLUG_ENUMERATE, hotplug_callback() is called for devices
+  // that are already attached before libusb_hotplug_register_callback()
+  // returns.
+
+  rc = libusb_hotplug_register_callback(ctx,
+					LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+					LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+					LIBUSB_HOTPLUG_ENUMERATE,
+					config.vendor, config.product,
+					LIBUSB_HOTPLUG_MATCH_ANY,
+					hotplug_callback, NULL,
+					&hotplug_handle);
+
+  if (rc) {
+    print_usberr(rc, "Failed to register hotplug callback");
     return 1;
+  }
+
+  if (!devices)
+    INFO("Waiting for USB device %04x/%04x to be attached\n",
+	 config.vendor, config.product);
 
-  return setup_device(dev, dev_handle, &desc, max_size);
+  return usb_process_devices();
 }
 
 int cancel_all(struct piperendpoint *xep) {
@@ -579,7 +2192,7 @@ int cancel_all(struct piperendpoint *xep) {
   int rc_out = 0;
 
   for (td = xep->td_queued->next; td != xep->td_queued; td = td->next) {
-    rc = libusb_cancel_transfer(td->transfer);
+    rc = transport->cancel(td->transfer);
 
     if (rc && (rc != LIBUSB_ERROR_NOT_FOUND)) {
       ERR("While canceling a transfer on endpoint %d on behalf of %s:\n",
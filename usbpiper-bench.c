@@ -0,0 +1,624 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "histogram.h"
+
+// End-to-end benchmark for usbpiper's device files. Each file given with
+// -r or -w is streamed by a thread of its own, with a data pattern that is
+// verified on the reading side. The output is throughput, the latency of
+// each read() and write() call, and CPU time per GB moved, both of this
+// process and (with --pid) of the daemon.
+//
+// usbpiper serves one READ and one WRITE at a time per file, so there is
+// no point in several threads per file. Concurrency comes from files.
+
+typedef int boolean;
+#define true 1
+#define false 0
+
+enum pattern_type {
+  PATTERN_NONE,
+  PATTERN_COUNTER, // A running byte counter, as the simulated device sends
+  PATTERN_PRBS, // xorshift64 pseudo-random sequence
+};
+
+struct pattern {
+  enum pattern_type type;
+  uint64_t state;
+  uint8_t counter;
+  uint8_t word[8]; // Current PRBS word, and how much of it is left
+  int word_left;
+};
+
+struct worker {
+  pthread_t thread;
+  char *path;
+  boolean is_write;
+  int fd;
+  struct pattern gen;
+  boolean synced; // Counter pattern: Synchronized to the first byte read
+  unsigned char *buf;
+  unsigned char *expected;
+  uint64_t bytes;
+  uint64_t calls;
+  uint64_t mismatches; // Blocks with unexpected data
+  uint64_t first_mismatch; // Stream offset of the first one
+  struct piperhist latency;
+  uint64_t elapsed_ns; // Until the thread stopped
+  boolean failed;
+};
+
+static struct {
+  unsigned int block_size;
+  double seconds;
+  uint64_t max_bytes; // Per file, 0 = unlimited
+  enum pattern_type pattern;
+  uint64_t seed;
+  boolean json;
+  int pid; // Of the daemon, for CPU accounting
+} opts = {
+  .block_size = 65536,
+  .seconds = 10,
+  .pattern = PATTERN_COUNTER,
+  .seed = 0x5eed5eed5eed5eedULL,
+};
+
+#define MAX_WORKERS 64
+
+static struct worker workers[MAX_WORKERS];
+static int num_workers;
+static volatile boolean stop;
+static int finished; // Number of threads that stopped
+static uint64_t start;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void pattern_fill(struct pattern *p, unsigned char *buf, size_t len) {
+  static unsigned char table[512];
+  size_t n;
+  int i;
+
+  switch (p->type) {
+  case PATTERN_NONE:
+    return;
+
+  case PATTERN_COUNTER:
+    if (!table[1])
+      for (i=0; i<sizeof(table); i++)
+	table[i] = i;
+
+    while (len) {
+      n = (len < 256) ? len : 256;
+      memcpy(buf, &table[p->counter], n);
+      p->counter += n; // Wraps around at 256
+      buf += n;
+      len -= n;
+    }
+    return;
+
+  case PATTERN_PRBS:
+    while (len) {
+      if (!p->word_left) {
+	uint64_t x = p->state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	p->state = x;
+
+	// Whole words directly, when aligned to the sequence
+	if (len >= 8) {
+	  memcpy(buf, &x, 8);
+	  buf += 8;
+	  len -= 8;
+	  continue;
+	}
+
+	memcpy(p->word, &x, 8);
+	p->word_left = 8;
+      }
+
+      n = (len < p->word_left) ? len : p->word_left;
+      memcpy(buf, &p->word[8 - p->word_left], n);
+      p->word_left -= n;
+      buf += n;
+      len -= n;
+    }
+    return;
+  }
+}
+
+static void verify(struct worker *w, size_t len) {
+  size_t i;
+
+  if (w->gen.type == PATTERN_NONE)
+    return;
+
+  // The counter pattern may start anywhere, e.g. after a previous run
+  if ((w->gen.type == PATTERN_COUNTER) && !w->synced) {
+    w->gen.counter = w->buf[0];
+    w->synced = true;
+  }
+
+  pattern_fill(&w->gen, w->expected, len);
+
+  if (!memcmp(w->buf, w->expected, len))
+    return;
+
+  for (i=0; (i < len) && (w->buf[i] == w->expected[i]); i++)
+    ;
+
+  if (!w->mismatches++)
+    w->first_mismatch = w->bytes + i;
+
+  // Resynchronize, so that one gap doesn't make everything after it wrong
+  if (w->gen.type == PATTERN_COUNTER)
+    w->gen.counter = w->buf[len - 1] + 1;
+}
+
+static void *worker_thread(void *arg) {
+  struct worker *w = arg;
+  uint64_t t;
+  ssize_t rc;
+  size_t len;
+
+  while (!stop) {
+    len = opts.block_size;
+
+    if (opts.max_bytes && (opts.max_bytes - w->bytes < len))
+      len = opts.max_bytes - w->bytes;
+
+    if (!len)
+      break;
+
+    if (w->is_write)
+      pattern_fill(&w->gen, w->buf, len);
+
+    t = now_ns();
+
+    if (w->is_write)
+      rc = write(w->fd, w->buf, len);
+    else
+      rc = read(w->fd, w->buf, len);
+
+    if (rc < 0) {
+      if (errno == EINTR)
+	continue; // Probably stop, see main()
+
+      fprintf(stderr, "%s %s: %s\n", w->is_write ? "write" : "read",
+	      w->path, strerror(errno));
+      w->failed = true;
+      break;
+    }
+
+    hist_add(&w->latency, now_ns() - t);
+    w->calls++;
+
+    if (rc == 0) {
+      fprintf(stderr, "%s: Unexpected EOF\n", w->path);
+      w->failed = true;
+      break;
+    }
+
+    // A short write means that the rest wasn't written, and the data
+    // pattern must continue from there.
+    if (w->is_write && (rc < len)) {
+      fprintf(stderr, "%s: Short write (%zd of %zu bytes)\n", w->path, rc, len);
+      w->failed = true;
+      break;
+    }
+
+    if (!w->is_write)
+      verify(w, rc);
+
+    w->bytes += rc;
+  }
+
+  w->elapsed_ns = now_ns() - start;
+  __atomic_add_fetch(&finished, 1, __ATOMIC_RELEASE);
+
+  return NULL;
+}
+
+static double mb_per_s(struct worker *w) {
+  return w->elapsed_ns ? w->bytes * 1000.0 / w->elapsed_ns : 0;
+}
+
+static void interrupt_handler(int sig) {
+}
+
+// CPU time of process @pid in seconds, from /proc/PID/stat
+
+static double process_cpu(int pid) {
+  char path[64], buf[1024], *p;
+  unsigned long utime, stime;
+  FILE *f;
+  int n;
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+
+  if (!(f = fopen(path, "r")))
+    return -1;
+
+  n = fread(buf, 1, sizeof(buf) - 1, f);
+  fclose(f);
+  buf[(n > 0) ? n : 0] = 0;
+
+  // The process name may contain spaces, so start after it
+  if (!(p = strrchr(buf, ')')) ||
+      (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+	      &utime, &stime) != 2))
+    return -1;
+
+  return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static double self_cpu(void) {
+  struct rusage ru;
+
+  getrusage(RUSAGE_SELF, &ru);
+
+  return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+    ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static void usage(char *prog) {
+  fprintf(stderr,
+	  "Usage: %s [options] -r FILE | -w FILE ...\n\n"
+	  "  -r, --read FILE             Read from FILE (may be repeated)\n"
+	  "  -w, --write FILE            Write to FILE (may be repeated)\n"
+	  "  -b, --block-size N          Bytes per read() or write() (default %u)\n"
+	  "  -t, --time SECONDS          Duration of the run (default %g)\n"
+	  "  -n, --bytes N               Stop each file after N bytes\n"
+	  "  -p, --pattern TYPE          counter (default), prbs or none\n"
+	  "      --seed N                Seed of the prbs pattern\n"
+	  "      --pid PID               Also account for the CPU time of the\n"
+	  "                              usbpiper process PID\n"
+	  "  -j, --json                  Output JSON instead of text\n"
+	  "  -h, --help                  This help\n\n"
+	  "The counter pattern matches usbpiper's simulated device. With\n"
+	  "--loopback, write to usbpiper_loop_out and read from\n"
+	  "usbpiper_loop_in with the same pattern. The prbs pattern is checked\n"
+	  "from the first byte read, so there must be no leftover data.\n",
+	  prog, opts.block_size, opts.seconds);
+}
+
+static int add_worker(char *path, boolean is_write) {
+  struct worker *w;
+
+  if (num_workers >= MAX_WORKERS) {
+    fprintf(stderr, "Too many files (max %d)\n", MAX_WORKERS);
+    return 1;
+  }
+
+  w = &workers[num_workers++];
+  w->path = path;
+  w->is_write = is_write;
+  return 0;
+}
+
+static int parse_size(char *s, uint64_t *val) {
+  char *end;
+  uint64_t v = strtoull(s, &end, 0);
+
+  if (end == s)
+    return 1;
+
+  switch (*end) {
+  case 'k': case 'K': v <<= 10; end++; break;
+  case 'm': case 'M': v <<= 20; end++; break;
+  case 'g': case 'G': v <<= 30; end++; break;
+  }
+
+  if (*end)
+    return 1;
+
+  *val = v;
+  return 0;
+}
+
+static int parse_args(int argc, char **argv) {
+  enum {
+    OPT_SEED = 0x100,
+    OPT_PID,
+  };
+
+  static const struct option long_options[] = {
+    { "read", required_argument, NULL, 'r' },
+    { "write", required_argument, NULL, 'w' },
+    { "block-size", required_argument, NULL, 'b' },
+    { "time", required_argument, NULL, 't' },
+    { "bytes", required_argument, NULL, 'n' },
+    { "pattern", required_argument, NULL, 'p' },
+    { "seed", required_argument, NULL, OPT_SEED },
+    { "pid", required_argument, NULL, OPT_PID },
+    { "json", no_argument, NULL, 'j' },
+    { "help", no_argument, NULL, 'h' },
+    { }
+  };
+
+  uint64_t val;
+  int c;
+
+  while ((c = getopt_long(argc, argv, "r:w:b:t:n:p:jh",
+			  long_options, NULL)) != -1) {
+    switch (c) {
+    case 'r':
+    case 'w':
+      if (add_worker(optarg, c == 'w'))
+	return 1;
+      break;
+
+    case 'b':
+      if (parse_size(optarg, &val) || !val || (val > (1 << 30))) {
+	fprintf(stderr, "Invalid block size \"%s\"\n", optarg);
+	return 1;
+      }
+      opts.block_size = val;
+      break;
+
+    case 't':
+      opts.seconds = atof(optarg);
+
+      if (opts.seconds <= 0) {
+	fprintf(stderr, "Invalid duration \"%s\"\n", optarg);
+	return 1;
+      }
+      break;
+
+    case 'n':
+      if (parse_size(optarg, &opts.max_bytes)) {
+	fprintf(stderr, "Invalid byte count \"%s\"\n", optarg);
+	return 1;
+      }
+      break;
+
+    case 'p':
+      if (!strcmp(optarg, "counter"))
+	opts.pattern = PATTERN_COUNTER;
+      else if (!strcmp(optarg, "prbs"))
+	opts.pattern = PATTERN_PRBS;
+      else if (!strcmp(optarg, "none"))
+	opts.pattern = PATTERN_NONE;
+      else {
+	fprintf(stderr, "Invalid pattern \"%s\"\n", optarg);
+	return 1;
+      }
+      break;
+
+    case OPT_SEED:
+      if (parse_size(optarg, &opts.seed) || !opts.seed) {
+	fprintf(stderr, "Invalid seed \"%s\"\n", optarg);
+	return 1;
+      }
+      break;
+
+    case OPT_PID:
+      opts.pid = atoi(optarg);
+      break;
+
+    case 'j':
+      opts.json = true;
+      break;
+
+    case 'h':
+      usage(argv[0]);
+      exit(0);
+
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (!num_workers || (optind < argc)) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  return 0;
+}
+
+static void print_text(double elapsed, double cpu_self, double cpu_daemon) {
+  uint64_t total[2] = { 0, 0 };
+  double gb;
+  int i;
+
+  for (i=0; i<num_workers; i++) {
+    struct worker *w = &workers[i];
+    struct piperhist *h = &w->latency;
+
+    total[w->is_write] += w->bytes;
+
+    printf("%-40s %-5s %9.1f MB/s  latency us p50 %.1f p99 %.1f "
+	   "p999 %.1f max %.1f  calls %llu",
+	   w->path, w->is_write ? "write" : "read",
+	   mb_per_s(w),
+	   hist_percentile(h, 0.5) / 1000.0,
+	   hist_percentile(h, 0.99) / 1000.0,
+	   hist_percentile(h, 0.999) / 1000.0,
+	   h->max / 1000.0,
+	   (unsigned long long) w->calls);
+
+    if (w->mismatches)
+      printf("  MISMATCHES %llu (first at byte %llu)",
+	     (unsigned long long) w->mismatches,
+	     (unsigned long long) w->first_mismatch);
+
+    printf("%s\n", w->failed ? "  FAILED" : "");
+  }
+
+  printf("Total: read %.1f MB/s, write %.1f MB/s in %.2f s\n",
+	 total[0] / elapsed / 1e6, total[1] / elapsed / 1e6, elapsed);
+
+  gb = (total[0] + total[1]) / 1e9;
+
+  if (gb > 0) {
+    printf("CPU: %.3f s/GB (bench)", cpu_self / gb);
+
+    if (cpu_daemon >= 0)
+      printf(", %.3f s/GB (usbpiper)", cpu_daemon / gb);
+
+    printf("\n");
+  }
+}
+
+static void print_json(double elapsed, double cpu_self, double cpu_daemon) {
+  uint64_t total = 0;
+  double gb;
+  int i;
+
+  printf("{\n  \"elapsed_s\": %.3f,\n  \"block_size\": %u,\n"
+	 "  \"files\": [\n", elapsed, opts.block_size);
+
+  for (i=0; i<num_workers; i++) {
+    struct worker *w = &workers[i];
+    struct piperhist *h = &w->latency;
+
+    total += w->bytes;
+
+    printf("    { \"path\": \"%s\", \"direction\": \"%s\", "
+	   "\"bytes\": %llu, \"mb_per_s\": %.1f, \"calls\": %llu,\n"
+	   "      \"latency_us\": { \"p50\": %.1f, \"p99\": %.1f, "
+	   "\"p999\": %.1f, \"max\": %.1f },\n"
+	   "      \"mismatches\": %llu, \"failed\": %s }%s\n",
+	   w->path, w->is_write ? "write" : "read",
+	   (unsigned long long) w->bytes, mb_per_s(w),
+	   (unsigned long long) w->calls,
+	   hist_percentile(h, 0.5) / 1000.0,
+	   hist_percentile(h, 0.99) / 1000.0,
+	   hist_percentile(h, 0.999) / 1000.0,
+	   h->max / 1000.0,
+	   (unsigned long long) w->mismatches,
+	   w->failed ? "true" : "false",
+	   (i < num_workers - 1) ? "," : "");
+  }
+
+  gb = total / 1e9;
+
+  printf("  ],\n  \"cpu_s_per_gb\": { \"bench\": %.4f",
+	 (gb > 0) ? cpu_self / gb : 0);
+
+  if (cpu_daemon >= 0)
+    printf(", \"usbpiper\": %.4f", (gb > 0) ? cpu_daemon / gb : 0);
+
+  printf(" }\n}\n");
+}
+
+int main(int argc, char **argv) {
+  struct sigaction sa;
+  struct timespec tick = { .tv_sec = 0, .tv_nsec = 10000000 }; // 10 ms
+  double cpu_self, cpu_daemon = -1, daemon_start = -1;
+  uint64_t elapsed = 0;
+  boolean failed = false;
+  int i, rc;
+
+  if (parse_args(argc, argv))
+    return 1;
+
+  // Threads blocked in read() or write() are stopped with a signal. The
+  // daemon then gets an INTERRUPT request for the pending READ or WRITE.
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = interrupt_handler;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR1, &sa, NULL);
+
+  for (i=0; i<num_workers; i++) {
+    struct worker *w = &workers[i];
+
+    w->fd = open(w->path, w->is_write ? O_WRONLY : O_RDONLY);
+
+    if (w->fd < 0) {
+      perror(w->path);
+      return 1;
+    }
+
+    w->buf = malloc(opts.block_size);
+    w->expected = malloc(opts.block_size);
+
+    if (!w->buf || !w->expected) {
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+    }
+
+    w->gen.type = opts.pattern;
+    w->gen.state = opts.seed;
+  }
+
+  if (opts.pid)
+    daemon_start = process_cpu(opts.pid);
+
+  cpu_self = self_cpu();
+  start = now_ns();
+
+  for (i=0; i<num_workers; i++) {
+    rc = pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]);
+
+    if (rc) {
+      fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+      return 1;
+    }
+  }
+
+  // With --bytes, the threads may finish earlier
+
+  while ((__atomic_load_n(&finished, __ATOMIC_ACQUIRE) < num_workers) &&
+	 ((elapsed = now_ns() - start) < opts.seconds * 1e9))
+    nanosleep(&tick, NULL);
+
+  // A thread may be just about to call read() or write() when the signal
+  // arrives, and then block. So keep signaling until all have stopped.
+
+  stop = true;
+
+  while (__atomic_load_n(&finished, __ATOMIC_ACQUIRE) < num_workers) {
+    for (i=0; i<num_workers; i++)
+      if (!workers[i].elapsed_ns)
+	pthread_kill(workers[i].thread, SIGUSR1);
+
+    nanosleep(&tick, NULL);
+  }
+
+  for (i=0; i<num_workers; i++) {
+    pthread_join(workers[i].thread, NULL);
+    failed |= workers[i].failed || workers[i].mismatches;
+  }
+
+  cpu_self = self_cpu() - cpu_self;
+
+  if (daemon_start >= 0)
+    cpu_daemon = process_cpu(opts.pid) - daemon_start;
+
+  for (i=0; i<num_workers; i++)
+    close(workers[i].fd);
+
+  elapsed = 0;
+
+  for (i=0; i<num_workers; i++)
+    if (workers[i].elapsed_ns > elapsed)
+      elapsed = workers[i].elapsed_ns;
+
+  if (opts.json)
+    print_json(elapsed / 1e9, cpu_self, cpu_daemon);
+  else
+    print_text(elapsed / 1e9, cpu_self, cpu_daemon);
+
+  return failed ? 2 : 0;
+}
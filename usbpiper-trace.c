@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "trace.h"
+
+// Decoder for the binary trace dumped by usbpiper on SIGUSR1. Prints the
+// events of all shards merged in time order, with the time relative to the
+// first event.
+
+static const char *names[TRACE_IDS] = {
+  [TRACE_CUSE_REQUEST] = "cuse_request",
+  [TRACE_READ] = "read",
+  [TRACE_READ_DONE] = "read_done",
+  [TRACE_WRITE] = "write",
+  [TRACE_WRITE_DONE] = "write_done",
+  [TRACE_INTERRUPT] = "interrupt",
+  [TRACE_TIMER] = "timer",
+  [TRACE_TD_SUBMIT] = "td_submit",
+  [TRACE_TD_DONE] = "td_done",
+};
+
+struct event {
+  struct pipertraceevent e;
+  uint32_t shard;
+};
+
+static int compare(const void *a, const void *b) {
+  const struct event *x = a, *y = b;
+
+  if (x->e.timestamp != y->e.timestamp)
+    return (x->e.timestamp < y->e.timestamp) ? -1 : 1;
+
+  return 0;
+}
+
+static void print_event(struct event *ev, uint64_t t0) {
+  struct pipertraceevent *e = &ev->e;
+  uint64_t t = e->timestamp - t0;
+  const char *name = (e->id < TRACE_IDS) ? names[e->id] : NULL;
+
+  printf("%6llu.%06llu shard %u ",
+	 (unsigned long long) (t / 1000000000),
+	 (unsigned long long) ((t % 1000000000) / 1000),
+	 ev->shard);
+
+  if (!name) {
+    printf("unknown event %u\n", e->id);
+    return;
+  }
+
+  switch (e->id) {
+  case TRACE_TD_SUBMIT:
+    printf("%s ep %02x length %llu\n", name, e->arg0,
+	   (unsigned long long) e->arg1);
+    break;
+
+  case TRACE_TD_DONE:
+    printf("%s ep %02x actual %llu status %d\n", name, e->arg0,
+	   (unsigned long long) e->arg1, (int) e->arg2);
+    break;
+
+  case TRACE_READ_DONE:
+  case TRACE_WRITE_DONE:
+    printf("%s fd %u unique %llu result %lld\n", name, e->arg0,
+	   (unsigned long long) e->arg1, (long long) e->arg2);
+    break;
+
+  default:
+    printf("%s fd %u unique %llu arg %llu\n", name, e->arg0,
+	   (unsigned long long) e->arg1, (unsigned long long) e->arg2);
+  }
+}
+
+int main(int argc, char **argv) {
+  struct pipertracefile file;
+  struct pipertraceringhdr hdr;
+  struct pipertraceevent *ring = NULL;
+  struct event *events = NULL;
+  unsigned long num = 0, i;
+  uint64_t first, n;
+  uint32_t r;
+  FILE *f;
+
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s TRACE-FILE\n", argv[0]);
+    return 1;
+  }
+
+  if (!(f = fopen(argv[1], "rb"))) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  if ((fread(&file, sizeof(file), 1, f) != 1) ||
+      memcmp(file.magic, TRACE_MAGIC, sizeof(file.magic))) {
+    fprintf(stderr, "%s is not a usbpiper trace file\n", argv[1]);
+    return 1;
+  }
+
+  for (r=0; r<file.num_rings; r++) {
+    if ((fread(&hdr, sizeof(hdr), 1, f) != 1) || !hdr.size ||
+	(hdr.size & (hdr.size - 1)))
+      goto truncated;
+
+    ring = realloc(ring, hdr.size * sizeof(*ring));
+    events = realloc(events, (num + hdr.size) * sizeof(*events));
+
+    if (!ring || !events) {
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+    }
+
+    if (fread(ring, sizeof(*ring), hdr.size, f) != hdr.size)
+      goto truncated;
+
+    // The oldest event may have been in the middle of being overwritten
+    first = (hdr.head > hdr.size) ? hdr.head - hdr.size + 1 : 0;
+
+    for (n = first; n < hdr.head; n++) {
+      events[num].e = ring[n & (hdr.size - 1)];
+      events[num].shard = hdr.shard;
+      num++;
+    }
+  }
+
+  fclose(f);
+
+  qsort(events, num, sizeof(*events), compare);
+
+  for (i=0; i<num; i++)
+    print_event(&events[i], events[0].e.timestamp);
+
+  return 0;
+
+ truncated:
+  fprintf(stderr, "%s is truncated or corrupt\n", argv[1]);
+  return 1;
+}
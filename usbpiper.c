@@ -1,36 +1,107 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
 #include <sys/epoll.h>
 
 #include "usbpiper.h"
 #include "cuse.h"
 
-static const int max_size = 0x20000;
 #define ARRAYSIZE 10
 
-static void eventloop(int pollfd) {
+struct pipershard {
+  int index;
+  int cpu; // -1 if not pinned
+  pthread_t thread;
+};
+
+static struct pipershard shards[MAX_SHARDS];
+
+// With --busy-poll, the loop doesn't sleep while events keep coming, so
+// there's no wakeup latency: epoll_wait() is called with a zero timeout
+// until there's an event, and blocks only after config.spin_budget ns
+// without any (never with a zero budget). The libusb and CUSE fds are all
+// in the epoll set, so this polls every one of them.
+
+static int poll_events(int pollfd, struct epoll_event *events,
+		       struct pipershardstats *st) {
+  uint64_t start = 0, now;
+  int num;
+
+  while (1) {
+    num = epoll_wait(pollfd, events, ARRAYSIZE, 0);
+    st->polls++;
+
+    if (num)
+      break;
+
+    now = piper_now();
+
+    if (!start) {
+      start = now;
+    } else if (config.spin_budget && ((now - start) >= config.spin_budget)) {
+      st->spin_ns += now - start;
+      st->sleeps++;
+      return epoll_wait(pollfd, events, ARRAYSIZE, -1);
+    }
+  }
+
+  if (start)
+    st->spin_ns += piper_now() - start;
+
+  return num;
+}
+
+// Returns only on failure
+
+static int eventloop(int pollfd, struct pipershardstats *st) {
   struct epoll_event event_array[ARRAYSIZE];
   int num, i;
 
   while (1) {
-    if ((num = epoll_wait(pollfd, event_array, ARRAYSIZE, -1)) < 0) {
+    num = config.busy_poll ? poll_events(pollfd, event_array, st) :
+      epoll_wait(pollfd, event_array, ARRAYSIZE, -1);
+
+    // Signals are blocked in the shards (see trace.c), but a stopped and
+    // continued process, or a debugger, may interrupt epoll_wait() anyway
+    if ((num < 0) && (errno == EINTR))
+      continue;
+
+    if (num < 0) {
       perror("epoll_wait");
-      break;
+      return 1;
     }
 
     for (i=0; i<num; i++) {
       struct pipercallback *c = event_array[i].data.ptr;
       if ((*c->callback)(event_array[i].events, c->private))
-	return;
+	return 1;
     }
+
+    // Devices are set up and torn down only between batches of events,
+    // so that no pending event refers to a freed callback struct.
+    if (usb_process_devices())
+      return 1;
   }
 }
 
-int main(int argc, char **argv) {
+// A shard is an event loop with its own epoll fd, libusb session, buffers
+// and share of the USB devices. The per-shard state in devfile.c and usb.c
+// is thread-local, so each shard runs in its own thread.
+
+static int run_shard(struct pipershard *shard) {
+  char name[32];
   int pollfd;
 
-  WARN("\nNote: This utility is NOT a driver for the XillyUSB FPGA IP core.\n\n");
+  snprintf(name, sizeof(name), "Shard %d", shard->index);
+  realtime_thread(name, &shard->cpu, (shard->cpu >= 0) ? 1 : 0, true);
 
-  if (init_devfile(max_size))
+  if (trace_init(shard->index, config.trace_size))
+    return 1;
+
+  if (init_devfile(config.max_size, config.splice_threshold))
     return 1;
 
   pollfd = epoll_create1(0);
@@ -40,10 +111,63 @@ int main(int argc, char **argv) {
     return 1;
   }
 
-  if (init_usb(pollfd, max_size))
+  // The stats file covers all shards, but is served by the first one
+  if (stats_init(pollfd, shard->index))
+    return 1;
+
+  if (init_usb(pollfd, config.max_size, shard->index))
+    return 1;
+
+  return eventloop(pollfd, &shard_stats[shard->index]);
+}
+
+// If any shard quits, the whole daemon does, just like with a single one.
+
+static void *shard_thread(void *arg) {
+  exit(run_shard(arg));
+}
+
+int main(int argc, char **argv) {
+  int i, rc;
+
+  if (parse_options(argc, argv))
+    return 1;
+
+  WARN("\nNote: This utility is NOT a driver for the XillyUSB FPGA IP core.\n\n");
+
+  if (realtime_lock_memory())
+    return 1;
+
+  if (config.trace_size && trace_install_signal())
     return 1;
 
-  eventloop(pollfd);
+  for (i=0; i<32; i++)
+    if (config.tap_files[i]) {
+      if (tap_start())
+	return 1;
+      break;
+    }
+
+  for (i=0; i<config.shards; i++) {
+    shards[i].index = i;
+    shards[i].cpu = config.num_shard_cpus ?
+      config.shard_cpus[i % config.num_shard_cpus] : -1;
+  }
+
+  if (config.shards == 1)
+    return run_shard(&shards[0]);
+
+  for (i=0; i<config.shards; i++) {
+    rc = pthread_create(&shards[i].thread, NULL, shard_thread, &shards[i]);
+
+    if (rc) {
+      ERR("Failed to start thread for shard %d: %s\n", i, strerror(rc));
+      return 1;
+    }
+  }
+
+  for (i=0; i<config.shards; i++)
+    pthread_join(shards[i].thread, NULL);
 
   return 0;
 }
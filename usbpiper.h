@@ -3,14 +3,34 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <time.h>
+#include <sys/uio.h>
 #include <libusb-1.0/libusb.h>
 
+#include "histogram.h"
+#include "trace.h"
+#include "tap.h"
+#include "probes.h"
+
+// BUG() and ERR() are always printed. The others depend on --log-level.
+// Per-request events go to the trace ring (see trace()) rather than here.
+
+enum piperloglevel {
+  LOGLEVEL_ERR,
+  LOGLEVEL_WARN,
+  LOGLEVEL_INFO,
+  LOGLEVEL_DEBUG,
+};
+
+#define LOG_AT(level, ...) \
+  { if (config.log_level >= (level)) fprintf(stderr, __VA_ARGS__); }
+
 #define BUG(...) { fprintf(stderr, __VA_ARGS__); }
 #define ERR(...) { fprintf(stderr, __VA_ARGS__); }
-#define WARN(...) { fprintf(stderr, __VA_ARGS__); }
-#define LOG(...) { fprintf(stderr, __VA_ARGS__); }
-#define DEBUG(...) { fprintf(stderr, __VA_ARGS__); }
-#define INFO(...) { fprintf(stderr, __VA_ARGS__); }
+#define WARN(...) LOG_AT(LOGLEVEL_WARN, __VA_ARGS__)
+#define LOG(...) LOG_AT(LOGLEVEL_WARN, __VA_ARGS__)
+#define DEBUG(...) LOG_AT(LOGLEVEL_DEBUG, __VA_ARGS__)
+#define INFO(...) LOG_AT(LOGLEVEL_INFO, __VA_ARGS__)
 
 enum xusb_state {
   XUSB_CLOSED = 0,
@@ -20,33 +40,284 @@ enum xusb_state {
 
 typedef enum { false = 0, true = 1 } boolean;
 
+// In packet mode, each message in a FIFO is preceded by its length
+typedef uint32_t piperpkthdr;
+
 struct piperfifo {
   unsigned int size; // In bytes
   unsigned int fill; // Number of bytes in the FIFO
+  unsigned int highwater; // Largest fill seen, for statistics
   unsigned int readpos;
   unsigned int writepos;
   void *mem;
+  boolean huge; // @mem is a mapping of huge pages, see piper_alloc()
 };
 
 struct piperusbfile;
 struct piperendpoint;
+struct pipertap;
+
+// Statistics are plain counters, updated and reset only by the thread that
+// runs the endpoint, and read without locking by the stats file.
+
+#define STATS_DEPTHS 17 // The last entry counts all deeper queues
+
+struct piperepstats {
+  uint64_t bytes;
+  uint64_t transfers;
+  uint64_t short_transfers;
+  uint64_t depth[STATS_DEPTHS]; // TDs left queued when one completes
+  uint64_t zero_td_ns; // Time the file was open with no TDs queued
+  uint64_t zero_td_since; // When the current such period began, or 0
+  uint64_t sched_waits; // TDs held back for other endpoints' turn
+  uint64_t throttles; // TDs held back by the rate cap
+};
+
+struct piperfilestats {
+  uint64_t reads_full; // READ completions by reason
+  uint64_t reads_timeout;
+  uint64_t reads_interrupted;
+  uint64_t reads_message; // Packet mode
+  uint64_t writes;
+  uint64_t timer_arms;
+  struct piperhist read_latency; // READ request to its completion
+  struct piperhist write_latency; // WRITE admission to its completion
+};
+
+#define MAX_SHARDS 64
+#define FIFO_SIZE_MAX (1UL << 30) // Largest FIFO that may be requested
+#define CACHE_LINE 64 // For the layout of per-endpoint state
+
+// Event loop counters of each shard with --busy-poll. Each shard's are on
+// cache lines of their own, as they're updated on every poll.
+
+struct pipershardstats {
+  uint64_t polls; // epoll_wait() calls with a zero timeout
+  uint64_t spin_ns; // Time spent polling without any event
+  uint64_t sleeps; // Times the spin budget ran out and the loop blocked
+} __attribute__((aligned(CACHE_LINE)));
+
+extern struct pipershardstats shard_stats[MAX_SHARDS];
+
+struct pipershardmap {
+  struct pipershardmap *next;
+  char *path;
+  int shard;
+};
+
+struct piperconfig {
+  uint16_t vendor;
+  uint16_t product;
+  int max_size;
+  int splice_threshold;
+  boolean hotplug;
+  int shards;
+  int shard_cpus[MAX_SHARDS];
+  int num_shard_cpus;
+  struct pipershardmap *shard_map;
+  uint32_t interfaces; // Bitmap of interface numbers to claim
+  boolean interfaces_requested; // Bitmap set explicitly
+  int alt[32]; // Initial alternate setting of each interface
+  int iso_tds; // Number of TDs on each isochronous endpoint
+  int iso_packets; // Number of packets in each isochronous TD
+  boolean iso_meta; // Create side channel files for isochronous endpoints
+  uint32_t packet_eps; // Bitmap of endpoints in packet mode, see below
+  boolean packet_interrupt; // All interrupt endpoints in packet mode
+  int log_level; // enum piperloglevel
+  unsigned int trace_size; // Events in each shard's trace ring, 0 = off
+  char *trace_file; // Where SIGUSR1 dumps the trace rings
+  boolean simulate; // Serve a simulated device instead of a real one
+  boolean loopback; // Create a pair of device files connected to each other
+  char *tap_files[32]; // Capture file of each endpoint, see ep_index()
+  unsigned int tap_size; // Bytes in each tap's ring, a power of two
+  boolean huge_pages; // FIFOs and TD buffers in 2 MiB pages, if possible
+  unsigned int fifo_size; // Of all endpoints' FIFOs, 0 = FIFOSIZE in usb.c
+  unsigned int fifo_sizes[32]; // Of each endpoint's, see ep_index(), 0 = above
+  unsigned int fifo_max; // Cap for FIFOs that grow when full, 0 = fixed size
+  boolean lazy; // FIFOs and TD buffers only while the endpoint's file is open
+  size_t pool_size; // Bytes of them kept for reuse when released
+  int td_pool; // Spare TDs shared by bulk and interrupt endpoints
+  int td_max; // TDs that an endpoint may have, own and borrowed
+  int rt_policy; // SCHED_FIFO or SCHED_RR, for the shards
+  int rt_priority; // 0 = regular scheduling
+  int worker_cpus[MAX_SHARDS]; // Of threads other than the shards
+  int num_worker_cpus;
+  boolean mlockall; // Lock all of the daemon's memory in RAM
+  boolean busy_poll; // Poll for events instead of sleeping in epoll_wait()
+  uint64_t spin_budget; // ns without events before blocking, 0 = never
+  int ep_weights[32]; // TD scheduling weight, see ep_index(), 0 = 1
+  uint64_t ep_rates[32]; // Bytes/s cap of each endpoint, 0 = none
+  boolean ep_rates_set; // Any of ep_rates is set
+  int device_tds; // TDs in flight on a device's endpoints, 0 = no cap
+};
+
+// Index of an endpoint address (e.g. 0x81) in per-endpoint arrays
+static inline int ep_index(uint8_t addr) {
+  return (addr & 0x0f) + ((addr & 0x80) ? 16 : 0);
+}
+
+// Bit in config.packet_eps for an endpoint address
+static inline uint32_t ep_bit(uint8_t addr) {
+  return 1 << ep_index(addr);
+}
+
+// The records in an isochronous endpoint's side channel file, one for each
+// packet, in the order of the packets' data in the main file. @timestamp
+// is CLOCK_MONOTONIC in nanoseconds, estimated from the TD's completion
+// time and the endpoint's interval. @offset is where the packet's data
+// begins in the main file's stream, counted from its OPEN, so the two
+// files can be lined up even if the side channel is opened later, or
+// records were dropped. @length is the number of bytes in the main file,
+// which is zero unless @status (a libusb_transfer_status) is
+// LIBUSB_TRANSFER_COMPLETED.
+
+struct piperisorecord {
+  uint64_t timestamp;
+  uint64_t offset;
+  uint32_t length;
+  int32_t status;
+};
+
+extern struct piperconfig config;
+
+// Control files have no endpoint behind them. show() fills @buf with up
+// to @size bytes of text to read, and returns its length. command() is
+// given the (NUL-terminated) data written to the file, and returns 0 or
+// a negative errno.
+
+struct piperctl {
+  int (*show)(void *private, char *buf, int size);
+  int (*command)(void *private, char *cmd);
+  void *private;
+};
+
+struct piperinterface {
+  struct piperdevice *device;
+  const struct libusb_interface *desc;
+  int number;
+  int alt; // Current alternate setting, its bAlternateSetting
+  struct piperusbfile *ctl; // Control file, if there's more than one alt
+  struct piperctl ctlops;
+};
+
+// One struct piperdevice exists for each matching USB device that is
+// attached, from its arrival until all its resources have been released
+// after its departure.
+
+struct piperdevice {
+  struct piperdevice *next;
+  libusb_device *dev; // NULL for a simulated device
+  libusb_device_handle *handle; // NULL until the device is set up
+  char *path; // Bus and port numbers, e.g. "1-4.2"
+  struct libusb_config_descriptor *cfg;
+  struct piperinterface *interfaces;
+  int num_interfaces;
+  struct piperendpoint *endpoints; // Linked through xep->next
+  boolean departed;
+  boolean failed;
+  int queued_tds; // Of its bulk and interrupt endpoints, see td_admit()
+  boolean sched_pending; // Has endpoints waiting for TDs to be admitted
+};
+
+// All access to USB goes through a transport. Transfers are struct
+// libusb_transfer for all transports, filled with libusb_fill_*_transfer()
+// and completed through their ->callback, with libusb's semantics:
+// cancel() only requests the cancellation, and the callback is called
+// later on with LIBUSB_TRANSFER_CANCELLED. Functions returning int return
+// 0 or a LIBUSB_ERROR_* code.
+
+struct pipertransport {
+  const char *name;
+  int (*init)(int pollfd); // Add the transport's fds to @pollfd
+  struct libusb_transfer *(*alloc_transfer)(int iso_packets);
+  void (*free_transfer)(struct libusb_transfer *transfer);
+  int (*submit)(struct libusb_transfer *transfer);
+  int (*cancel)(struct libusb_transfer *transfer);
+  int (*open)(struct piperdevice *device); // Sets ->handle and ->cfg
+  void (*close)(struct piperdevice *device);
+  void (*free_config)(struct libusb_config_descriptor *cfg);
+  int (*claim_interface)(struct piperinterface *intf);
+  int (*set_alt)(struct piperinterface *intf, int alt);
+};
 
 struct pipertd {
   struct pipertd *prev;
   struct pipertd *next;
   struct piperendpoint *xep;
   struct libusb_transfer *transfer;
+  uint64_t submitted; // piper_now() at submission
+  boolean borrowed; // From the shared spare TDs, see --td-pool
 };
 
+// The fields used for every transfer come first, so that they share the
+// first cache lines, followed by the FIFO struct and the TD array, in the
+// same allocation (see new_endpoint() in usb.c). The latency histogram is
+// large and each TD touches only one of its buckets, so it's at the end.
+// Fields that other threads write to are kept apart after it, so they
+// don't bounce the lines that the endpoint's shard works on.
+
 struct piperendpoint {
-  struct piperusbfile *dev;
-  struct piperfifo *fifo;
-  int ep;
-  libusb_device_handle *usbdevice;
+  struct piperfifo *fifo; // fifo_store, or the counterpart's in loopback
   struct pipertd *td_pool; // List header of unused TDs
   struct pipertd *td_queued; // List header of TDs submitted to libusb
+  struct piperusbfile *dev;
+  struct piperdevice *device;
+  struct piperendpoint *next; // Of the same device
+  libusb_device_handle *usbdevice;
+  struct pipertap *tap; // Capture of the data to / from USB, or NULL
   int num_queued_tds;
+  int num_tds; // Own TDs, not including borrowed ones
+  int num_borrowed; // Spare TDs currently borrowed
+  int td_bufsize;
   int transfer_type;
+  int ep;
+  uint8_t addr; // bEndpointAddress
+  boolean packet_mode; // FIFO holds messages, one per USB transfer
+  boolean present; // In the interface's current alternate setting
+  boolean lazy; // FIFO memory and td_bufs only while the file is open
+
+  // TD scheduling among the device's endpoints, see td_admit() in usb.c
+  int weight; // Share of the device's TDs (--device-tds)
+  boolean sched_waiting; // Waiting for one of the device's TDs
+  boolean throttled; // Waiting for tokens
+  uint64_t rate; // Bytes/s, 0 = no cap
+  int64_t tokens; // Bytes that may be submitted, negative if overdrawn
+  uint64_t tokens_at; // When tokens was last refilled
+
+  struct piperfifo fifo_store;
+  struct piperepstats stats;
+
+  // Isochronous endpoints only
+  int iso_packets; // Per TD
+  int iso_packet_size;
+  uint64_t iso_interval_ns;
+  struct piperendpoint *meta; // Side channel, if enabled
+  boolean is_meta; // This is a side channel
+  uint64_t iso_missed; // Packets not received
+  uint64_t iso_underruns; // No TDs were queued when one completed
+  uint64_t iso_dropped; // Packets (or records) that didn't fit into FIFO
+  uint64_t iso_offset; // Bytes written into the main stream since OPEN
+
+  struct piperinterface *intf;
+  int shard; // That runs the endpoint
+  void *td_bufs; // The buffers of all TDs, in one block
+  size_t td_bufs_size;
+  boolean td_bufs_huge; // See piper_alloc()
+
+  // FIFO sizes as set by the user don't include fifo_extra, which is the
+  // room for one WRITE on OUT endpoints
+  unsigned int fifo_extra;
+  unsigned int fifo_full_hits; // Episodes of a full FIFO since fifo_full_since
+  uint64_t fifo_full_since;
+  boolean fifo_was_full; // Not drained since the last episode was counted
+
+  struct piperhist usb_latency; // TD submission to completion
+
+  // Written by the shard that serves the statistics file
+  unsigned int fifo_request // New size from the statistics file, or 0
+    __attribute__((aligned(CACHE_LINE)));
+  struct piperendpoint *stats_next; // List of all endpoints, in stats.c
+  struct piperendpoint **stats_pprev;
 };
 
 struct pipercallback {
@@ -54,30 +325,74 @@ struct pipercallback {
   void *private;
 };
 
+// The state of a device file, in one allocation with its name. The fields
+// used on each request come first. The flags are separate booleans rather
+// than bitfields, so setting one is a plain store.
+
 struct piperusbfile {
-  libusb_device_handle *usbdevice;
   int fd;
   int timerfd;
-  char *name;
   enum xusb_state state;
+  uint32_t read_size;
+  uint32_t write_size;
+  boolean timer_armed;
+  boolean timed_out;
+  boolean interrupted_up;
+  boolean interrupted_down;
+  boolean bulkout_canceled;
+  boolean splice_next; // The last request was a WRITE worth splicing
   uint64_t unique_up;
   uint64_t unique_down; // Also for release
+  uint64_t up_since; // When the pending READ arrived
+  uint64_t down_since; // When the pending WRITE was admitted
   struct piperendpoint *sink;
   struct piperendpoint *source;
-  struct pipercallback *callback;
-  struct pipercallback *timer_callback;
-  uint32_t read_size;
-  uint32_t write_size;
-  int timer_armed:1;
-  int timed_out:1;
-  int interrupted_up:1;
-  int interrupted_down:1;
-  int bulkout_canceled:1;
 
-  // Temporary, for simple loopback
+  // Loopback mode: The file at the other end of the shared FIFO
   struct piperusbfile *counterpart;
+
+  struct pipercallback callback;
+  struct pipercallback timer_callback;
+  struct piperfilestats stats;
+  struct piperctl *ctl; // Non-NULL for a control file
+  char *name;
 };
 
+static inline uint64_t piper_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct pipertracering {
+  struct pipertraceringhdr hdr;
+  struct pipertraceevent *events;
+};
+
+extern __thread struct pipertracering *trace_ring;
+
+// Record an event in the shard's trace ring, if tracing is enabled. The
+// event is published by incrementing the head after it has been written.
+
+static inline void trace(uint32_t id, uint32_t arg0,
+			 uint64_t arg1, uint64_t arg2) {
+  struct pipertracering *r = trace_ring;
+  struct pipertraceevent *e;
+
+  if (!r)
+    return;
+
+  e = &r->events[r->hdr.head & (r->hdr.size - 1)];
+  e->timestamp = piper_now();
+  e->id = id;
+  e->arg0 = arg0;
+  e->arg1 = arg1;
+  e->arg2 = arg2;
+
+  __atomic_store_n(&r->hdr.head, r->hdr.head + 1, __ATOMIC_RELEASE);
+}
+
 static inline unsigned int fifo_fill(struct piperfifo *fifo) {
   return fifo->fill;
 }
@@ -86,32 +401,74 @@ static inline unsigned int fifo_vacant(struct piperfifo *fifo) {
   return fifo->size - fifo->fill;
 }
 
+// Called before a FIFO is checked for room, see fifo_full() in usb.c. Once
+// it has drained to half its size, the next time it's full counts anew.
+
+static inline void fifo_check_drained(struct piperendpoint *xep) {
+  if (xep->fifo_was_full && (xep->fifo->fill <= xep->fifo->size / 2))
+    xep->fifo_was_full = false;
+}
+
 // Headers for devfile.c:
+extern int (*devfile_open_cuse)(char *name);
 struct piperusbfile *devfile_init(int pollfd, char *name);
 void devfile_destroy(struct piperusbfile *xusb);
-int init_devfile(int max_size);
+int init_devfile(int max_size, int splice_threshold);
 void deinit_devfile(void);
 int try_complete_release(struct piperusbfile *xusb);
 int try_complete_write(struct piperusbfile *xusb);
 int try_complete_read(struct piperusbfile *xusb);
 
+// Headers for hugepage.c:
+
+enum piperpool { POOL_FIFO, POOL_TD };
+
+void *piper_alloc(size_t size, const char *what, boolean *huge);
+void piper_free(void *mem, size_t size, boolean huge);
+void *pool_get(size_t size, enum piperpool kind, boolean *huge);
+boolean pool_put(void *mem, size_t size, enum piperpool kind, boolean huge);
+
 // Headers for fifo.c:
 
 struct piperfifo *piperfifo_new(unsigned int size);
+void piperfifo_init(struct piperfifo *fifo, unsigned int size);
 void piperfifo_destroy(struct piperfifo *fifo);
+int piperfifo_resize(struct piperfifo *fifo, unsigned int size);
+int piperfifo_get_mem(struct piperfifo *fifo);
+void piperfifo_put_mem(struct piperfifo *fifo, boolean pool);
 unsigned int piperfifo_write(struct piperfifo *fifo,
 			     void *data, unsigned int len);
 unsigned int piperfifo_read(struct piperfifo *fifo,
 			    void *data, unsigned int len);
 unsigned int piperfifo_limit(struct piperfifo *fifo,
 			     unsigned int len);
+int piperfifo_peek_iov(struct piperfifo *fifo, struct iovec *iov,
+		       unsigned int len);
+unsigned int piperfifo_drop(struct piperfifo *fifo,
+			    unsigned int len);
+int piperfifo_write_fd(struct piperfifo *fifo,
+		       int fd, unsigned int len);
+
+// Headers for realtime.c:
+int realtime_lock_memory(void);
+void realtime_thread(const char *name, const int *cpus, int num_cpus,
+		     boolean realtime);
+
+// Headers for config.c:
+int parse_uint(char *s, unsigned long *val);
+int parse_options(int argc, char **argv);
 
 // Headers for usb.c:
-int init_usb(int pollfd, int max_size);
+int init_usb(int pollfd, int max_size, int shard);
+int usb_process_devices(void);
 int cancel_all(struct piperendpoint *xep);
 int try_queue_bulkin(struct piperendpoint *xep);
 int try_queue_bulkout(struct piperendpoint *xep,
 		      boolean try_complete);
+void fifo_open_resize(struct piperendpoint *xep);
+int endpoint_activate(struct piperendpoint *xep);
+void endpoint_deactivate(struct piperendpoint *xep);
+boolean fifo_full(struct piperendpoint *xep);
 
 void insert_list(struct pipertd *new_entry,
 		 struct pipertd *after_entry);
@@ -121,6 +478,26 @@ static inline int empty_list(struct pipertd *header) {
   return header->next == header;
 }
 
+// Headers for usbsim.c:
+extern const struct pipertransport sim_transport;
+int parse_sim_options(char *s);
+
+// Headers for stats.c:
+int stats_init(int pollfd, int shard);
+void stats_register(struct piperendpoint *xep);
+void stats_unregister(struct piperendpoint *xep);
+
+// Headers for trace.c:
+int trace_init(int shard, unsigned int size);
+int trace_install_signal(void);
+
+// Headers for tap.c:
+int tap_start(void);
+struct pipertap *tap_open(uint8_t addr, char *path);
+void tap_close(struct pipertap *tap);
+void tap_record(struct pipertap *tap, void *data, unsigned int len);
+uint64_t tap_dropped(struct pipertap *tap);
+
 // Headers for usberrors.c:
 void print_usberr(int errnum, char *msg);
 void print_xfererr(int errnum, char *msg);
@@ -0,0 +1,773 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+
+#include "usbpiper.h"
+
+// A simulated USB device, which is served instead of a real one with
+// --simulate. It has a bulk IN endpoint (0x81) and a bulk OUT endpoint
+// (0x02). IN transfers return a running byte counter, so the data's
+// integrity can be verified, and OUT data is discarded.
+//
+// The transfers share a bus of a given bandwidth, and complete in order of
+// submission, each after a fixed latency on top of its share of the bus.
+// Every Nth IN transfer may be made short, and every Nth transfer may be
+// failed. Completions are driven by a timerfd in the shard's epoll fd, and
+// delivered through the transfer's callback, just like libusb does.
+//
+// Instead of the counter, the IN endpoint may replay a capture recorded
+// with --tap, and the OUT data may be written into a file, or compared with
+// a reference capture. See "Replay" below.
+//
+// With iso=1, the device has a second interface, with an isochronous IN
+// endpoint (0x83) of 192 bytes per packet in alternate setting 1 and 1024
+// bytes in setting 2 (and none in setting 0). The settings are listed in
+// the order 0, 2, 1, so a setting's index in altsetting[] isn't its
+// number. The packets carry a byte counter of their own, and are as long
+// as the current setting's packet size, except that every 8th is half as
+// long. A packet buffer smaller than the packet size fails with babble,
+// like on real hardware.
+
+struct simparams {
+  uint64_t bandwidth; // Bytes per second, 0 = unlimited
+  uint64_t latency_ns; // Added to each transfer
+  unsigned long short_every; // Every Nth IN transfer is short, 0 = never
+  unsigned long error_every; // Every Nth transfer fails, 0 = never
+  unsigned long unplug_after; // Device departs after N transfers, 0 = never
+};
+
+static struct simparams sim = {
+  .bandwidth = 40 << 20,
+  .latency_ns = 125000,
+};
+
+struct simtransfer {
+  struct simtransfer *next;
+  uint64_t due; // piper_now() at completion
+  boolean pending;
+  boolean canceled;
+  struct libusb_transfer transfer; // Must be last (iso_packet_desc[])
+};
+
+// Not const: A replayed IN endpoint takes the address from the capture
+static struct libusb_endpoint_descriptor sim_endpoints[] = {
+  { .bLength = 7, .bDescriptorType = LIBUSB_DT_ENDPOINT,
+    .bEndpointAddress = 0x81, .bmAttributes = LIBUSB_TRANSFER_TYPE_BULK,
+    .wMaxPacketSize = 512 },
+  { .bLength = 7, .bDescriptorType = LIBUSB_DT_ENDPOINT,
+    .bEndpointAddress = 0x02, .bmAttributes = LIBUSB_TRANSFER_TYPE_BULK,
+    .wMaxPacketSize = 512 },
+};
+
+static const struct libusb_interface_descriptor sim_setting = {
+  .bLength = 9,
+  .bDescriptorType = LIBUSB_DT_INTERFACE,
+  .bNumEndpoints = 2,
+  .bInterfaceClass = 0xff,
+  .endpoint = sim_endpoints,
+};
+
+#define SIM_ISO_INTERFACE 1
+#define SIM_ISO_EP 0x83
+
+static const struct libusb_endpoint_descriptor sim_iso_endpoints[] = {
+  { .bLength = 7, .bDescriptorType = LIBUSB_DT_ENDPOINT,
+    .bEndpointAddress = SIM_ISO_EP,
+    .bmAttributes = LIBUSB_TRANSFER_TYPE_ISOCHRONOUS,
+    .wMaxPacketSize = 192, .bInterval = 1 },
+  { .bLength = 7, .bDescriptorType = LIBUSB_DT_ENDPOINT,
+    .bEndpointAddress = SIM_ISO_EP,
+    .bmAttributes = LIBUSB_TRANSFER_TYPE_ISOCHRONOUS,
+    .wMaxPacketSize = 1024, .bInterval = 1 },
+};
+
+static const struct libusb_interface_descriptor sim_iso_settings[] = {
+  { .bLength = 9, .bDescriptorType = LIBUSB_DT_INTERFACE,
+    .bInterfaceNumber = SIM_ISO_INTERFACE, .bAlternateSetting = 0,
+    .bNumEndpoints = 0, .bInterfaceClass = 0xff },
+  { .bLength = 9, .bDescriptorType = LIBUSB_DT_INTERFACE,
+    .bInterfaceNumber = SIM_ISO_INTERFACE, .bAlternateSetting = 2,
+    .bNumEndpoints = 1, .bInterfaceClass = 0xff,
+    .endpoint = &sim_iso_endpoints[1] },
+  { .bLength = 9, .bDescriptorType = LIBUSB_DT_INTERFACE,
+    .bInterfaceNumber = SIM_ISO_INTERFACE, .bAlternateSetting = 1,
+    .bNumEndpoints = 1, .bInterfaceClass = 0xff,
+    .endpoint = &sim_iso_endpoints[0] },
+};
+
+static const struct libusb_interface sim_interfaces[] = {
+  { .altsetting = &sim_setting, .num_altsetting = 1 },
+  { .altsetting = sim_iso_settings, .num_altsetting = 3 },
+};
+
+// bNumInterfaces is 2 with iso=1
+static struct libusb_config_descriptor sim_config = {
+  .bLength = 9,
+  .bDescriptorType = LIBUSB_DT_CONFIG,
+  .bNumInterfaces = 1,
+  .bConfigurationValue = 1,
+  .interface = sim_interfaces,
+};
+
+static char sim_handle; // Only its address is used, as the device handle
+
+static __thread int sim_timerfd = -1;
+static __thread struct pipercallback sim_callback;
+static __thread struct simtransfer *sim_pending; // Sorted by ->due
+static __thread uint64_t sim_bus_free; // When the bus becomes idle
+static __thread unsigned long sim_count; // Transfers completed
+static __thread uint8_t sim_in_byte; // Next byte of the IN data
+static __thread uint8_t sim_iso_byte; // Next byte of the isochronous data
+static __thread unsigned long sim_iso_packets; // Sent so far
+static __thread int sim_iso_alt; // Index of the iso interface's setting
+static __thread boolean sim_unplugged;
+
+static inline struct simtransfer *sim_of(struct libusb_transfer *transfer) {
+  return (void *) ((char *) transfer - offsetof(struct simtransfer, transfer));
+}
+
+// Replay: The records of one endpoint in a capture file (see tap.h), which
+// is mapped into memory. IN transfers take their data from the replayed
+// capture, one record per transfer (or less, if it doesn't fit), and are
+// completed no earlier than the original timing, unless timing=max is
+// given. OUT data goes to the sink file and / or is compared with the
+// reference capture's OUT records.
+
+struct capture {
+  char *path;
+  unsigned char *data;
+  size_t size;
+  size_t pos; // Offset of the current record
+  uint32_t offset; // Into the current record's payload
+  uint8_t addr; // Endpoint whose records are used, 0 = the first one
+  boolean gaps; // A TAP_DROPPED record was seen
+};
+
+static struct {
+  struct capture in; // replay=PATH
+  struct capture ref; // compare=PATH
+  char *sink_path; // sink=PATH
+  int sink_fd;
+  boolean max_speed;
+  boolean loop;
+  boolean ended;
+  uint64_t t0; // Timestamp of the first record
+  uint64_t start; // piper_now() when the first record was due
+  uint64_t compared; // OUT bytes that matched the reference so far
+  boolean ref_done; // Mismatch or end of reference reported
+  boolean ready; // replay_init() was called
+} replay = { .sink_fd = -1 };
+
+static struct pipertaprecord *capture_record(struct capture *c) {
+  struct pipertaprecord *rec;
+
+  for (; c->pos + sizeof(*rec) <= c->size;
+       c->pos += sizeof(*rec) + tap_padded(rec->length)) {
+    rec = (void *) (c->data + c->pos);
+
+    if (c->addr && (rec->addr != c->addr))
+      continue;
+
+    if (rec->flags & TAP_DROPPED) {
+      if (!c->gaps)
+	WARN("Capture %s has gaps, where %u bytes and more were lost\n",
+	     c->path, rec->length);
+      c->gaps = true;
+      continue;
+    }
+
+    if (c->pos + sizeof(*rec) + rec->length > c->size)
+      break; // Truncated capture
+
+    return rec;
+  }
+
+  return NULL;
+}
+
+// Use up @len bytes of the current record's payload
+
+static void capture_consume(struct capture *c, struct pipertaprecord *rec,
+			    uint32_t len) {
+  c->offset += len;
+
+  if (c->offset >= rec->length) {
+    c->pos += sizeof(*rec) + tap_padded(rec->length);
+    c->offset = 0;
+  }
+}
+
+// Map the capture, and pick the first endpoint in direction @in if
+// c->addr wasn't given
+
+static int capture_open(struct capture *c, boolean in) {
+  struct pipertaprecord *rec;
+  struct stat st;
+  int fd;
+
+  if ((fd = open(c->path, O_RDONLY | O_CLOEXEC)) < 0) {
+    ERR("Failed to open capture file %s:\n", c->path);
+    perror("open");
+    return 1;
+  }
+
+  if (fstat(fd, &st) || (st.st_size < 8)) {
+    ERR("Capture file %s is empty or inaccessible\n", c->path);
+    close(fd);
+    return 1;
+  }
+
+  c->size = st.st_size;
+  c->data = mmap(NULL, c->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (c->data == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+
+  madvise(c->data, c->size, MADV_SEQUENTIAL);
+
+  if (memcmp(c->data, TAP_MAGIC, 8)) {
+    ERR("%s is not a capture file\n", c->path);
+    return 1;
+  }
+
+  c->pos = 8;
+
+  if (!c->addr) {
+    for (rec = capture_record(c); rec; rec = capture_record(c)) {
+      if (!(rec->addr & LIBUSB_ENDPOINT_IN) == !in) {
+	c->addr = rec->addr;
+	break;
+      }
+
+      capture_consume(c, rec, rec->length);
+    }
+
+    c->pos = 8;
+    c->gaps = false;
+  }
+
+  if (!c->addr || !capture_record(c)) {
+    ERR("Capture file %s has no %s data\n", c->path, in ? "IN" : "OUT");
+    return 1;
+  }
+
+  return 0;
+}
+
+// There's only one replay, which belongs to the shard that serves the
+// simulated device, so it's set up when the device is opened rather than
+// in sim_init(), which runs in all shards
+
+static int replay_init(void) {
+  struct pipertaprecord *rec;
+
+  if (replay.ready)
+    return 0;
+
+  replay.ready = true;
+
+  if (replay.in.path) {
+    if (capture_open(&replay.in, true))
+      return 1;
+
+    rec = capture_record(&replay.in);
+    replay.t0 = rec->timestamp;
+    sim_endpoints[0].bEndpointAddress = replay.in.addr;
+
+    INFO("Replaying endpoint %02x from %s%s\n", replay.in.addr,
+	 replay.in.path, replay.max_speed ? " at maximal speed" : "");
+  }
+
+  if (replay.ref.path) {
+    if (capture_open(&replay.ref, false))
+      return 1;
+
+    INFO("Comparing OUT data with endpoint %02x in %s\n", replay.ref.addr,
+	 replay.ref.path);
+  }
+
+  if (replay.sink_path) {
+    replay.sink_fd = open(replay.sink_path, O_WRONLY | O_CREAT | O_TRUNC |
+			  O_CLOEXEC, 0644);
+
+    if (replay.sink_fd < 0) {
+      ERR("Failed to open %s:\n", replay.sink_path);
+      perror("open");
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// When the current record is due. Returns UINT64_MAX when the capture has
+// ended, so the transfer never completes (unless canceled).
+
+static uint64_t replay_due(uint64_t now) {
+  struct pipertaprecord *rec = capture_record(&replay.in);
+
+  if (!rec && replay.loop) {
+    replay.in.pos = 8;
+    replay.in.offset = 0;
+    replay.start = 0;
+    rec = capture_record(&replay.in);
+  }
+
+  if (!rec) {
+    if (!replay.ended)
+      INFO("Replay of %s has ended\n", replay.in.path);
+    replay.ended = true;
+    return UINT64_MAX;
+  }
+
+  if (!replay.start)
+    replay.start = now - (rec->timestamp - replay.t0);
+
+  if (replay.max_speed)
+    return 0;
+
+  return replay.start + (rec->timestamp - replay.t0);
+}
+
+static void replay_fill(struct libusb_transfer *transfer) {
+  struct pipertaprecord *rec = capture_record(&replay.in);
+  uint32_t len = rec->length - replay.in.offset;
+
+  if (len > transfer->length)
+    len = transfer->length;
+
+  memcpy(transfer->buffer, (unsigned char *) &rec[1] + replay.in.offset, len);
+  capture_consume(&replay.in, rec, len);
+
+  transfer->actual_length = len;
+}
+
+static void replay_compare(unsigned char *buf, uint32_t len) {
+  struct pipertaprecord *rec;
+  uint32_t n, i;
+
+  while (len && !replay.ref_done) {
+    if (!(rec = capture_record(&replay.ref))) {
+      WARN("OUT data goes on beyond the %llu bytes in %s\n",
+	   (unsigned long long) replay.compared, replay.ref.path);
+      replay.ref_done = true;
+      return;
+    }
+
+    n = rec->length - replay.ref.offset;
+
+    if (n > len)
+      n = len;
+
+    for (i=0; i<n; i++)
+      if (buf[i] != ((unsigned char *) &rec[1])[replay.ref.offset + i]) {
+	ERR("OUT data differs from %s at byte %llu\n", replay.ref.path,
+	    (unsigned long long) replay.compared + i);
+	replay.ref_done = true;
+	return;
+      }
+
+    buf += n;
+    len -= n;
+    replay.compared += n;
+    capture_consume(&replay.ref, rec, n);
+  }
+
+  if (!replay.ref_done && !capture_record(&replay.ref)) {
+    INFO("OUT data matched all %llu bytes in %s\n",
+	 (unsigned long long) replay.compared, replay.ref.path);
+    replay.ref_done = true;
+  }
+}
+
+static void replay_out(unsigned char *buf, int len) {
+  if ((replay.sink_fd >= 0) && (write(replay.sink_fd, buf, len) != len)) {
+    ERR("Failed to write to %s, no more OUT data goes there\n",
+	replay.sink_path);
+    close(replay.sink_fd);
+    replay.sink_fd = -1;
+  }
+
+  if (replay.ref.data)
+    replay_compare(buf, len);
+}
+
+// Arm the timer for the earliest pending completion, or disarm it
+
+static int sim_arm(void) {
+  struct itimerspec t = { };
+
+  if (sim_pending && (sim_pending->due != UINT64_MAX)) {
+    t.it_value.tv_sec = sim_pending->due / 1000000000;
+    t.it_value.tv_nsec = sim_pending->due % 1000000000;
+  }
+
+  if (timerfd_settime(sim_timerfd, TFD_TIMER_ABSTIME, &t, NULL)) {
+    perror("timerfd_settime");
+    return 1;
+  }
+
+  return 0;
+}
+
+static void sim_insert(struct simtransfer *st) {
+  struct simtransfer **p = &sim_pending;
+
+  while (*p && ((*p)->due <= st->due))
+    p = &(*p)->next;
+
+  st->next = *p;
+  *p = st;
+}
+
+static void sim_remove(struct simtransfer *st) {
+  struct simtransfer **p = &sim_pending;
+
+  while (*p && (*p != st))
+    p = &(*p)->next;
+
+  if (*p)
+    *p = st->next;
+}
+
+static void sim_fill(unsigned char *buf, int len, uint8_t *counter) {
+  static unsigned char pattern[512];
+  int i, chunk;
+
+  if (!pattern[1])
+    for (i=0; i<sizeof(pattern); i++)
+      pattern[i] = i;
+
+  while (len) {
+    chunk = (len < 256) ? len : 256;
+    memcpy(buf, &pattern[*counter], chunk);
+    *counter += chunk; // Wraps around at 256
+    buf += chunk;
+    len -= chunk;
+  }
+}
+
+// Fills the packets of an isochronous IN transfer, see iso=1 above
+
+static void sim_iso_fill(struct libusb_transfer *transfer) {
+  int size = sim_iso_settings[sim_iso_alt].bNumEndpoints ?
+    sim_iso_settings[sim_iso_alt].endpoint->wMaxPacketSize : 0;
+  int i;
+
+  transfer->actual_length = 0;
+
+  for (i=0; i<transfer->num_iso_packets; i++) {
+    struct libusb_iso_packet_descriptor *pkt = &transfer->iso_packet_desc[i];
+
+    pkt->actual_length = 0;
+
+    if (pkt->length < size) {
+      pkt->status = LIBUSB_TRANSFER_OVERFLOW;
+      continue;
+    }
+
+    pkt->status = LIBUSB_TRANSFER_COMPLETED;
+    pkt->actual_length = (sim_iso_packets++ % 8) ? size : size / 2;
+    sim_fill(libusb_get_iso_packet_buffer_simple(transfer, i),
+	     pkt->actual_length, &sim_iso_byte);
+  }
+}
+
+static void sim_complete(struct simtransfer *st) {
+  struct libusb_transfer *transfer = &st->transfer;
+
+  transfer->actual_length = 0;
+
+  if (st->canceled) {
+    transfer->status = LIBUSB_TRANSFER_CANCELLED;
+    return;
+  }
+
+  sim_count++;
+
+  if (sim.unplug_after && (sim_count >= sim.unplug_after))
+    sim_unplugged = true;
+
+  if (sim_unplugged) {
+    transfer->status = LIBUSB_TRANSFER_NO_DEVICE;
+    return;
+  }
+
+  if (sim.error_every && !(sim_count % sim.error_every)) {
+    transfer->status = LIBUSB_TRANSFER_ERROR;
+    return;
+  }
+
+  transfer->status = LIBUSB_TRANSFER_COMPLETED;
+  transfer->actual_length = transfer->length;
+
+  if (!(transfer->endpoint & LIBUSB_ENDPOINT_IN)) {
+    replay_out(transfer->buffer, transfer->actual_length);
+    return;
+  }
+
+  if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+    sim_iso_fill(transfer);
+    return;
+  }
+
+  if (replay.in.data) {
+    replay_fill(transfer);
+    return;
+  }
+
+  // A short transfer ends with a short packet
+  if (sim.short_every && !(sim_count % sim.short_every) &&
+      (transfer->length > 1))
+    transfer->actual_length = transfer->length / 2 + 1;
+
+  sim_fill(transfer->buffer, transfer->actual_length, &sim_in_byte);
+}
+
+static int sim_event(uint32_t events, void *private) {
+  struct simtransfer *st;
+  uint64_t ticks, now;
+
+  if ((read(sim_timerfd, &ticks, sizeof(ticks)) < 0) && (errno != EAGAIN)) {
+    perror("Failed to read from simulation timer");
+    return 1;
+  }
+
+  now = piper_now();
+
+  // Transfers submitted by the callbacks are due no earlier than now, so
+  // they're completed on the next round, not in this loop.
+
+  while (sim_pending && (sim_pending->due < now)) {
+    st = sim_pending;
+    sim_pending = st->next;
+
+    // A replayed IN transfer waits for its record to be due
+    if (replay.in.data && !st->canceled &&
+	(st->transfer.endpoint & LIBUSB_ENDPOINT_IN)) {
+      uint64_t due = replay_due(now);
+
+      if (due >= now) {
+	st->due = due;
+	sim_insert(st);
+	continue;
+      }
+    }
+
+    st->pending = false;
+
+    sim_complete(st);
+    st->transfer.callback(&st->transfer);
+  }
+
+  return sim_arm();
+}
+
+static int sim_init(int pollfd) {
+  struct epoll_event event;
+
+  sim_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+
+  if (sim_timerfd < 0) {
+    perror("timerfd_create");
+    return 1;
+  }
+
+  sim_callback.callback = sim_event;
+  sim_callback.private = NULL;
+
+  event.events = EPOLLIN;
+  event.data.ptr = &sim_callback;
+
+  if (epoll_ctl(pollfd, EPOLL_CTL_ADD, sim_timerfd, &event)) {
+    perror("epoll_ctl");
+    return 1;
+  }
+
+  INFO("Simulated USB device: %llu bytes/s, %llu us per transfer\n",
+       (unsigned long long) sim.bandwidth,
+       (unsigned long long) sim.latency_ns / 1000);
+
+  return 0;
+}
+
+static struct libusb_transfer *sim_alloc_transfer(int iso_packets) {
+  struct simtransfer *st;
+
+  st = calloc(1, sizeof(*st) +
+	      iso_packets * sizeof(struct libusb_iso_packet_descriptor));
+
+  return st ? &st->transfer : NULL;
+}
+
+static void sim_free_transfer(struct libusb_transfer *transfer) {
+  free(sim_of(transfer));
+}
+
+static int sim_submit(struct libusb_transfer *transfer) {
+  struct simtransfer *st = sim_of(transfer);
+  uint64_t now = piper_now();
+  uint64_t start = (sim_bus_free > now) ? sim_bus_free : now;
+
+  if (sim_unplugged)
+    return LIBUSB_ERROR_NO_DEVICE;
+
+  if (st->pending)
+    return LIBUSB_ERROR_BUSY;
+
+  sim_bus_free = start;
+
+  if (sim.bandwidth)
+    sim_bus_free += transfer->length * 1000000000ULL / sim.bandwidth;
+
+  st->due = sim_bus_free + sim.latency_ns;
+  st->pending = true;
+  st->canceled = false;
+
+  sim_insert(st);
+
+  return sim_arm() ? LIBUSB_ERROR_OTHER : 0;
+}
+
+// Like libusb, the transfer is completed as canceled later on, from the
+// event loop, and not from within this function.
+
+static int sim_cancel(struct libusb_transfer *transfer) {
+  struct simtransfer *st = sim_of(transfer);
+
+  if (!st->pending || st->canceled)
+    return LIBUSB_ERROR_NOT_FOUND;
+
+  sim_remove(st);
+  st->canceled = true;
+  st->due = piper_now();
+  sim_insert(st);
+
+  return sim_arm() ? LIBUSB_ERROR_OTHER : 0;
+}
+
+static int sim_open(struct piperdevice *device) {
+  if (replay_init())
+    return LIBUSB_ERROR_IO;
+
+  device->handle = (libusb_device_handle *) &sim_handle;
+  device->cfg = &sim_config;
+
+  return 0;
+}
+
+static void sim_close(struct piperdevice *device) {
+}
+
+static void sim_free_config(struct libusb_config_descriptor *cfg) {
+}
+
+static int sim_set_alt(struct piperinterface *intf, int alt) {
+  int i;
+
+  if (intf->number != SIM_ISO_INTERFACE)
+    return 0;
+
+  for (i=0; i<intf->desc->num_altsetting; i++)
+    if (sim_iso_settings[i].bAlternateSetting == alt) {
+      sim_iso_alt = i;
+      return 0;
+    }
+
+  return LIBUSB_ERROR_NOT_FOUND;
+}
+
+// Like libusb_transport_claim(), which sets the initial alternate setting
+
+static int sim_claim_interface(struct piperinterface *intf) {
+  return sim_set_alt(intf, intf->alt);
+}
+
+const struct pipertransport sim_transport = {
+  .name = "sim",
+  .init = sim_init,
+  .alloc_transfer = sim_alloc_transfer,
+  .free_transfer = sim_free_transfer,
+  .submit = sim_submit,
+  .cancel = sim_cancel,
+  .open = sim_open,
+  .close = sim_close,
+  .free_config = sim_free_config,
+  .claim_interface = sim_claim_interface,
+  .set_alt = sim_set_alt,
+};
+
+// Parse the argument of --simulate, e.g. "bandwidth=200M,latency=50,short=10"
+// or "replay=/tmp/ep81.cap,timing=max"
+
+int parse_sim_options(char *s) {
+  char *tok, *eq;
+  unsigned long val;
+
+  for (tok = strtok(s, ","); tok; tok = strtok(NULL, ",")) {
+    if (!(eq = strchr(tok, '=')))
+      goto err;
+
+    *eq = 0;
+
+    // The parameters with a string value. Pointers into argv are kept.
+
+    if (!strcmp(tok, "replay")) {
+      replay.in.path = eq + 1;
+      continue;
+    } else if (!strcmp(tok, "compare")) {
+      replay.ref.path = eq + 1;
+      continue;
+    } else if (!strcmp(tok, "sink")) {
+      replay.sink_path = eq + 1;
+      continue;
+    } else if (!strcmp(tok, "timing")) {
+      if (!strcmp(eq + 1, "max"))
+	replay.max_speed = true;
+      else if (!strcmp(eq + 1, "original"))
+	replay.max_speed = false;
+      else
+	goto err;
+      continue;
+    }
+
+    if (parse_uint(eq + 1, &val))
+      goto err;
+
+    if (!strcmp(tok, "bandwidth"))
+      sim.bandwidth = val;
+    else if (!strcmp(tok, "latency"))
+      sim.latency_ns = val * 1000ULL;
+    else if (!strcmp(tok, "short"))
+      sim.short_every = val;
+    else if (!strcmp(tok, "error"))
+      sim.error_every = val;
+    else if (!strcmp(tok, "unplug"))
+      sim.unplug_after = val;
+    else if (!strcmp(tok, "iso"))
+      sim_config.bNumInterfaces = (val != 0) ? 2 : 1;
+    else if (!strcmp(tok, "loop"))
+      replay.loop = (val != 0);
+    else if (!strcmp(tok, "ep"))
+      replay.in.addr = val | LIBUSB_ENDPOINT_IN;
+    else
+      goto err;
+  }
+
+  return 0;
+
+ err:
+  ERR("Invalid simulation parameter \"%s\"\n", tok);
+  return 1;
+}